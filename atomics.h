@@ -0,0 +1,26 @@
+#ifndef ATOMICS_H
+#define ATOMICS_H
+// The few atomic operations needed by the lock-free code (queue.c, pool.c),
+// for MSVC and for gcc/mingw. This does not depend on windows.h.
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+typedef __int64 atomic64;
+// on MSVC, volatile accesses have acquire/release semantics
+#define xchg_ptr(p,v) _InterlockedExchangePointer((void *volatile*)(p),(v))
+#define cas32(p,old,v) (_InterlockedCompareExchange((volatile long*)(p),(long)(v),(long)(old)) == (long)(old))
+#define cas64(p,old,v) (_InterlockedCompareExchange64((volatile __int64*)(p),(v),(old)) == (old))
+#define atomic_inc(p) _InterlockedIncrement((volatile long*)(p))
+#define load_acquire(p) (*(p))
+#define store_release(p,v) (*(p) = (v))
+#else
+typedef long long atomic64;
+#define xchg_ptr(p,v) __atomic_exchange_n((p),(v),__ATOMIC_SEQ_CST)
+#define cas32(p,old,v) __sync_bool_compare_and_swap((p),(old),(v))
+#define cas64(p,old,v) __sync_bool_compare_and_swap((p),(old),(v))
+#define atomic_inc(p) __sync_add_and_fetch((p),1)
+#define load_acquire(p) __atomic_load_n((p),__ATOMIC_ACQUIRE)
+#define store_release(p,v) __atomic_store_n((p),(v),__ATOMIC_RELEASE)
+#endif
+
+#endif
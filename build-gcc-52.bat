@@ -3,4 +3,11 @@ set LUA_DIR=D:\dev\lua\lua-5.2.0\src
 set CFLAGS=-c -g -DPSAPI_VERSION=1  -I"%LUA_DIR%"
 gcc %CFLAGS% winapi.c
 gcc %CFLAGS% wutils.c
-gcc -g -shared winapi.o wutils.o "%LUA_DIR%\lua52.dll" -lpsapi -lMpr -o winapi.dll
\ No newline at end of file
+gcc %CFLAGS% utf.c
+gcc %CFLAGS% queue.c
+gcc %CFLAGS% pool.c
+gcc %CFLAGS% reactor.c
+gcc %CFLAGS% wheel.c
+gcc %CFLAGS% timing.c
+gcc %CFLAGS% ring.c
+gcc -g -shared winapi.o wutils.o utf.o queue.o pool.o reactor.o wheel.o timing.o ring.o "%LUA_DIR%\lua52.dll" -lpsapi -lMpr -o winapi.dll
\ No newline at end of file
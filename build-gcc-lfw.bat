@@ -3,4 +3,11 @@ set LUA_DIR=C:\Program Files\Lua\5.1
 set CFLAGS=-Os -DPSAPI_VERSION=1  -I"%LUA_DIR%\include"
 gcc -c %CFLAGS% winapi.c
 gcc -c %CFLAGS% wutils.c
-gcc -Wl,-s -shared winapi.o wutils.o -L"%LUA_DIR%/lib"  -lpsapi -lMpr -llua5.1 -lmsvcr80  -o winapi.dll
\ No newline at end of file
+gcc -c %CFLAGS% utf.c
+gcc -c %CFLAGS% queue.c
+gcc -c %CFLAGS% pool.c
+gcc -c %CFLAGS% reactor.c
+gcc -c %CFLAGS% wheel.c
+gcc -c %CFLAGS% timing.c
+gcc -c %CFLAGS% ring.c
+gcc -Wl,-s -shared winapi.o wutils.o utf.o queue.o pool.o reactor.o wheel.o timing.o ring.o -L"%LUA_DIR%/lib"  -lpsapi -lMpr -llua5.1 -lmsvcr80  -o winapi.dll
\ No newline at end of file
@@ -5,4 +5,11 @@ set LUA_LIB=c:\users\steve\luadist\lib\liblua51.dll.a
 set CFLAGS=-c -O1 -DPSAPI_VERSION=1  -I"%LUA_INCLUDE%"
 gcc %CFLAGS% winapi.c
 gcc %CFLAGS% wutils.c
-gcc -Wl,-s -shared winapi.o wutils.o "%LUA_LIB%" -lpsapi -lMpr -o winapi.dll
\ No newline at end of file
+gcc %CFLAGS% utf.c
+gcc %CFLAGS% queue.c
+gcc %CFLAGS% pool.c
+gcc %CFLAGS% reactor.c
+gcc %CFLAGS% wheel.c
+gcc %CFLAGS% timing.c
+gcc %CFLAGS% ring.c
+gcc -Wl,-s -shared winapi.o wutils.o utf.o queue.o pool.o reactor.o wheel.o timing.o ring.o "%LUA_LIB%" -lpsapi -lMpr -o winapi.dll
\ No newline at end of file
@@ -2,4 +2,11 @@ set LUA_DIR=C:\Program Files\Lua\5.1
 set CFLAGS= /O1 /DPSAPI_VERSION=1  /I"%LUA_DIR%\include"
 cl /nologo -c %CFLAGS% winapi.c
 cl /nologo -c %CFLAGS% wutils.c
-link /nologo winapi.obj wutils.obj /EXPORT:luaopen_winapi  /LIBPATH:"%LUA_DIR%\lib" msvcrt.lib kernel32.lib user32.lib psapi.lib advapi32.lib shell32.lib  Mpr.lib lua5.1.lib  /DLL /OUT:winapi.dll
+cl /nologo -c %CFLAGS% utf.c
+cl /nologo -c %CFLAGS% queue.c
+cl /nologo -c %CFLAGS% pool.c
+cl /nologo -c %CFLAGS% reactor.c
+cl /nologo -c %CFLAGS% wheel.c
+cl /nologo -c %CFLAGS% timing.c
+cl /nologo -c %CFLAGS% ring.c
+link /nologo winapi.obj wutils.obj utf.obj queue.obj pool.obj reactor.obj wheel.obj timing.obj ring.obj /EXPORT:luaopen_winapi  /LIBPATH:"%LUA_DIR%\lib" msvcrt.lib kernel32.lib user32.lib psapi.lib advapi32.lib shell32.lib  Mpr.lib lua5.1.lib  /DLL /OUT:winapi.dll
@@ -0,0 +1,33 @@
+-- throughput of winapi.encode for various sizes of input.
+-- Each size is converted UTF-8 -> UTF-16 -> UTF-8 and checked.
+require 'winapi'
+local UTF8, UTF16 = winapi.CP_UTF8, winapi.CP_UTF16
+local encode = winapi.encode
+
+local samples = {
+  ascii = 'the quick brown fox jumps over the lazy dog\r\n',
+  greek = winapi.utf8_expand '#03BB#03BC#03BD #03BE#03BF#03C0 abc\r\n',
+}
+
+local function bench (name, sample, size)
+  local s = sample:rep(math.ceil(size/#sample)):sub(1,size)
+  -- don't cut a UTF-8 sequence in half
+  while #s > 0 and s:byte(#s) >= 0x80 do s = s:sub(1,-2) end
+  local reps = math.max(1,math.floor(2^24/#s))
+  local w, u
+  local t = os.clock()
+  for i = 1,reps do
+    w = encode(UTF8,UTF16,s)
+    u = encode(UTF16,UTF8,w)
+  end
+  t = os.clock() - t
+  assert(u == s, 'round trip failed')
+  local mb = 2*reps*#s/2^20
+  print(('%-6s %9d bytes %6d reps %8.1f MB/s'):format(name,#s,reps,mb/math.max(t,1e-6)))
+end
+
+for _,name in ipairs {'ascii','greek'} do
+  for _,size in ipairs {16,256,4096,65536,2^20,8*2^20} do
+    bench(name,samples[name],size)
+  end
+end
@@ -0,0 +1,39 @@
+-- splitting process output into lines: in Lua, from the chunks that
+-- File:read returns, or in C with File:lines.
+-- usage: lua bench-lines.lua [command]
+require 'winapi'
+local cmd = arg[1] or 'cmd /c dir /s /b %WINDIR%\\System32'
+
+local function lua_lines(f)
+  local n, rest = 0, ''
+  local chunk = f:read()
+  while chunk do
+    chunk = rest..chunk
+    for line in chunk:gmatch '([^\n]*)\n' do
+      n = n + 1
+    end
+    rest = chunk:match '[^\n]*$'
+    chunk = f:read()
+  end
+  if #rest > 0 then n = n + 1 end
+  return n
+end
+
+local function c_lines(f)
+  local n = 0
+  for line in f:lines() do
+    n = n + 1
+  end
+  return n
+end
+
+for _,test in ipairs {{'lua',lua_lines},{'lines',c_lines},{'lua',lua_lines},{'lines',c_lines}} do
+  local P,f = winapi.spawn_process(cmd)
+  collectgarbage()
+  local mem, t = collectgarbage 'count', winapi.clock()
+  local n = test[2](f)
+  t = (winapi.clock() - t)/1e6
+  print(('%-6s %d lines in %.1f ms, %.0f KB of garbage'):format(test[1],n,t,collectgarbage 'count' - mem))
+  P:wait()
+  f:close()
+end
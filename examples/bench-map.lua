@@ -0,0 +1,54 @@
+-- scanning a big file: reading it all into a string with io.read,
+-- or mapping it with winapi.map_file, which only makes strings for what
+-- is asked for.
+-- usage: lua bench-map.lua file [text]
+require 'winapi'
+local file, text = arg[1], arg[2] or 'ERROR'
+if not file then return print 'usage: lua bench-map.lua file [text]' end
+
+local function io_find()
+  local f = assert(io.open(file,'rb'))
+  local s = f:read '*a'
+  f:close()
+  local n, i = 0, 1
+  while true do
+    local _,j = s:find(text,i,true)
+    if not j then break end
+    n, i = n + 1, j + 1
+  end
+  return n
+end
+
+local function map_find()
+  local m = assert(winapi.map_file(file))
+  local n, i = 0, 1
+  while true do
+    local _,j = m:find(text,i)
+    if not j then break end
+    n, i = n + 1, j + 1
+  end
+  m:close()
+  return n
+end
+
+local function io_lines()
+  local n = 0
+  for line in io.lines(file) do n = n + 1 end
+  return n
+end
+
+local function map_lines()
+  local m = assert(winapi.map_file(file))
+  local n = 0
+  for line in m:lines() do n = n + 1 end
+  m:close()
+  return n
+end
+
+for _,test in ipairs {{'io find',io_find},{'map find',map_find},{'io lines',io_lines},{'map lines',map_lines}} do
+  collectgarbage()
+  local t = winapi.clock()
+  local n = test[2]()
+  t = (winapi.clock() - t)/1e6
+  print(('%-10s %d in %.1f ms'):format(test[1],n,t))
+end
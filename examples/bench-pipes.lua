@@ -0,0 +1,79 @@
+-- load test for the pipe server: N clients connect at once, and then
+-- exchange messages of several sizes with it. The server keeps a pool
+-- of instances and echoes each message back with write_async.
+-- Prints CSV, one line per measurement, so that runs can be compared:
+-- connections/sec, round-trip latency percentiles (one message at a time)
+-- and messages/sec (every client with a message in flight).
+-- usage: lua bench-pipes.lua [clients] [messages] [sizes...]
+require 'winapi'
+local nclients = tonumber(arg[1]) or 32
+local nmessages = tonumber(arg[2]) or 2000
+local sizes = {}
+for i = 3,#arg do sizes[#sizes+1] = tonumber(arg[i]) end
+if #sizes == 0 then sizes = {16,256,4096,65536} end
+local pipename = '\\\\.\\pipe\\winapi-bench'
+
+local served = 0
+local server = winapi.make_pipe_server(function(f,err)
+  if not f then
+    io.stderr:write('server failed: ',err,'\n')
+    os.exit(1)
+  end
+  served = served + 1
+  f:read_async(function(msg)
+    if msg then f:write_async(msg,nil,true) end
+  end, true)
+end, pipename, {instances = math.min(nclients,63), buffer = 65536})
+winapi.sleep(50)
+
+local function report(test,size,count,secs,sw)
+  local p50, p99, p999 = '', '', ''
+  if sw then
+    p50 = ('%.1f'):format(sw:percentile(50)/1e3)
+    p99 = ('%.1f'):format(sw:percentile(99)/1e3)
+    p999 = ('%.1f'):format(sw:percentile(99.9)/1e3)
+  end
+  print(('%s,%d,%d,%d,%.4f,%.0f,%s,%s,%s'):format(test,nclients,size,count,secs,count/secs,p50,p99,p999))
+end
+
+print 'test,clients,size,count,seconds,per_sec,p50_us,p99_us,p999_us'
+
+-- connect them all; when every instance is taken, wait for the server to
+-- put more up, and count it as part of the cost
+local clients = {}
+local t = winapi.clock()
+for i = 1,nclients do
+  local f = winapi.open_pipe(pipename)
+  while not f do
+    winapi.sleep(0)
+    f = winapi.open_pipe(pipename)
+  end
+  clients[i] = f
+end
+while served < nclients do winapi.sleep(0) end
+report('connect',0,nclients,(winapi.clock() - t)/1e9)
+
+for _,size in ipairs(sizes) do
+  local msg = ('x'):rep(size)
+  local sw = winapi.stopwatch()
+  for k = 1,nmessages do
+    local f = clients[(k - 1) % nclients + 1]
+    sw:start()
+    f:write_message(msg)
+    local reply = f:read_message()
+    sw:stop()
+    assert(reply and #reply == size,'bad reply')
+  end
+  report('latency',size,nmessages,sw:stats().mean*nmessages/1e9,sw)
+
+  local rounds = math.ceil(nmessages/nclients)
+  t = winapi.clock()
+  for r = 1,rounds do
+    for _,f in ipairs(clients) do f:write_message(msg) end
+    for _,f in ipairs(clients) do assert(f:read_message()) end
+  end
+  report('throughput',size,rounds*nclients,(winapi.clock() - t)/1e9)
+end
+
+for _,f in ipairs(clients) do f:close() end
+server:kill()
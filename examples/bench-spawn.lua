@@ -0,0 +1,70 @@
+-- how many processes a second spawn_process can start, and how long the
+-- call itself takes, for the command-line form and the options form with
+-- different kinds of standard streams. Each process is waited for before the
+-- next is started, except for 'batch' which starts them all first.
+-- Prints CSV, one line per test.
+-- usage: lua bench-spawn.lua [count] [program args...]
+require 'winapi'
+local count = tonumber(arg[1]) or 200
+local argv = {}
+for i = 2,#arg do argv[#argv+1] = arg[i] end
+if #argv == 0 then argv = {'cmd','/c','exit'} end
+local command = table.concat(argv,' ')
+
+print 'test,count,seconds,per_sec,spawn_p50_us,spawn_p99_us'
+
+local function report(test,secs,sw)
+  print(('%s,%d,%.4f,%.1f,%.1f,%.1f'):format(test,count,secs,count/secs,
+    sw:percentile(50)/1e3,sw:percentile(99)/1e3))
+end
+
+local function run(test,spawn)
+  local sw = winapi.stopwatch()
+  local t = winapi.clock()
+  for i = 1,count do
+    sw:start()
+    local P,f,err = spawn()
+    sw:stop()
+    if not P then
+      io.stderr:write(test,': ',f,'\n')
+      os.exit(1)
+    end
+    P:wait()
+    P:close()
+    if f then f:close() end
+    if err then err:close() end
+  end
+  report(test,(winapi.clock() - t)/1e9,sw)
+end
+
+run('command',function()
+  return winapi.spawn_process(command)
+end)
+
+run('argv-pipes',function()
+  return winapi.spawn_process {argv = argv}
+end)
+
+run('argv-null',function()
+  return winapi.spawn_process {argv = argv, stdin = 'null', stdout = 'null', stderr = 'null'}
+end)
+
+run('argv-env',function()
+  return winapi.spawn_process {argv = argv, stdin = 'null', stdout = 'null', stderr = 'null',
+    env = {BENCH_SPAWN = '1'}}
+end)
+
+-- start them all, and then wait for them all
+local sw = winapi.stopwatch()
+local procs = {}
+local t = winapi.clock()
+for i = 1,count do
+  sw:start()
+  procs[i] = winapi.spawn_process {argv = argv, stdin = 'null', stdout = 'null', stderr = 'null'}
+  sw:stop()
+end
+for _,P in ipairs(procs) do
+  P:wait()
+  P:close()
+end
+report('batch',(winapi.clock() - t)/1e9,sw)
@@ -0,0 +1,38 @@
+-- timing code with a stopwatch: each lap is added to statistics kept in C,
+-- so timing a hot loop allocates nothing per sample.
+-- usage: lua bench-stopwatch.lua [n]
+require 'winapi'
+local n = tonumber(arg[1]) or 100000
+
+local function report(name,sw)
+  local s = sw:stats()
+  print(('%-8s n %d  mean %.0f  p50 %d  p90 %d  p99 %d  max %d ns'):format(
+    name, s.count, s.mean, s.p50, s.p90, s.p99, s.max))
+end
+
+-- the cost of timing nothing at all
+local sw = winapi.stopwatch(true)
+for i = 1,n do sw:lap() end
+report('empty',sw)
+
+sw = winapi.stopwatch()
+local parts = {}
+for i = 1,n do
+  sw:start()
+  parts[i % 100 + 1] = ('%d:%s'):format(i,'x')
+  sw:stop()
+end
+report('format',sw)
+
+sw = winapi.stopwatch()
+for i = 1,n/100 do
+  sw:start()
+  local s = table.concat(parts,',')
+  sw:stop()
+end
+report('concat',sw)
+print(sw)
+
+local t = winapi.clock()
+winapi.sleep(10)
+print(('sleep(10) took %.3f ms'):format((winapi.clock() - t)/1e6))
@@ -0,0 +1,40 @@
+-- timer jitter: how late do timers fire, with 1000 or 10000 of them going?
+-- With slack, timers fire later but together, and the machine wakes up less.
+-- usage: lua bench-timers.lua [ntimers] [secs] [slack]
+-- (on Windows, os.clock is wall-clock time)
+require 'winapi'
+io.stdout:setvbuf 'no'
+local clock = os.clock
+local ntimers, secs = tonumber(arg[1]) or 1000, tonumber(arg[2]) or 5
+local slack = tonumber(arg[3]) or 0
+winapi.use_dispatch()
+
+local late, n = {}, 0
+local finished = false
+for i = 1,ntimers do
+  local period = 50 + i % 50
+  local last = clock()
+  winapi.make_timer(period,function()
+    local t = clock()
+    n = n + 1
+    late[n] = (t - last)*1000 - period
+    last = t
+    return finished
+  end,nil,slack)
+end
+
+winapi.make_timer(secs*1000,function()
+  finished = true
+  winapi.stop()
+  return true
+end)
+winapi.run()
+
+table.sort(late)
+local sum = 0
+for i = 1,n do sum = sum + late[i] end
+print(('%d timers: %d fires, lateness in msec: mean %.2f p50 %.2f p99 %.2f max %.2f'):format(
+  ntimers, n, sum/n, late[math.ceil(n/2)], late[math.ceil(n*0.99)], late[n]))
+local stats = winapi.timer_stats()
+print(('slack %d msec: %d wakeups, %d timeouts, %d wakeups saved'):format(
+  slack, stats.wakeups, stats.timeouts, stats.saved))
@@ -0,0 +1,46 @@
+-- stress test: several watcher threads convert file names to UTF-8
+-- at the same time as the main thread is converting text.
+require 'winapi'
+io.stdout:setvbuf 'no'
+local U = winapi.utf8_expand
+winapi.set_encoding(winapi.CP_UTF8)
+
+local dir = 'bench-watch-tmp'
+local nwatch, nfiles = tonumber(arg[1]) or 4, tonumber(arg[2]) or 500
+os.execute('mkdir '..dir)
+
+local count, bad = 0, 0
+local names = {}
+for i = 1,nfiles do
+  names[U('#03BB#03BC#03BD-#20AC-')..i..'.txt'] = true
+end
+
+local function on_change (action, name)
+  if action == winapi.FILE_ACTION_ADDED then
+    count = count + 1
+    if not names[name] then bad = bad + 1 end
+  end
+end
+
+local watchers = {}
+for i = 1,nwatch do
+  watchers[i] = assert(winapi.watch_for_file_changes(dir,winapi.FILE_NOTIFY_CHANGE_FILE_NAME,false,on_change))
+end
+winapi.sleep(100)
+
+local t = os.clock()
+for name in pairs(names) do
+  -- short_path creates the file, converting the name on this thread
+  os.remove(winapi.short_path(dir..'\\'..name))
+end
+-- let the watchers catch up
+local expected = nwatch*nfiles
+for i = 1,100 do
+  if count >= expected then break end
+  winapi.sleep(50)
+end
+t = os.clock() - t
+
+for i = 1,nwatch do watchers[i]:kill() end
+os.execute('rmdir '..dir)
+print(('%d watchers, %d files: %d events in %.2f sec, %d bad names'):format(nwatch,nfiles,count,t,bad))
@@ -15,58 +15,17 @@ winapi.make_pipe_server(function(f)
 end)
 --]]
 
-local wrap, yield, resume = coroutine.wrap, coroutine.yield, coroutine.resume
-
---[[
+-- each client gets a task; reading only suspends the task, not the server.
+-- The pipes are overlapped, so the waiting reads do not need a thread each.
 winapi.make_pipe_server(function(f)
-    local fun = function(f)
+    winapi.go(function(f)
         while true do
             local res = f:read()
-            if res == 'close' then break end
+            if not res or res == 'close' then break end
             f:write(res:upper())
         end
-    end
-    local co = coroutine.create(fun)
-    resume(co,fwrap(f,co))
-end)
-]]
-
---~             f:read_async(function(txt)
---~                resume(co,txt)
---~             end)
-
-function fwrap (f,co)
-    local obj = {}
-    local started
-    function obj:read ()
-        if not started then
-            f:read_async(co)
-            started = true
-        end
-        return yield()
-    end
-    function obj:write (s)
-        return f:write(s)
-    end
-    return obj
-end
-
-function winapi.make_pipe_server_async(fun)
-    winapi.make_pipe_server(function(f)
-        local co = coroutine.wrap(fun)
-        co(fwrap(f,co))
-    end)
-end
-
-winapi.make_pipe_server_async(function(f)
-    while true do
-        local res = f:read()
-        if res == 'close' then break end
-        f:write(res:upper())
-    end
-    print 'finis'
-end)
-
+        print 'finis'
+    end,f)
+end, nil, true)
 
 winapi.sleep(-1)
-
@@ -0,0 +1,20 @@
+-- streaming from a serial port: the reads are overlapped, so no thread is
+-- needed, and what comes in is collected in C and passed on in big chunks.
+-- usage: lua serial-stream.lua COM3 [baud]
+require 'winapi'
+local port, baud = arg[1] or 'COM3', arg[2] or '921600'
+local f,e = winapi.open_serial(port..' baud='..baud..' data=8 parity=n stop=1',
+  {overlapped = true, timeout = 20, rx_queue = 65536})
+if not f then return print('error',e) end
+
+local total, calls = 0, 0
+f:read_async(function(data)
+  if data == '' then return print 'port closed' end
+  total = total + #data
+  calls = calls + 1
+end, {high_water = 8192, latency = 50})
+
+winapi.make_timer(1000,function()
+  print(('%d bytes in %d callbacks'):format(total,calls))
+end)
+winapi.sleep(-1)
@@ -0,0 +1,30 @@
+-- a decoder converts text that arrives in pieces, even if a piece
+-- ends in the middle of a character.
+require 'winapi'
+local UTF8, UTF16 = winapi.CP_UTF8, winapi.CP_UTF16
+
+local text = winapi.utf8_expand '#03BB#03BC#03BD and #20AC, in UTF-8'
+local wtext = winapi.encode(UTF8,UTF16,text)
+
+-- feed the text n bytes at a time
+local function chunked (e_in, e_out, s, n)
+  local d = winapi.decoder(e_in,e_out)
+  local out = {}
+  for i = 1,#s,n do
+    out[#out+1] = d:feed(s:sub(i,i+n-1))
+  end
+  out[#out+1] = d:finish()
+  return table.concat(out)
+end
+
+for n = 1,7 do
+  assert(chunked(UTF8,UTF16,text,n) == wtext)
+  assert(chunked(UTF16,UTF8,wtext,n) == text)
+  assert(chunked(UTF8,UTF8,text,n) == text)
+end
+
+-- an incomplete sequence at the end becomes U+FFFD
+local d = winapi.decoder(UTF8,UTF8)
+assert(d:feed('abc\206') == 'abc')
+assert(d:finish() == winapi.utf8_expand '#FFFD')
+print 'ok'
@@ -0,0 +1,22 @@
+-- callbacks from background threads are queued and run on the main thread.
+require 'winapi'
+io.stdout:setvbuf 'no'
+
+winapi.use_dispatch()
+
+local ticks = {a = 0, b = 0}
+local ta = winapi.make_timer(100,function()
+  ticks.a = ticks.a + 1
+end)
+local tb = winapi.make_timer(250,function()
+  ticks.b = ticks.b + 1
+  print('a',ticks.a,'b',ticks.b)
+  if ticks.b == 4 then winapi.stop() end
+end)
+
+winapi.run()
+ta:kill()
+tb:kill()
+
+-- dispatch() waits for at least one callback, or the timeout
+print(winapi.dispatch(-1))
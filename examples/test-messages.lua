@@ -0,0 +1,19 @@
+require 'winapi'
+
+-- messages over a pipe: each one arrives whole, however big it is and
+-- however the pipe splits it up.
+winapi.make_pipe_server(function(f)
+    f:read_async(function(msg,err)
+        if not msg then return print('client gone',err) end
+        f:write_message(('%d bytes'):format(#msg))
+    end, true)
+end)
+
+winapi.sleep(100)
+local f = assert(winapi.open_pipe())
+for _,msg in ipairs {'', 'hello', ('x'):rep(100000), 'bye\0with a nul'} do
+    f:write_message(msg)
+    print(f:read_message())
+end
+f:close()
+winapi.sleep(100)
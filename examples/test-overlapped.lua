@@ -0,0 +1,33 @@
+require 'winapi'
+
+-- an echo server where no client gets a thread of its own: the clients'
+-- files are overlapped, so their reads and writes are all waited for by
+-- the one background thread.
+local clients = 0
+
+winapi.make_pipe_server(function(f)
+    clients = clients + 1
+    print('client',clients)
+    f:read_async(function(s)
+        if s == '' then
+            print 'client gone'
+        else
+            f:write_async(s:upper(),function(n,err)
+                if not n then print('write failed',err) end
+            end)
+        end
+    end)
+end, nil, true)
+
+-- and a client, which also reads and writes in the background
+winapi.sleep(100)
+local f = assert(winapi.open_pipe(nil,true))
+f:read_async(function(s)
+    if s ~= '' then print('got',s) end
+end)
+for i = 1,5 do
+    f:write_async('hello '..i)
+    winapi.sleep(100)
+end
+f:close()
+winapi.sleep(200)
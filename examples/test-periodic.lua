@@ -0,0 +1,31 @@
+-- periodic timers keep to their deadlines, however long the callback takes;
+-- an ordinary timer waits its interval after each callback, and drifts.
+-- usage: lua test-periodic.lua [msec] [secs]
+require 'winapi'
+io.stdout:setvbuf 'no'
+local msec, secs = tonumber(arg[1]) or 10, tonumber(arg[2]) or 5
+local function busy(ms) -- a callback which takes some time
+  local t = os.clock() + ms/1000
+  while os.clock() < t do end
+end
+
+local plain, skip, catchup, missed = 0, 0, 0, 0
+winapi.make_timer(msec,function()
+  plain = plain + 1
+  busy(2)
+end)
+winapi.make_timer(msec,function(late)
+  skip = skip + 1
+  missed = missed + late
+end,'skip')
+winapi.make_timer(msec,function(late)
+  catchup = catchup + 1
+end,'catchup')
+
+winapi.sleep(secs*1000)
+local expected = math.floor(secs*1000/msec)
+print(('expected %d calls'):format(expected))
+print(('plain   %d (drifted by %d intervals)'):format(plain,expected - plain))
+print(('skip    %d, plus %d missed'):format(skip,missed))
+print(('catchup %d'):format(catchup))
+os.exit()
@@ -0,0 +1,40 @@
+require 'winapi'
+
+-- a pipe server with a pool of instances, so that many clients can
+-- connect at once; each client is echoed back in upper case.
+-- usage: lua test-pipe-pool.lua [clients]
+local nclients = tonumber(arg[1]) or 200
+local served = 0
+
+winapi.make_pipe_server(function(f,err)
+    if not f then return print('server failed',err) end
+    served = served + 1
+    f:read_async(function(s)
+        if s ~= '' then f:write_async(s:upper()) end
+    end)
+end, nil, {instances = 16, buffer = 65536})
+
+winapi.sleep(100)
+
+local t = winapi.clock()
+local clients = {}
+for i = 1,nclients do
+    local f,err = winapi.open_pipe(nil,true)
+    -- the server needs a moment to replace the instances which were taken
+    while not f do
+        winapi.sleep(1)
+        f,err = winapi.open_pipe(nil,true)
+    end
+    clients[i] = f
+end
+print(('%d clients connected in %.1f ms'):format(nclients,(winapi.clock() - t)/1e6))
+
+for i,f in ipairs(clients) do
+    f:write('hello '..i)
+end
+local ok = 0
+for i,f in ipairs(clients) do
+    if f:read() == 'HELLO '..i then ok = ok + 1 end
+    f:close()
+end
+print('served',served,'echoed',ok)
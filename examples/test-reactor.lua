@@ -0,0 +1,26 @@
+-- hundreds of timers and waits, all served by the one reactor thread.
+-- Compare the thread count in Task Manager with the number of timers!
+local W = require 'winapi'
+io.stdout:setvbuf 'no'
+local N = tonumber(arg[1]) or 500
+
+local events, fired, signalled = {}, 0, 0
+for i = 1,N do
+    events[i] = W.event()
+    events[i]:wait_async(function(s)
+        signalled = signalled + 1
+    end)
+end
+
+for i = 1,N do
+    W.make_timer(10 + i % 50,function()
+        fired = fired + 1
+        events[i]:signal()
+        return true -- just the once
+    end)
+end
+
+local t = W.make_timer(2000,function() end) -- will be killed
+W.sleep(1000)
+t:kill()
+print('timers',fired,'waits',signalled)
@@ -0,0 +1,32 @@
+-- batched file change notification: the callback gets arrays of events.
+require 'winapi'
+io.stdout:setvbuf 'no'
+local dir = 'without_spaces'
+local LAST_WRITE,FILE_NAME =
+        winapi.FILE_NOTIFY_CHANGE_LAST_WRITE,
+        winapi.FILE_NOTIFY_CHANGE_FILE_NAME
+
+local w,err = winapi.watch_for_file_changes(dir,LAST_WRITE+FILE_NAME,false,
+  function(events,msg)
+    if events == -1 then return print('error',msg) end
+    print(#events..' events')
+    for _,e in ipairs(events) do print('',e[1],e[2]) end
+  end,
+  {max = 100, latency = 200, coalesce = true})
+if not w then return print(err) end
+
+winapi.sleep(100)
+
+-- each file is written several times, but we only hear about it once per batch
+for i = 1,10 do
+  for k = 1,5 do
+    local f = io.open(dir..'/batch'..i..'.txt','w')
+    f:write(k)
+    f:close()
+  end
+end
+winapi.sleep(500)
+
+for i = 1,10 do os.remove(dir..'/batch'..i..'.txt') end
+winapi.sleep(500)
+w:kill()
@@ -0,0 +1,173 @@
+/* Lock-free allocators for callback data.
+   The pool is a free list of fixed-size items, where the head carries a
+   counter which changes on every update, so a compare-and-swap cannot be
+   fooled by an item which was taken and put back in the meantime.
+
+   The arena hands out blocks from a ring buffer by moving the head along
+   with compare-and-swap. Each block starts with a header; when a block is
+   freed it is marked, and the tail moves over any run of freed blocks,
+   clearing them as it goes. A block which would not fit before the end of
+   the buffer gets a freed padding block in front of it.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+#include "atomics.h"
+
+typedef unsigned long long Tag;
+
+// the head with the tag moved on; the tag is unsigned, so that it wraps
+// round rather than overflowing, and only the result is made an atomic64
+#define next_head(tag,idx) ((atomic64)((((Tag)(tag) + 1) << 32) | (unsigned)(idx)))
+
+/// initialize a pool.
+// If there is not enough memory, the pool is empty, and every item comes from malloc.
+// @param p the pool
+// @param itemsz size of each item
+// @param count number of items
+// @function pool_init
+void pool_init(Pool *p, int itemsz, int count) {
+  int i;
+  p->itemsz = itemsz;
+  p->items = (char*)malloc(itemsz*count);
+  p->next = (volatile int*)malloc(count*sizeof(int));
+  if (p->items == NULL || p->next == NULL) {
+    free(p->items);
+    free((void*)p->next);
+    p->items = NULL;
+    p->next = NULL;
+    count = 0;
+  }
+  p->count = count;
+  for (i = 0; i < count; i++)
+    p->next[i] = i + 1 < count ? i + 1 : -1;
+  p->head = count > 0 ? 1 : 0;
+  p->hits = 0;
+  p->misses = 0;
+}
+
+/// get an item from the pool, or from malloc if it is empty.
+// @param p the pool
+// @return the item
+// @function pool_alloc
+void *pool_alloc(Pool *p) {
+  while (1) {
+    atomic64 old = load_acquire(&p->head);
+    Tag tag = (Tag)old >> 32;
+    int idx = (int)(old & 0xFFFFFFFF) - 1, next;
+    if (idx < 0) {
+      atomic_inc(&p->misses);
+      return malloc(p->itemsz);
+    }
+    // if another thread takes this item first, next may be stale; but then the swap fails
+    next = load_acquire(&p->next[idx]);
+    if (cas64(&p->head,old,next_head(tag,next + 1))) {
+      atomic_inc(&p->hits);
+      return p->items + idx*p->itemsz;
+    }
+  }
+}
+
+/// give an item back to the pool.
+// @param p the pool
+// @param item from `pool_alloc`
+// @function pool_free
+void pool_free(Pool *p, void *item) {
+  char *it = (char*)item;
+  int idx;
+  if (it < p->items || it >= p->items + p->itemsz*p->count) {
+    free(item);
+    return;
+  }
+  idx = (int)(it - p->items)/p->itemsz;
+  while (1) {
+    atomic64 old = load_acquire(&p->head);
+    Tag tag = (Tag)old >> 32;
+    store_release(&p->next[idx],(int)(old & 0xFFFFFFFF) - 1);
+    if (cas64(&p->head,old,next_head(tag,idx + 1)))
+      return;
+  }
+}
+
+typedef struct {
+  unsigned size;
+  volatile unsigned freed;
+} ArenaHeader;
+
+#define ARENA_ALIGN 8
+
+/// initialize an arena.
+// @param a the arena
+// @param size its size in bytes; must be a power of two
+// If there is not enough memory, every block comes from malloc.
+// @function arena_init
+void arena_init(Arena *a, unsigned size) {
+  a->buf = (char*)calloc(size,1);
+  a->size = a->buf != NULL ? size : 0;
+  a->head = 0;
+  a->tail = 0;
+  a->hits = 0;
+  a->misses = 0;
+}
+
+/// allocate a block from the arena, or from malloc if there is no room.
+// @param a the arena
+// @param n size in bytes
+// @return the block
+// @function arena_alloc
+void *arena_alloc(Arena *a, unsigned n) {
+  unsigned need = (sizeof(ArenaHeader) + n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  if (need <= a->size/4) {
+    while (1) {
+      unsigned head = load_acquire(&a->head), tail = load_acquire(&a->tail);
+      unsigned off = head & (a->size - 1), pad = 0;
+      if (off + need > a->size)
+        pad = a->size - off;
+      if (head - tail + pad + need > a->size)
+        break; // full
+      if (cas32(&a->head,head,head + pad + need)) {
+        ArenaHeader *h;
+        if (pad) {
+          h = (ArenaHeader*)(a->buf + off);
+          h->size = pad;
+          store_release(&h->freed,1);
+          off = 0;
+        }
+        h = (ArenaHeader*)(a->buf + off);
+        h->size = need;
+        atomic_inc(&a->hits);
+        return h + 1;
+      }
+    }
+  }
+  atomic_inc(&a->misses);
+  return malloc(n);
+}
+
+/// free a block from `arena_alloc`.
+// Calls to this must not overlap.
+// @param a the arena
+// @param ptr the block
+// @function arena_free
+void arena_free(Arena *a, void *ptr) {
+  ArenaHeader *h = (ArenaHeader*)ptr - 1;
+  unsigned tail, head;
+  if ((char*)ptr < a->buf || (char*)ptr >= a->buf + a->size) {
+    free(ptr);
+    return;
+  }
+  h->freed = 1;
+  tail = a->tail;
+  head = load_acquire(&a->head);
+  while (tail != head) {
+    unsigned size;
+    h = (ArenaHeader*)(a->buf + (tail & (a->size - 1)));
+    if (! load_acquire(&h->freed))
+      break;
+    // clear the block, so that stale data never looks like a freed header
+    size = h->size;
+    memset(h,0,size);
+    tail += size;
+  }
+  store_release(&a->tail,tail);
+}
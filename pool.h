@@ -0,0 +1,40 @@
+#ifndef POOL_H
+#define POOL_H
+// Allocators for callback data, so that producer threads don't go to malloc
+// for every event. Both fall back to malloc when they run out, and keep
+// count of how often that happens. This does not depend on windows.h.
+#include "atomics.h"
+
+// A pool of fixed-size items, kept on a lock-free free list.
+// Any thread may allocate or free.
+typedef struct {
+  char *items;
+  int itemsz;
+  int count;
+  volatile int *next;      // next free item, or -1
+  volatile atomic64 head;  // index+1 of the first free item, plus an ABA tag in the high word
+  volatile long hits;
+  volatile long misses;
+} Pool;
+
+void pool_init(Pool *p, int itemsz, int count);
+void *pool_alloc(Pool *p);
+void pool_free(Pool *p, void *item);
+
+// A ring buffer for variable-sized blocks. Any thread may allocate, but
+// frees must not overlap (e.g. they all happen on one thread). Blocks may
+// be freed in any order; space is reclaimed in allocation order.
+typedef struct {
+  char *buf;
+  unsigned size;           // a power of two
+  volatile unsigned head;  // allocate from here
+  volatile unsigned tail;  // reclaim from here
+  volatile long hits;
+  volatile long misses;
+} Arena;
+
+void arena_init(Arena *a, unsigned size);
+void *arena_alloc(Arena *a, unsigned n);
+void arena_free(Arena *a, void *ptr);
+
+#endif
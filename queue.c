@@ -0,0 +1,67 @@
+/* Lock-free MPSC queue.
+   Pushing is a single atomic exchange, so producers never wait for each other
+   or for the consumer. A pop may return NULL while a producer is part way
+   through a push; the node turns up on a later pop.
+*/
+#include <stddef.h>
+#include "queue.h"
+#include "atomics.h"
+
+/// initialize a queue.
+// @param q the queue
+// @function queue_init
+void queue_init(Queue *q) {
+  q->stub.next = NULL;
+  q->head = &q->stub;
+  q->tail = &q->stub;
+}
+
+/// push a node onto the queue. Can be called from any thread.
+// @param q the queue
+// @param n the node
+// @function queue_push
+void queue_push(Queue *q, QNode *n) {
+  QNode *prev;
+  n->next = NULL;
+  prev = (QNode*)xchg_ptr(&q->head,n);
+  // the queue is briefly broken here, until prev is linked to n
+  store_release(&prev->next,n);
+}
+
+/// pop a node from the queue. Only the consumer thread may call this.
+// @param q the queue
+// @return the oldest node, or NULL
+// @function queue_pop
+QNode *queue_pop(Queue *q) {
+  QNode *tail = q->tail;
+  QNode *next = load_acquire(&tail->next);
+  if (tail == &q->stub) {
+    if (next == NULL)
+      return NULL;
+    q->tail = next;
+    tail = next;
+    next = load_acquire(&next->next);
+  }
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+  if (tail != load_acquire(&q->head))
+    return NULL; // a push is in progress
+  // tail is the last node; put the stub behind it so it can be taken
+  queue_push(q,&q->stub);
+  next = load_acquire(&tail->next);
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+/// is the queue empty? Only meaningful on the consumer thread.
+// @param q the queue
+// @function queue_empty
+int queue_empty(Queue *q) {
+  QNode *tail = q->tail;
+  return tail == &q->stub && load_acquire(&tail->next) == NULL;
+}
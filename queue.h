@@ -0,0 +1,23 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+// A lock-free multi-producer, single-consumer queue (after Dmitry Vyukov's
+// intrusive MPSC queue). Any thread may push; only one thread may pop.
+// Nodes are embedded in the caller's own structs, so pushing never allocates.
+// This does not depend on windows.h.
+
+typedef struct QNode {
+  struct QNode *volatile next;
+} QNode;
+
+typedef struct {
+  QNode *volatile head;  // producers push here
+  QNode *tail;           // the consumer pops here
+  QNode stub;
+} Queue;
+
+void queue_init(Queue *q);
+void queue_push(Queue *q, QNode *n);
+QNode *queue_pop(Queue *q);
+int queue_empty(Queue *q);
+
+#endif
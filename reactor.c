@@ -0,0 +1,608 @@
+/* The reactor thread.
+   New ops are handed over on a lock-free queue, and cancellations on another;
+   either way the thread is woken by an event (an eventfd elsewhere). The list
+   of waiting ops, and the timing wheel which holds their timeouts, are only
+   ever touched by the reactor thread itself.
+
+   On Windows no more than MAXIMUM_WAIT_OBJECTS-1 handles can be waited on at
+   once. Any more are given to registered waits, which the system pool
+   multiplexes in the same way; when one fires, the op is put on a ready
+   queue for the reactor thread. So callbacks are always run on the reactor
+   thread, and the number of threads only grows by one per 62 handles.
+
+   The reactor sleeps until the next timeout with a timer of its own (a
+   high-resolution waitable timer, or a timerfd), because an ordinary wait on
+   Windows is only good to the 15.6 msec system tick. Periodic ops keep
+   absolute deadlines in usec; the wheel only counts msec, so once one comes
+   within its last msec it moves to a short list sorted by deadline.
+
+   An op with slack has its timeout rounded up onto a grid as coarse as the
+   slack allows, so that timeouts which are close together come due on the
+   same tick and are run in one wakeup.
+*/
+#include <stddef.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+#include "reactor.h"
+#include "timing.h"
+#include "atomics.h"
+
+#define MAX_EVENTS 64
+
+typedef struct {
+  QNode node;
+  ReactorOp *op;
+  unsigned int id;
+} CancelRequest;
+
+static volatile int s_state = 0; // 0 not started, 1 starting, 2 running
+static volatile unsigned int s_last_id = 0;
+static Queue s_adds, s_cancels;
+static ReactorOp *s_first = NULL, *s_last = NULL;
+static TimerWheel s_wheel;
+static WheelTimer s_soon;       // periodic ops due within the msec
+static ReactorTime s_timer_at;  // when the timer is set for, if not zero
+static ReactorBatchFn s_batch = NULL;
+static ReactorStats s_stats;
+#ifdef _WIN32
+static Queue s_ready;
+static int s_local = 0; // handles waited on by the reactor thread
+#endif
+
+#define op_of(n) ((ReactorOp*)((char*)(n) - offsetof(ReactorOp,node)))
+#define op_of_timer(t) ((ReactorOp*)((char*)(t) - offsetof(ReactorOp,timer)))
+
+#ifdef _WIN32
+static HANDLE s_wake, s_timer;
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+typedef HANDLE (WINAPI *CreateTimerEx)(LPSECURITY_ATTRIBUTES,LPCWSTR,DWORD,DWORD);
+
+// only Windows 10 (1803) and later have high-resolution timers; before that,
+// a timer is as coarse as the system tick.
+static HANDLE create_timer() {
+  CreateTimerEx create = (CreateTimerEx)GetProcAddress(GetModuleHandleA("kernel32.dll"),"CreateWaitableTimerExW");
+  HANDLE timer = NULL;
+  if (create != NULL)
+    timer = create(NULL,NULL,CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,TIMER_ALL_ACCESS);
+  if (timer == NULL)
+    timer = CreateWaitableTimer(NULL,FALSE,NULL);
+  return timer;
+}
+
+static void set_timer(ReactorTime at) {
+  LARGE_INTEGER due;
+  ReactorTime now = reactor_clock();
+  // relative, in units of 100 nsec
+  due.QuadPart = at > now ? -(LONGLONG)((at - now)*10) : -1;
+  SetWaitableTimer(s_timer,&due,0,NULL,NULL,FALSE);
+}
+
+static void wake() {
+  SetEvent(s_wake);
+}
+
+static void yield() {
+  Sleep(0);
+}
+#else
+static int s_wake, s_epoll, s_timer;
+
+static void set_timer(ReactorTime at) {
+  struct itimerspec its;
+  its.it_interval.tv_sec = its.it_interval.tv_nsec = 0;
+  its.it_value.tv_sec = (time_t)(at/1000000);
+  its.it_value.tv_nsec = (long)(at%1000000)*1000;
+  timerfd_settime(s_timer,TFD_TIMER_ABSTIME,&its,NULL);
+}
+
+static void wake() {
+  uint64_t one = 1;
+  if (write(s_wake,&one,sizeof(one)) < 0)
+    return; // the counter is saturated, so it is already readable
+}
+
+static void yield() {
+  sched_yield();
+}
+#endif
+
+static unsigned int ticks() {
+  return (unsigned int)(reactor_clock()/1000);
+}
+
+// the first tick which is not earlier than now; a timeout counted from here
+// can only come due at or after its interval, never before.
+static unsigned int ticks_up() {
+  return (unsigned int)((reactor_clock() + 999)/1000);
+}
+
+static void link_op(ReactorOp *op) {
+  op->next = NULL;
+  op->prev = s_last;
+  if (s_last)
+    s_last->next = op;
+  else
+    s_first = op;
+  s_last = op;
+}
+
+static void unlink_op(ReactorOp *op) {
+  if (op->prev)
+    op->prev->next = op->next;
+  else
+    s_first = op->next;
+  if (op->next)
+    op->next->prev = op->prev;
+  else
+    s_last = op->prev;
+  op->prev = op->next = NULL;
+}
+
+#ifdef _WIN32
+static VOID CALLBACK waited(PVOID data, BOOLEAN timedout) { // runs in the system pool
+  ReactorOp *op = (ReactorOp*)data;
+  store_release(&op->fired,1);
+  queue_push(&s_ready,&op->node);
+  wake();
+}
+
+// The set of handles is built afresh for each wait, so an op only has to
+// claim a place there, or failing that get a registered wait.
+static int arm(ReactorOp *op) {
+  if (op->handle == REACTOR_NO_HANDLE)
+    return 1;
+  if (s_local < MAXIMUM_WAIT_OBJECTS - 2) {
+    op->local = 1;
+    ++s_local;
+    return 1;
+  }
+  return RegisterWaitForSingleObject((PHANDLE)&op->wait,op->handle,waited,op,
+    INFINITE,WT_EXECUTEONLYONCE | WT_EXECUTEINWAITTHREAD);
+}
+
+// Let go of the handle before calling back, since the op may be freed then.
+// If a registered wait has already fired, then the op is on the ready queue,
+// and nothing more can be done with it until it comes off.
+static int release(ReactorOp *op, int status) {
+  if (op->local) {
+    op->local = 0;
+    --s_local;
+  } else if (op->wait != NULL) {
+    // this waits for the callback to finish, if it is running
+    UnregisterWaitEx(op->wait,INVALID_HANDLE_VALUE);
+    op->wait = NULL;
+  }
+  return load_acquire(&op->fired);
+}
+#else
+// Ops are registered with epoll as one-shot, so that once an op is ready
+// it can be freed without epoll ever seeing it again. The callback may have
+// closed the fd, so it is not touched afterwards; epoll only forgets an fd when
+// every copy of it has been closed anyway (say, in a child process).
+static int arm(ReactorOp *op) {
+  struct epoll_event ev;
+  if (op->handle != op->armed)
+    op->armed = REACTOR_NO_HANDLE;
+  if (op->handle == REACTOR_NO_HANDLE)
+    return 1;
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = op;
+  if (op->armed == op->handle)
+    return epoll_ctl(s_epoll,EPOLL_CTL_MOD,op->handle,&ev) == 0;
+  if (epoll_ctl(s_epoll,EPOLL_CTL_ADD,op->handle,&ev) != 0
+      && (errno != EEXIST || epoll_ctl(s_epoll,EPOLL_CTL_MOD,op->handle,&ev) != 0))
+    return 0;
+  op->armed = op->handle;
+  return 1;
+}
+
+// an op which is ready has already been switched off
+static int release(ReactorOp *op, int status) {
+  if (status != REACTOR_READY && op->armed != REACTOR_NO_HANDLE) {
+    epoll_ctl(s_epoll,EPOLL_CTL_DEL,op->armed,NULL);
+    op->armed = REACTOR_NO_HANDLE;
+  }
+  return 0;
+}
+#endif
+
+// the soon list is kept in order of deadline; usually an op goes on the end
+static void add_soon(ReactorOp *op) {
+  WheelTimer *t = s_soon.prev;
+  while (t != &s_soon && op_of_timer(t)->deadline > op->deadline)
+    t = t->prev;
+  op->timer.prev = t;
+  op->timer.next = t->next;
+  t->next->prev = &op->timer;
+  t->next = &op->timer;
+  op->soon = 1;
+}
+
+static void remove_timer(ReactorOp *op) {
+  if (op->soon) {
+    op->timer.prev->next = op->timer.next;
+    op->timer.next->prev = op->timer.prev;
+    op->timer.next = op->timer.prev = NULL;
+    op->soon = 0;
+  } else if (wheel_pending(&op->timer)) {
+    wheel_remove(&s_wheel,&op->timer);
+  }
+}
+
+// round a tick up to a multiple of the largest power of two within the
+// slack. The grids for different slacks line up, so a coarse one still
+// shares its ticks with the finer ones.
+static unsigned int coarsen(unsigned int tick, unsigned int slack) {
+  unsigned int grid = 1;
+  while (grid <= slack/2)
+    grid *= 2;
+  return (tick + grid - 1) & ~(grid - 1);
+}
+
+static void set_due(ReactorOp *op) {
+  if (op->period != 0) {
+    unsigned int tick = (unsigned int)(op->deadline/1000);
+    if (op->slack > 0)
+      tick = coarsen(tick + 1,op->slack); // by then the deadline has passed
+    if ((int)(tick - ticks()) <= 0)
+      add_soon(op);
+    else
+      wheel_add(&s_wheel,&op->timer,tick);
+  } else if (op->timeout != REACTOR_FOREVER) {
+    wheel_add(&s_wheel,&op->timer,coarsen(ticks_up() + op->timeout,op->slack));
+  }
+}
+
+// a periodic op has come due: count the deadlines which have passed since,
+// and move on to the next one, or past them all if they are to be skipped.
+// The next deadline only depends on the last, so there is no drift.
+static void next_deadline(ReactorOp *op) {
+  ReactorTime now = reactor_clock(), missed = 0;
+  if (now > op->deadline)
+    missed = (now - op->deadline)/op->period;
+  op->overruns = missed > 0xFFFFFFFF ? 0xFFFFFFFF : (unsigned int)missed;
+  if (op->policy == REACTOR_SKIP)
+    op->deadline += (missed + 1)*op->period;
+  else
+    op->deadline += op->period;
+}
+
+// call back, and then either keep the op waiting or forget it. The callback
+// may free the op if it is finished with, so it must not be touched after that.
+static void run(ReactorOp *op, int status) {
+  remove_timer(op);
+  if (release(op,status)) {
+#ifdef _WIN32
+    // it has been signalled meanwhile; a timeout is then too late
+    if (status == REACTOR_CANCELLED)
+      op->deferred = status;
+#endif
+    return;
+  }
+  unlink_op(op);
+  if (status == REACTOR_TIMEOUT) {
+    ++s_stats.timeouts;
+    if (op->period != 0)
+      next_deadline(op);
+  }
+  if (op->fn(op,status) && status != REACTOR_CANCELLED && status != REACTOR_ERROR) {
+    set_due(op);
+    link_op(op);
+    if (arm(op))
+      return;
+    unlink_op(op);
+    release(op,REACTOR_ERROR);
+    op->fn(op,REACTOR_ERROR);
+  }
+}
+
+static void start_ops() {
+  QNode *n;
+  while ((n = queue_pop(&s_adds)) != NULL) {
+    ReactorOp *op = op_of(n);
+    set_due(op);
+    link_op(op);
+    if (! arm(op)) {
+      unlink_op(op);
+      op->fn(op,REACTOR_ERROR);
+    }
+  }
+}
+
+#ifdef _WIN32
+static void ready_ops() {
+  QNode *n;
+  while ((n = queue_pop(&s_ready)) != NULL) {
+    ReactorOp *op = op_of(n);
+    int status = op->deferred;
+    release(op,status);
+    store_release(&op->fired,0);
+    op->deferred = REACTOR_READY;
+    run(op,status);
+  }
+}
+#endif
+
+static void cancel_ops() {
+  QNode *n;
+  while ((n = queue_pop(&s_cancels)) != NULL) {
+    CancelRequest *c = (CancelRequest*)n;
+    ReactorOp *op;
+    // the op may be long gone, so only compare with ops we know are alive
+    for (op = s_first; op != NULL; op = op->next) {
+      if (op == c->op && op->id == c->id) {
+        run(op,REACTOR_CANCELLED);
+        break;
+      }
+    }
+    free(c);
+  }
+}
+
+static void timed_out(WheelTimer *t, void *data) {
+  ReactorOp *op = op_of_timer(t);
+  (void)data;
+  if (op->period != 0)
+    add_soon(op); // its deadline is somewhere in this msec
+  else
+    run(op,REACTOR_TIMEOUT); // does nothing if it is on the ready queue
+}
+
+// run any ops which have timed out, and work out when to wake up for the
+// rest, or return 0 if there are none. A periodic op which is catching up may
+// come straight back on the soon list, but only until it is up to `now`.
+static ReactorTime expire_ops() {
+  ReactorTime now = reactor_clock(), at = 0;
+  unsigned long timeouts = s_stats.timeouts;
+  int next;
+  if (s_batch)
+    s_batch(1);
+  wheel_advance(&s_wheel,(unsigned int)(now/1000),timed_out,NULL);
+  while (s_soon.next != &s_soon && op_of_timer(s_soon.next)->deadline <= now)
+    run(op_of_timer(s_soon.next),REACTOR_TIMEOUT);
+  if (s_batch)
+    s_batch(0);
+  if (s_stats.timeouts - timeouts > 1)
+    s_stats.saved += s_stats.timeouts - timeouts - 1;
+  next = wheel_next(&s_wheel);
+  if (next >= 0)
+    at = (now/1000 + next)*1000;
+  if (s_soon.next != &s_soon && (at == 0 || op_of_timer(s_soon.next)->deadline < at))
+    at = op_of_timer(s_soon.next)->deadline;
+  return at;
+}
+
+// the timer only needs setting again if it has gone off, or the time has changed
+static void wake_at(ReactorTime at) {
+  if (at != 0 && at != s_timer_at) {
+    s_timer_at = at;
+    set_timer(at);
+  }
+}
+
+#ifdef _WIN32
+static void wait_ops(ReactorTime at) {
+  HANDLE hs[MAXIMUM_WAIT_OBJECTS];
+  ReactorOp *ops[MAXIMUM_WAIT_OBJECTS], *op;
+  DWORD n = 2, res;
+  hs[0] = s_wake;
+  hs[1] = s_timer;
+  for (op = s_first; op != NULL && n < MAXIMUM_WAIT_OBJECTS; op = op->next) {
+    if (op->local) {
+      hs[n] = op->handle;
+      ops[n++] = op;
+    }
+  }
+  wake_at(at);
+  res = WaitForMultipleObjects(n,hs,FALSE,INFINITE);
+  ++s_stats.wakeups;
+  if (res == WAIT_OBJECT_0 + 1) {
+    s_timer_at = 0;
+  } else if (res > WAIT_OBJECT_0 + 1 && res < WAIT_OBJECT_0 + n) {
+    run(ops[res - WAIT_OBJECT_0],REACTOR_READY);
+  } else if (res > WAIT_ABANDONED_0 + 1 && res < WAIT_ABANDONED_0 + n) {
+    run(ops[res - WAIT_ABANDONED_0],REACTOR_READY);
+  } else if (res == WAIT_FAILED) {
+    // one of the handles has gone bad (probably closed); find out which
+    DWORD i;
+    for (i = 2; i < n; i++) {
+      if (WaitForSingleObject(hs[i],0) == WAIT_FAILED)
+        run(ops[i],REACTOR_ERROR);
+    }
+  }
+}
+
+static DWORD WINAPI reactor_thread(LPVOID arg)
+#else
+static void wait_ops(ReactorTime at) {
+  struct epoll_event evs[MAX_EVENTS];
+  int i, n;
+  wake_at(at);
+  n = epoll_wait(s_epoll,evs,MAX_EVENTS,-1);
+  ++s_stats.wakeups;
+  for (i = 0; i < n; i++) {
+    ReactorOp *op = (ReactorOp*)evs[i].data.ptr;
+    uint64_t count;
+    if (op == NULL) {
+      if (read(s_wake,&count,sizeof(count)) < 0)
+        continue;
+    } else if (op == (ReactorOp*)&s_timer) {
+      if (read(s_timer,&count,sizeof(count)) > 0)
+        s_timer_at = 0;
+    } else {
+      run(op,REACTOR_READY);
+    }
+  }
+}
+
+static void *reactor_thread(void *arg)
+#endif
+{
+  (void)arg;
+  while (1) {
+    start_ops();
+#ifdef _WIN32
+    ready_ops();
+#endif
+    cancel_ops();
+    wait_ops(expire_ops());
+  }
+  return 0;
+}
+
+static void reactor_start() {
+  if (cas32(&s_state,0,1)) {
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+    struct epoll_event ev;
+#endif
+    queue_init(&s_adds);
+    queue_init(&s_cancels);
+    wheel_init(&s_wheel,ticks());
+    s_soon.next = s_soon.prev = &s_soon;
+#ifdef _WIN32
+    queue_init(&s_ready);
+    s_wake = CreateEvent(NULL,FALSE,FALSE,NULL);
+    s_timer = create_timer();
+    thread = CreateThread(NULL,0,reactor_thread,NULL,0,NULL);
+    CloseHandle(thread);
+#else
+    s_wake = eventfd(0,EFD_NONBLOCK);
+    s_epoll = epoll_create1(0);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(s_epoll,EPOLL_CTL_ADD,s_wake,&ev);
+    s_timer = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK);
+    ev.data.ptr = &s_timer;
+    epoll_ctl(s_epoll,EPOLL_CTL_ADD,s_timer,&ev);
+    pthread_create(&thread,NULL,reactor_thread,NULL);
+    pthread_detach(thread);
+#endif
+    store_release(&s_state,2);
+  } else {
+    while (load_acquire(&s_state) != 2)
+      yield();
+  }
+}
+
+/// set up an op.
+// @param op the op
+// @param h handle to wait for, or `REACTOR_NO_HANDLE`
+// @param timeout in msec, or `REACTOR_FOREVER`
+// @param fn called on the reactor thread when the op is ready or times out
+// @param data for the callback
+// @function reactor_init_op
+void reactor_init_op(ReactorOp *op, ReactorHandle h, int timeout, ReactorFn fn, void *data) {
+  op->handle = h;
+  op->timeout = timeout;
+  op->fn = fn;
+  op->data = data;
+  op->period = 0;
+  op->policy = REACTOR_SKIP;
+  op->overruns = 0;
+  op->slack = 0;
+}
+
+/// make an op periodic. It will time out at fixed deadlines, `usec` apart,
+// counting from when it is added, however long its callback takes. When it
+// is called back, `op->overruns` is the number of deadlines which had
+// already passed as well.
+// @param op the op
+// @param usec the period, or 0 to make it an ordinary op again
+// @param policy `REACTOR_SKIP` or `REACTOR_CATCH_UP`
+// @function reactor_set_period
+void reactor_set_period(ReactorOp *op, ReactorTime usec, int policy) {
+  op->period = usec;
+  op->policy = policy;
+}
+
+/// set a function to be called around each batch of timeouts.
+// For instance, it can let a lock which each callback would take be taken
+// just once for the batch. Set this before adding any ops.
+// @param fn the function, or NULL
+// @function reactor_set_batch
+void reactor_set_batch(ReactorBatchFn fn) {
+  s_batch = fn;
+}
+
+/// how often the reactor has woken up, and how many timeouts it ran.
+// The counts are only updated by the reactor thread, and are not read
+// atomically, so they are only a snapshot.
+// @param stats filled in with the counts
+// @function reactor_stats
+void reactor_stats(ReactorStats *stats) {
+  *stats = s_stats;
+}
+
+/// the time in usec, from a clock which only goes forward.
+// @function reactor_clock
+ReactorTime reactor_clock(void) {
+  return timing_clock()/1000;
+}
+
+/// hand an op over to the reactor thread, starting it if needed.
+// The op belongs to the reactor until its callback says it is finished.
+// Can be called from any thread.
+// @param op the op
+// @return an id for `reactor_cancel`
+// @function reactor_add
+unsigned int reactor_add(ReactorOp *op) {
+  unsigned int id;
+  if (load_acquire(&s_state) != 2)
+    reactor_start();
+  do {
+    id = (unsigned int)atomic_inc(&s_last_id);
+  } while (id == 0);
+  op->id = id;
+  op->armed = REACTOR_NO_HANDLE;
+  op->prev = op->next = NULL;
+  op->timer.next = NULL;
+  op->soon = 0;
+  op->deadline = reactor_clock() + op->period;
+#ifdef _WIN32
+  op->local = 0;
+  op->wait = NULL;
+  op->fired = 0;
+  op->deferred = REACTOR_READY;
+#endif
+  queue_push(&s_adds,&op->node);
+  wake();
+  return id;
+}
+
+/// cancel an op. Its callback will be called with `REACTOR_CANCELLED`,
+// unless it has already finished, in which case nothing happens. The op
+// is never touched here, so it does not matter if it has been freed.
+// Can be called from any thread.
+// @param op the op
+// @param id from `reactor_add`
+// @return 0 if there was no memory for the request, so nothing was done
+// @function reactor_cancel
+int reactor_cancel(ReactorOp *op, unsigned int id) {
+  CancelRequest *c = (CancelRequest*)malloc(sizeof(CancelRequest));
+  if (c == NULL)
+    return 0;
+  c->op = op;
+  c->id = id;
+  queue_push(&s_cancels,&c->node);
+  wake();
+  return 1;
+}
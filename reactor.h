@@ -0,0 +1,84 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+// A single background thread which waits on many handles and timeouts
+// at once, instead of a thread for each. On Windows the handles are
+// waitable objects; elsewhere they are file descriptors waited on with
+// epoll, so this can be built and tested anywhere.
+#include "queue.h"
+#include "wheel.h"
+
+#ifdef _WIN32
+typedef void *ReactorHandle;   // a HANDLE
+#define REACTOR_NO_HANDLE NULL
+#else
+typedef int ReactorHandle;     // a file descriptor
+#define REACTOR_NO_HANDLE (-1)
+#endif
+
+#define REACTOR_FOREVER (-1)
+
+typedef unsigned long long ReactorTime;  // usec, from reactor_clock
+
+enum {
+  REACTOR_SKIP,       // a periodic op which falls behind skips the deadlines it missed
+  REACTOR_CATCH_UP    // or is called back for each of them, as soon as it can be
+};
+
+enum {
+  REACTOR_READY,      // the handle was signalled, or is readable
+  REACTOR_TIMEOUT,
+  REACTOR_ERROR,      // the handle cannot be waited on
+  REACTOR_CANCELLED
+};
+
+typedef struct ReactorOp ReactorOp;
+
+// Called on the reactor thread. Return nonzero to keep waiting; the handle
+// and timeout may be changed first. Once this returns zero, or has been
+// called with REACTOR_CANCELLED or REACTOR_ERROR, the reactor forgets the op.
+typedef int (*ReactorFn)(ReactorOp *op, int status);
+
+struct ReactorOp {
+  ReactorHandle handle;   // may be REACTOR_NO_HANDLE for a plain timeout
+  int timeout;            // msec, or REACTOR_FOREVER
+  ReactorFn fn;
+  void *data;
+  ReactorTime period;     // usec; if not zero, the timeout is ignored, see reactor_set_period
+  int policy;             // REACTOR_SKIP or REACTOR_CATCH_UP
+  unsigned int overruns;  // deadlines which had already passed when called back
+  unsigned int slack;     // msec the timeout may be put off, to share a wakeup with others
+  // private to the reactor
+  QNode node;
+  unsigned int id;
+  WheelTimer timer;
+  ReactorTime deadline;   // for a periodic op
+  int soon;               // due within the msec, so on a list of its own rather than the wheel
+  ReactorHandle armed;
+  ReactorOp *prev, *next;
+#ifdef _WIN32
+  int local;              // waited on by the reactor thread itself
+  void *wait;             // otherwise, a registered wait
+  volatile long fired;    // the registered wait has put this on the ready queue
+  int deferred;           // status to report when it comes off that queue
+#endif
+};
+
+// Called on the reactor thread with 1 before it runs the ops which have
+// timed out together, and with 0 afterwards.
+typedef void (*ReactorBatchFn)(int begin);
+
+typedef struct {
+  unsigned long wakeups;   // times the reactor thread has woken up
+  unsigned long timeouts;  // ops called back because they timed out
+  unsigned long saved;     // timeouts which shared a wakeup with an earlier one
+} ReactorStats;
+
+void reactor_init_op(ReactorOp *op, ReactorHandle h, int timeout, ReactorFn fn, void *data);
+void reactor_set_period(ReactorOp *op, ReactorTime usec, int policy);
+ReactorTime reactor_clock(void);
+void reactor_set_batch(ReactorBatchFn fn);
+void reactor_stats(ReactorStats *stats);
+unsigned int reactor_add(ReactorOp *op);
+int reactor_cancel(ReactorOp *op, unsigned int id);
+
+#endif
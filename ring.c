@@ -0,0 +1,164 @@
+/* A ring buffer only grows when it is full; then the bytes are copied
+   into a buffer twice the size, starting at the beginning. Space to read
+   into is always contiguous, so it may be less than all the free space
+   when the free space wraps around the end.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+
+#define RING_MIN 4096
+
+/// initialize an empty ring buffer. Nothing is allocated until it is needed.
+// @param r the buffer
+// @function ring_init
+void ring_init(RingBuf *r) {
+  r->buf = NULL;
+  r->size = 0;
+  r->head = r->tail = 0;
+}
+
+/// free a ring buffer's memory.
+// @param r the buffer
+// @function ring_free
+void ring_free(RingBuf *r) {
+  free(r->buf);
+  ring_init(r);
+}
+
+// copy n bytes from the tail, allowing for wrap-around
+static void copy_out(RingBuf *r, char *dest, unsigned n) {
+  unsigned at = r->tail & (r->size - 1), first = r->size - at;
+  if (first >= n) {
+    memcpy(dest,r->buf + at,n);
+  } else {
+    memcpy(dest,r->buf + at,first);
+    memcpy(dest + first,r->buf,n - first);
+  }
+}
+
+static int grow(RingBuf *r, unsigned size) {
+  unsigned count = ring_count(r);
+  char *buf = (char*)malloc(size);
+  if (buf == NULL)
+    return 0;
+  if (count > 0)
+    copy_out(r,buf,count);
+  free(r->buf);
+  r->buf = buf;
+  r->size = size;
+  r->tail = 0;
+  r->head = count;
+  return 1;
+}
+
+/// space to read into at the head. If the buffer is full, or `want` bytes
+// would not fit, it is made bigger first.
+// @param r the buffer
+// @param want the least amount of free space needed (0 for any)
+// @param n set to the number of contiguous bytes available
+// @return the space, or NULL if out of memory
+// @function ring_space
+char *ring_space(RingBuf *r, unsigned want, unsigned *n) {
+  unsigned at, free_bytes;
+  if (r->size - ring_count(r) < (want ? want : 1)) {
+    unsigned size = r->size ? r->size : RING_MIN;
+    while (size - ring_count(r) < (want ? want : 1)) {
+      size *= 2;
+      if (size == 0)
+        return NULL;
+    }
+    if (! grow(r,size))
+      return NULL;
+  }
+  at = r->head & (r->size - 1);
+  free_bytes = r->size - ring_count(r);
+  *n = r->size - at < free_bytes ? r->size - at : free_bytes;
+  return r->buf + at;
+}
+
+/// find a byte.
+// @param r the buffer
+// @param ch the byte
+// @param from how far past the tail to start looking
+// @return how far past the tail it is, or -1 if it isn't there
+// @function ring_find
+int ring_find(RingBuf *r, char ch, unsigned from) {
+  unsigned count = ring_count(r), at, first;
+  const char *p;
+  if (from >= count)
+    return -1;
+  at = (r->tail + from) & (r->size - 1);
+  first = r->size - at;
+  if (first > count - from)
+    first = count - from;
+  p = (const char*)memchr(r->buf + at,ch,first);
+  if (p != NULL)
+    return (int)(from + (p - (r->buf + at)));
+  if (first < count - from) {
+    p = (const char*)memchr(r->buf,ch,count - from - first);
+    if (p != NULL)
+      return (int)(from + first + (p - r->buf));
+  }
+  return -1;
+}
+
+/// look at the first n bytes from the tail, as one piece.
+// If they wrap around the end of the buffer, they are copied to `scratch`.
+// @param r the buffer
+// @param n the number of bytes; must not be more than are held
+// @param scratch at least n bytes
+// @return a pointer to the bytes
+// @function ring_peek
+const char *ring_peek(RingBuf *r, unsigned n, char *scratch) {
+  unsigned at;
+  if (n == 0)
+    return "";
+  at = r->tail & (r->size - 1);
+  if (r->size - at >= n)
+    return r->buf + at;
+  copy_out(r,scratch,n);
+  return scratch;
+}
+
+/// the length of the first message, if all of it has arrived.
+// The length comes first, as a varint: seven bits to a byte, lowest
+// first, with the top bit set on all but the last byte.
+// @param r the buffer
+// @param hdr set to the number of bytes in the length
+// @return the length of the whole frame, header and message, or `RING_PARTIAL`
+// if it has not all arrived, or `RING_BAD` if the length is not valid
+// @function ring_frame
+int ring_frame(RingBuf *r, unsigned *hdr) {
+  unsigned count = ring_count(r), i;
+  unsigned long long len = 0;
+  for (i = 0; i < RING_FRAME_HEADER; i++) {
+    unsigned char b;
+    if (i >= count)
+      return RING_PARTIAL;
+    b = (unsigned char)r->buf[(r->tail + i) & (r->size - 1)];
+    len |= (unsigned long long)(b & 0x7F) << (7*i);
+    if ((b & 0x80) == 0) {
+      if (len > RING_FRAME_MAX)
+        return RING_BAD;
+      *hdr = i + 1;
+      return count - *hdr >= len ? (int)(*hdr + len) : RING_PARTIAL;
+    }
+  }
+  return RING_BAD;
+}
+
+/// write the length of a message, to go before it.
+// @param p at least `RING_FRAME_HEADER` bytes
+// @param len the length
+// @return the number of bytes written
+// @function ring_put_length
+int ring_put_length(char *p, unsigned len) {
+  int n = 0;
+  while (len >= 0x80) {
+    p[n++] = (char)(len | 0x80);
+    len >>= 7;
+  }
+  p[n++] = (char)len;
+  return n;
+}
@@ -0,0 +1,34 @@
+#ifndef RING_H
+#define RING_H
+// A growable ring buffer of bytes, for buffered reading: data is read
+// in at the head, and taken out at the tail. The size is always a power of
+// two, and head and tail only ever go up, so that head - tail is the
+// number of bytes held. It can also pick out messages which are framed
+// by their length. This does not depend on windows.h.
+
+typedef struct {
+  char *buf;
+  unsigned size;
+  unsigned head;
+  unsigned tail;
+} RingBuf;
+
+void ring_init(RingBuf *r);
+void ring_free(RingBuf *r);
+#define ring_count(r) ((r)->head - (r)->tail)
+char *ring_space(RingBuf *r, unsigned want, unsigned *n);
+#define ring_commit(r,n) ((r)->head += (n))
+int ring_find(RingBuf *r, char ch, unsigned from);
+const char *ring_peek(RingBuf *r, unsigned n, char *scratch);
+#define ring_consume(r,n) ((r)->tail += (n))
+
+// Messages may be framed by putting their length first, as a varint.
+#define RING_FRAME_HEADER 5             // most bytes in a length
+#define RING_FRAME_MAX 0x7FFFFFF0u      // so that a whole frame's length fits in an int
+#define RING_PARTIAL (-1)
+#define RING_BAD (-2)
+
+int ring_frame(RingBuf *r, unsigned *hdr);
+int ring_put_length(char *p, unsigned len);
+
+#endif
@@ -0,0 +1,157 @@
+/* Reading lines from a pipe, the C version of examples/bench-lines.lua.
+   A child writes CRLF lines of 20-100 bytes, which are read either as
+   winapi scripts used to: 2048-byte chunks, each made into a string,
+   glued onto what was left over and split; or as File:read_line does,
+   with the ring buffer and one string per line. Strings are malloc and
+   copy, standing in for Lua strings, and are counted along with the bytes
+   copied into them.
+   usage: bench-lines [lines]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "ring.h"
+#include "timing.h"
+
+static long strings, copied, lines;
+static volatile long sink;
+static char *data, *data_end;
+
+static char *make_string(const char *p, size_t n) {
+  char *s = (char*)malloc(n + 1);
+  memcpy(s,p,n);
+  s[n] = '\0';
+  ++strings;
+  copied += n;
+  return s;
+}
+
+static void got_line(const char *p, size_t n) {
+  char *line;
+  if (n > 0 && p[n-1] == '\r')
+    --n;
+  line = make_string(p,n);
+  sink += line[0];
+  free(line);
+  ++lines;
+}
+
+static void make_data(int nlines) {
+  char *q;
+  int i, j;
+  srand(1);
+  data = q = (char*)malloc((size_t)nlines*102);
+  for (i = 0; i < nlines; i++) {
+    int len = 20 + rand() % 80;
+    for (j = 0; j < len; j++)
+      *q++ = 'a' + j % 26;
+    *q++ = '\r';
+    *q++ = '\n';
+  }
+  data_end = q;
+}
+
+// a child which writes all the lines down a pipe
+static int spawn_writer(void) {
+  int fd[2];
+  char *w;
+  if (pipe(fd) != 0)
+    return -1;
+  if (fork() == 0) {
+    close(fd[0]);
+    for (w = data; w < data_end; ) {
+      ssize_t n = write(fd[1],w,data_end - w < 65536 ? data_end - w : 65536);
+      if (n <= 0)
+        break;
+      w += n;
+    }
+    _exit(0);
+  }
+  close(fd[1]);
+  return fd[0];
+}
+
+static void read_chunks(int fd) {
+  char buf[2048], *rest = make_string("",0), *all;
+  size_t nrest = 0, nall, start, i;
+  ssize_t n;
+  while ((n = read(fd,buf,sizeof(buf))) > 0) {
+    char *chunk = make_string(buf,n);         // f:read()
+    nall = nrest + n;                         // rest .. chunk
+    all = (char*)malloc(nall + 1);
+    memcpy(all,rest,nrest);
+    memcpy(all + nrest,chunk,n);
+    ++strings;
+    copied += nall;
+    free(chunk);
+    free(rest);
+    for (start = 0, i = 0; i < nall; i++) {   // gmatch '([^\n]*)\n'
+      if (all[i] == '\n') {
+        got_line(all + start,i - start);
+        start = i + 1;
+      }
+    }
+    rest = make_string(all + start,nall - start);  // match '[^\n]*$'
+    nrest = nall - start;
+    free(all);
+  }
+  free(rest);
+}
+
+static void read_ring(int fd) {
+  RingBuf r;
+  unsigned scanned = 0, space;
+  char *scratch = (char*)malloc(1<<16), *p;
+  int eof = 0, i;
+  ssize_t n;
+  ring_init(&r);
+  for (;;) {
+    i = ring_find(&r,'\n',scanned);
+    if (i < 0) {
+      // carry on from here once there is more
+      scanned = ring_count(&r);
+      if (eof)
+        break;
+      p = ring_space(&r,0,&space);
+      n = read(fd,p,space);
+      if (n <= 0)
+        eof = 1;
+      else
+        ring_commit(&r,n);
+      continue;
+    }
+    got_line(ring_peek(&r,i + 1,scratch),i);
+    ring_consume(&r,i + 1);
+    scanned = 0;
+  }
+  ring_free(&r);
+  free(scratch);
+}
+
+int main(int argc, char **argv) {
+  int nlines = argc > 1 ? atoi(argv[1]) : 2000000, rep, k;
+  if (nlines < 1) {
+    fprintf(stderr,"usage: bench-lines [lines]\n");
+    return 1;
+  }
+  make_data(nlines);
+  for (rep = 0; rep < 2; rep++) {
+    for (k = 0; k < 2; k++) {
+      int fd = spawn_writer();
+      TimeNs start = timing_clock();
+      strings = copied = lines = 0;
+      if (k == 0)
+        read_chunks(fd);
+      else
+        read_ring(fd);
+      printf("%-6s %ld lines %.3f s %ld strings %.1f MB copied\n",k ? "ring" : "chunks",
+        lines,(timing_clock() - start)/1e9,strings,copied/1e6);
+      close(fd);
+      wait(NULL);
+    }
+  }
+  free(data);
+  return 0;
+}
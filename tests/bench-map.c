@@ -0,0 +1,126 @@
+/* Scanning a big log, read whole or mapped, the C version of
+   examples/bench-map.lua. A file of 64-byte lines is written with a needle
+   at its very end; then it is searched for the needle and split into a
+   string per line, as map_file's find and lines do. Reading it whole is
+   done as Lua 5.1's io.read('*a') does, into a buffer which doubles and
+   then into the final string. Strings are malloc and copy, standing in for
+   Lua strings. The file is written first, so the page cache is warm.
+   usage: bench-map [megabytes]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "timing.h"
+
+#define PATH "bench-map.tmp"
+#define NEEDLE "needle-at-the-end"
+
+// as map_file's find does
+static const char *find_bytes(const char *p, size_t n, const char *s, size_t len) {
+  const char *end = p + n, *q;
+  if (len == 0)
+    return p;
+  while ((size_t)(end - p) >= len) {
+    q = (const char*)memchr(p,s[0],(end - p) - len + 1);
+    if (q == NULL)
+      return NULL;
+    if (memcmp(q,s,len) == 0)
+      return q;
+    p = q + 1;
+  }
+  return NULL;
+}
+
+static long split_lines(const char *p, size_t n) {
+  const char *e = p + n;
+  long lines = 0;
+  while (p < e) {
+    const char *r = (const char*)memchr(p,'\n',e - p);
+    size_t k = r ? (size_t)(r - p) : (size_t)(e - p);
+    char *line = (char*)malloc(k + 1);
+    memcpy(line,p,k);
+    free(line);
+    ++lines;
+    p += k + 1;
+  }
+  return lines;
+}
+
+static char *read_all(const char *path, size_t *n) {
+  FILE *f = fopen(path,"rb");
+  size_t cap = 8192, len = 0, got;
+  char *b = (char*)malloc(cap), *s;
+  while ((got = fread(b + len,1,cap - len,f)) > 0) {
+    len += got;
+    if (len == cap)
+      b = (char*)realloc(b,cap *= 2);
+  }
+  fclose(f);
+  s = (char*)malloc(len + 1);
+  memcpy(s,b,len);
+  free(b);
+  *n = len;
+  return s;
+}
+
+static int write_log(size_t size) {
+  char line[64];
+  size_t i;
+  FILE *f = fopen(PATH,"wb");
+  if (f == NULL)
+    return 0;
+  for (i = 0; i < sizeof(line) - 1; i++)
+    line[i] = 'a' + i % 26;
+  line[sizeof(line) - 1] = '\n';
+  for (i = 0; i + sizeof(line) <= size; i += sizeof(line))
+    fwrite(line,1,sizeof(line),f);
+  fputs(NEEDLE "\n",f);
+  fclose(f);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  int mb = argc > 1 ? atoi(argv[1]) : 1024, fd;
+  size_t n;
+  struct stat st;
+  const char *m, *q;
+  char *s;
+  TimeNs start;
+  long lines;
+  if (mb < 1 || ! write_log((size_t)mb << 20)) {
+    fprintf(stderr,"usage: bench-map [megabytes]\n");
+    return 1;
+  }
+
+  start = timing_clock();
+  s = read_all(PATH,&n);
+  q = find_bytes(s,n,NEEDLE,strlen(NEEDLE));
+  printf("read all + find  %.3f s at %ld\n",(timing_clock() - start)/1e9,q ? (long)(q - s) : -1);
+  free(s);
+
+  start = timing_clock();
+  fd = open(PATH,O_RDONLY);
+  fstat(fd,&st);
+  m = (const char*)mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  q = find_bytes(m,st.st_size,NEEDLE,strlen(NEEDLE));
+  printf("mapped find      %.3f s at %ld\n",(timing_clock() - start)/1e9,q ? (long)(q - m) : -1);
+
+  start = timing_clock();
+  lines = split_lines(m,st.st_size);
+  printf("mapped lines     %.3f s %ld lines\n",(timing_clock() - start)/1e9,lines);
+  munmap((void*)m,st.st_size);
+  close(fd);
+
+  start = timing_clock();
+  s = read_all(PATH,&n);
+  lines = split_lines(s,n);
+  free(s);
+  printf("read all + lines %.3f s %ld lines\n",(timing_clock() - start)/1e9,lines);
+
+  unlink(PATH);
+  return 0;
+}
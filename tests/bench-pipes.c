@@ -0,0 +1,331 @@
+/* A load benchmark for the pipe server's accept loop and callback dispatch,
+   which runs anywhere the reactor does; examples/bench-pipes.lua is the
+   same test for the real thing, on Windows.
+
+   The server is put together the way make_pipe_server and read_async are
+   with use_dispatch: the reactor thread waits for the listening socket and
+   every connection, reads what comes in, and pushes it onto a lock-free
+   queue. The main thread, standing in for Lua, pops each item and calls back:
+   a new connection starts a read op of its own, and a message is echoed back.
+   Named pipes are replaced by a Unix socket.
+
+   Prints CSV, in the same columns as bench-pipes.lua: connections/sec,
+   round-trip latency percentiles with one client at a time, and messages/sec
+   (with the latency under load) with every client sending at once.
+   usage: bench-pipes [clients] [messages] [sizes...]
+*/
+#define _GNU_SOURCE  // for accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "reactor.h"
+#include "queue.h"
+#include "timing.h"
+#include "atomics.h"
+
+#define READ_SIZE 65536
+#define MAX_SIZES 16
+
+enum { CONNECTED, MESSAGE, CLOSED };
+
+typedef struct {
+  QNode node;
+  int kind;
+  int fd;
+  int len;
+  char data[1];
+} Item;
+
+typedef struct {
+  ReactorOp op;
+  int fd;
+} Conn;
+
+static Queue s_items;
+static int s_wake;                 // an eventfd, written when the main thread may be waiting
+static volatile int s_waiting = 0;
+static volatile int s_stop = 0;
+static struct sockaddr_un s_addr;
+static char s_buff[READ_SIZE];    // only used by the reactor thread
+
+static int nclients = 16, nmessages = 2000;
+static int sizes[MAX_SIZES], nsizes = 0;
+
+static void post(int kind, int fd, const char *data, int len) {
+  Item *it = (Item*)malloc(sizeof(Item) + len);
+  it->kind = kind;
+  it->fd = fd;
+  it->len = len;
+  if (len > 0)
+    memcpy(it->data,data,len);
+  queue_push(&s_items,&it->node);
+  if (cas32(&s_waiting,1,0)) {
+    uint64_t one = 1;
+    if (write(s_wake,&one,sizeof(one)) < 0)
+      return;
+  }
+}
+
+// the reactor's side of read_async: pass on each chunk, and the end
+static int conn_ready(ReactorOp *op, int status) {
+  Conn *c = (Conn*)op->data;
+  ssize_t n = -1;
+  if (status == REACTOR_READY) {
+    n = read(c->fd,s_buff,READ_SIZE);
+    if (n > 0) {
+      post(MESSAGE,c->fd,s_buff,(int)n);
+      return 1;
+    }
+    if (n < 0 && errno == EAGAIN)
+      return 1;
+  }
+  // the main thread closes the fd, after any messages still queued for it
+  post(CLOSED,c->fd,NULL,0);
+  free(c);
+  return 0;
+}
+
+// the reactor's side of the pool: each client is handed over as it connects
+static int listen_ready(ReactorOp *op, int status) {
+  int fd;
+  if (status != REACTOR_READY)
+    return 0;
+  while ((fd = accept4(op->handle,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    post(CONNECTED,fd,NULL,0);
+  return 1;
+}
+
+static int write_all(int fd, const char *p, int len) {
+  while (len > 0) {
+    ssize_t n = write(fd,p,len);
+    if (n < 0) {
+      struct pollfd pf;
+      if (errno != EAGAIN)
+        return 0;
+      pf.fd = fd;
+      pf.events = POLLOUT;
+      poll(&pf,1,-1);
+      continue;
+    }
+    p += n;
+    len -= (int)n;
+  }
+  return 1;
+}
+
+// the callbacks, which would be Lua
+static void dispatch(Item *it) {
+  Conn *c;
+  switch (it->kind) {
+  case CONNECTED:
+    c = (Conn*)malloc(sizeof(Conn));
+    c->fd = it->fd;
+    reactor_init_op(&c->op,c->fd,REACTOR_FOREVER,conn_ready,c);
+    reactor_add(&c->op);
+    break;
+  case MESSAGE:
+    write_all(it->fd,it->data,it->len);
+    break;
+  case CLOSED:
+    close(it->fd);
+    break;
+  }
+  free(it);
+}
+
+// like dispatch mode's sleep: run what is queued, and wait when there is nothing
+static void run_server() {
+  while (! s_stop) {
+    QNode *n = queue_pop(&s_items);
+    if (n != NULL) {
+      dispatch((Item*)n);
+    } else {
+      uint64_t count;
+      // a full barrier, so that a push after the check is sure to see the flag
+      cas32(&s_waiting,0,1);
+      if (! queue_empty(&s_items) || s_stop)
+        continue;
+      if (read(s_wake,&count,sizeof(count)) < 0)
+        break;
+    }
+  }
+}
+
+static int connect_client() {
+  int fd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0);
+  if (fd < 0 || connect(fd,(struct sockaddr*)&s_addr,sizeof(s_addr)) != 0) {
+    perror("connect");
+    exit(1);
+  }
+  return fd;
+}
+
+static void round_trip(int fd, char *buff, int size) {
+  int got = 0;
+  if (! write_all(fd,buff,size)) {
+    perror("write");
+    exit(1);
+  }
+  while (got < size) {
+    ssize_t n = read(fd,buff + got,size - got);
+    if (n <= 0) {
+      perror("read");
+      exit(1);
+    }
+    got += (int)n;
+  }
+}
+
+typedef struct {
+  pthread_t thread;
+  int size;          // zero to only connect
+  int rounds;
+  TimingStats stats;
+} Client;
+
+static pthread_barrier_t s_start;
+
+static void *client_thread(void *arg) {
+  Client *cl = (Client*)arg;
+  char *buff = (char*)malloc(cl->size > 0 ? cl->size : 1);
+  int i, fd;
+  memset(buff,'x',cl->size > 0 ? cl->size : 1);
+  timing_reset(&cl->stats);
+  if (cl->size == 0) {
+    // each connection makes one round trip, so it has been through the callback
+    pthread_barrier_wait(&s_start);
+    for (i = 0; i < cl->rounds; i++) {
+      fd = connect_client();
+      round_trip(fd,buff,1);
+      close(fd);
+    }
+  } else {
+    fd = connect_client();
+    round_trip(fd,buff,1);
+    pthread_barrier_wait(&s_start);
+    for (i = 0; i < cl->rounds; i++) {
+      TimeNs t = timing_clock();
+      round_trip(fd,buff,cl->size);
+      timing_add(&cl->stats,timing_clock() - t);
+    }
+    close(fd);
+  }
+  free(buff);
+  return NULL;
+}
+
+static void merge(TimingStats *all, TimingStats *t) {
+  int i;
+  if (t->count == 0)
+    return;
+  if (all->count == 0 || t->min < all->min)
+    all->min = t->min;
+  if (t->max > all->max)
+    all->max = t->max;
+  all->count += t->count;
+  all->sum += t->sum;
+  for (i = 0; i < TIMING_BUCKETS; i++)
+    all->buckets[i] += t->buckets[i];
+}
+
+// n clients at once, between them either connecting or sending messages
+// about nmessages times
+static void run_clients(const char *test, int n, int size) {
+  Client *clients = (Client*)malloc(n*sizeof(Client));
+  TimingStats all;
+  TimeNs t;
+  double secs;
+  int i, rounds = (nmessages + n - 1)/n;
+  pthread_barrier_init(&s_start,NULL,n + 1);
+  for (i = 0; i < n; i++) {
+    clients[i].size = size;
+    clients[i].rounds = rounds;
+    pthread_create(&clients[i].thread,NULL,client_thread,&clients[i]);
+  }
+  pthread_barrier_wait(&s_start);
+  t = timing_clock();
+  for (i = 0; i < n; i++)
+    pthread_join(clients[i].thread,NULL);
+  secs = (timing_clock() - t)/1e9;
+  pthread_barrier_destroy(&s_start);
+  timing_reset(&all);
+  for (i = 0; i < n; i++)
+    merge(&all,&clients[i].stats);
+  printf("%s,%d,%d,%d,%.4f,%.0f",test,n,size,rounds*n,secs,rounds*n/secs);
+  if (all.count > 0)
+    printf(",%.1f,%.1f,%.1f\n",timing_percentile(&all,50)/1e3,
+      timing_percentile(&all,99)/1e3,timing_percentile(&all,99.9)/1e3);
+  else
+    printf(",,,\n");
+  fflush(stdout);
+  free(clients);
+}
+
+static void *bench_thread(void *arg) {
+  int i;
+  uint64_t one = 1;
+  (void)arg;
+  printf("test,clients,size,count,seconds,per_sec,p50_us,p99_us,p999_us\n");
+  run_clients("connect",nclients,0);
+  for (i = 0; i < nsizes; i++) {
+    run_clients("latency",1,sizes[i]);
+    run_clients("throughput",nclients,sizes[i]);
+  }
+  store_release(&s_stop,1);
+  if (write(s_wake,&one,sizeof(one)) < 0)
+    return NULL;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  ReactorOp listener;
+  pthread_t bench;
+  int i, fd;
+  if (argc > 1)
+    nclients = atoi(argv[1]);
+  if (argc > 2)
+    nmessages = atoi(argv[2]);
+  for (i = 3; i < argc && nsizes < MAX_SIZES; i++)
+    sizes[nsizes++] = atoi(argv[i]);
+  if (nsizes == 0) {
+    sizes[0] = 16; sizes[1] = 256; sizes[2] = 4096; sizes[3] = 65536;
+    nsizes = 4;
+  }
+  if (nclients < 1 || nmessages < 1) {
+    fprintf(stderr,"usage: bench-pipes [clients] [messages] [sizes...]\n");
+    return 1;
+  }
+  for (i = 0; i < nsizes; i++) {
+    if (sizes[i] < 1) {
+      fprintf(stderr,"message sizes must be more than zero\n");
+      return 1;
+    }
+  }
+
+  queue_init(&s_items);
+  s_wake = eventfd(0,EFD_CLOEXEC);
+  memset(&s_addr,0,sizeof(s_addr));
+  s_addr.sun_family = AF_UNIX;
+  snprintf(s_addr.sun_path,sizeof(s_addr.sun_path),"/tmp/winapi-bench-%d",(int)getpid());
+  fd = socket(AF_UNIX,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+  if (fd < 0 || bind(fd,(struct sockaddr*)&s_addr,sizeof(s_addr)) != 0 || listen(fd,SOMAXCONN) != 0) {
+    perror(s_addr.sun_path);
+    return 1;
+  }
+  reactor_init_op(&listener,fd,REACTOR_FOREVER,listen_ready,NULL);
+  reactor_add(&listener);
+
+  pthread_create(&bench,NULL,bench_thread,NULL);
+  run_server();
+  pthread_join(bench,NULL);
+  unlink(s_addr.sun_path);
+  return 0;
+}
@@ -0,0 +1,113 @@
+/* Relaying between pipes, the C version of what winapi.pump replaces.
+   A thread feeds one pipe and another drains a second, and the main thread
+   copies from the first to the second: as a script did with read_async and
+   write, in 2K chunks each made into a string and written with the Lua
+   mutex held; as the pump does, in 64K pieces with no strings and no lock;
+   and with splice(2), for reference.
+   usage: bench-pump [megabytes]
+*/
+#define _GNU_SOURCE  // for splice and F_SETPIPE_SZ
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "timing.h"
+
+#define PIECE 65536
+
+static int in[2], out[2];
+static long total;
+static pthread_mutex_t lua_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *feed(void *arg) {
+  static char b[PIECE];
+  long n = 0;
+  (void)arg;
+  memset(b,'x',sizeof(b));
+  while (n < total) {
+    ssize_t w = write(in[1],b,sizeof(b));
+    if (w <= 0)
+      break;
+    n += w;
+  }
+  close(in[1]);
+  return NULL;
+}
+
+static void *drain(void *arg) {
+  static char b[PIECE];
+  (void)arg;
+  while (read(out[0],b,sizeof(b)) > 0)
+    ;
+  close(out[0]);
+  return NULL;
+}
+
+static void write_all(int fd, const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd,p,n);
+    if (w <= 0)
+      return;
+    p += w;
+    n -= w;
+  }
+}
+
+static long relay(int mode) {
+  static char buf[PIECE];
+  long moved = 0;
+  ssize_t n;
+  if (mode == 0) {
+    // read_async then File:write: a string for each chunk, and the mutex
+    while ((n = read(in[0],buf,2048)) > 0) {
+      char *s;
+      pthread_mutex_lock(&lua_mutex);
+      s = (char*)malloc(n);
+      memcpy(s,buf,n);
+      write_all(out[1],s,n);
+      free(s);
+      pthread_mutex_unlock(&lua_mutex);
+      moved += n;
+    }
+  } else if (mode == 1) {
+    while ((n = read(in[0],buf,PIECE)) > 0) {
+      write_all(out[1],buf,n);
+      moved += n;
+    }
+  } else {
+    while ((n = splice(in[0],NULL,out[1],NULL,1<<20,SPLICE_F_MOVE)) > 0)
+      moved += n;
+  }
+  return moved;
+}
+
+int main(int argc, char **argv) {
+  int mb = argc > 1 ? atoi(argv[1]) : 2048, mode;
+  if (mb < 1) {
+    fprintf(stderr,"usage: bench-pump [megabytes]\n");
+    return 1;
+  }
+  total = (long)mb << 20;
+  for (mode = 0; mode < 3; mode++) {
+    pthread_t feeder, drainer;
+    TimeNs start;
+    long moved;
+    if (pipe(in) != 0 || pipe(out) != 0)
+      return 1;
+    fcntl(in[0],F_SETPIPE_SZ,1<<20);
+    fcntl(out[0],F_SETPIPE_SZ,1<<20);
+    start = timing_clock();
+    pthread_create(&feeder,NULL,feed,NULL);
+    pthread_create(&drainer,NULL,drain,NULL);
+    moved = relay(mode);
+    close(in[0]);
+    close(out[1]);
+    pthread_join(feeder,NULL);
+    pthread_join(drainer,NULL);
+    printf("%-16s %.2f GB/s\n",mode == 0 ? "read_async/write" : mode == 1 ? "pump 64K" : "splice",
+      moved/((timing_clock() - start)/1e9)/1e9);
+  }
+  return 0;
+}
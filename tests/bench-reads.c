@@ -0,0 +1,75 @@
+/* Pipe bandwidth by read size, as set with File:read_size. A child writes
+   zeros down a pipe, and they are read in pieces of 2K, 64K, 1M and 4M.
+   Each piece is filled as File:read(n) fills it, and then made into one
+   string: malloc and copy, standing in for a Lua string.
+   usage: bench-reads [megabytes]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "timing.h"
+
+#define WRITE_SIZE (1<<20)
+
+// a child which writes total bytes of zeros down a pipe
+static int spawn_writer(size_t total) {
+  int fd[2];
+  if (pipe(fd) != 0)
+    return -1;
+  if (fork() == 0) {
+    char *b = (char*)calloc(1,WRITE_SIZE);
+    size_t w;
+    close(fd[0]);
+    for (w = 0; w < total; ) {
+      ssize_t n = write(fd[1],b,total - w < WRITE_SIZE ? total - w : WRITE_SIZE);
+      if (n <= 0)
+        break;
+      w += n;
+    }
+    _exit(0);
+  }
+  close(fd[1]);
+  return fd[0];
+}
+
+int main(int argc, char **argv) {
+  size_t sizes[] = {2048, 65536, 1<<20, 4<<20}, total;
+  int mb = argc > 1 ? atoi(argv[1]) : 512, k;
+  if (mb < 1) {
+    fprintf(stderr,"usage: bench-reads [megabytes]\n");
+    return 1;
+  }
+  total = (size_t)mb << 20;
+  for (k = 0; k < 4; k++) {
+    int fd = spawn_writer(total);
+    char *buf = (char*)malloc(sizes[k]);
+    size_t got = 0;
+    long reads = 0, strings = 0;
+    TimeNs start = timing_clock();
+    double secs;
+    for (;;) {
+      size_t have = 0;
+      ssize_t n;
+      char *s;
+      while (have < sizes[k] && (n = read(fd,buf + have,sizes[k] - have)) > 0) {
+        have += n;
+        ++reads;
+      }
+      if (have == 0)
+        break;
+      s = (char*)malloc(have);
+      memcpy(s,buf,have);
+      free(s);
+      ++strings;
+      got += have;
+    }
+    secs = (timing_clock() - start)/1e9;
+    close(fd);
+    wait(NULL);
+    free(buf);
+    printf("read(%7lu): %.0f MB/s, %ld reads, %ld strings\n",(unsigned long)sizes[k],got/1e6/secs,reads,strings);
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+/* How late do timers fire? The C version of examples/bench-timers.lua.
+   Starts n timers on the reactor, with periods of 50-99 msec, and measures
+   how long after each interval every callback comes, for a few seconds.
+   The lateness is kept as a TimingStats (timing.c), and the CPU time used
+   is reported as well, since checking every timer on every wakeup shows
+   up there first. Given some slack, the timers share wakeups, and the
+   reactor's counts show how many were saved.
+   usage: bench-timers [timers] [seconds] [slack]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "reactor.h"
+#include "timing.h"
+#include "atomics.h"
+
+typedef struct {
+  ReactorOp op;
+  TimeNs last;
+} Timer;
+
+static TimingStats lateness;
+static volatile long early = 0;
+static volatile int stop = 0;
+
+// called on the reactor thread, so the stats need no lock
+static int timer_fired(ReactorOp *op, int status) {
+  Timer *t = (Timer*)op->data;
+  TimeNs now = timing_clock(), due = t->last + (TimeNs)op->timeout*1000000;
+  (void)status;
+  if (now < due)
+    ++early;
+  else
+    timing_add(&lateness,now - due);
+  t->last = now;
+  return ! load_acquire(&stop);
+}
+
+static double cpu_secs(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF,&ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)/1e6;
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000, secs = argc > 2 ? atoi(argv[2]) : 3;
+  int slack = argc > 3 ? atoi(argv[3]) : 0, i;
+  Timer *timers;
+  ReactorStats stats;
+  if (n < 1 || secs < 1 || slack < 0) {
+    fprintf(stderr,"usage: bench-timers [timers] [seconds] [slack]\n");
+    return 1;
+  }
+  timers = (Timer*)calloc(n,sizeof(Timer));
+  timing_reset(&lateness);
+  for (i = 0; i < n; i++) {
+    reactor_init_op(&timers[i].op,REACTOR_NO_HANDLE,50 + i % 50,timer_fired,&timers[i]);
+    timers[i].op.slack = slack;
+    timers[i].last = timing_clock();
+    reactor_add(&timers[i].op);
+  }
+  sleep(secs);
+  store_release(&stop,1);
+  usleep(200000);
+  reactor_stats(&stats);
+  printf("%d timers, %d s, slack %d: %llu fires, %ld early\n",n,secs,slack,lateness.count,early);
+  printf("wakeups %lu timeouts %lu saved %lu\n",stats.wakeups,stats.timeouts,stats.saved);
+  printf("lateness msec: mean %.2f p50 %.2f p99 %.2f max %.2f\n",
+    lateness.count > 0 ? lateness.sum/lateness.count/1e6 : 0.0,
+    timing_percentile(&lateness,50)/1e6,timing_percentile(&lateness,99)/1e6,lateness.max/1e6);
+  printf("cpu %.2f s\n",cpu_secs());
+  return 0;
+}
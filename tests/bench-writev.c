@@ -0,0 +1,63 @@
+/* Small messages in three pieces down a pipe, as File:writev sends them.
+   Each message is a header, a body and CRLF, written with three writes,
+   gathered into one buffer for a single write (which is what File:writev
+   does), or with writev(2) for comparison. A thread drains the pipe.
+   usage: bench-writev [messages]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "timing.h"
+
+static int fds[2];
+
+static void *drain(void *arg) {
+  char buf[65536];
+  (void)arg;
+  while (read(fds[0],buf,sizeof(buf)) > 0)
+    ;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  char hdr[8] = {'L','E','N',':','0','0','3','2'}, body[32], tail[2] = {'\r','\n'}, buf[64];
+  struct iovec v[3];
+  int n = argc > 1 ? atoi(argv[1]) : 1000000, i, way;
+  pthread_t thread;
+  if (n < 1 || pipe(fds) != 0) {
+    fprintf(stderr,"usage: bench-writev [messages]\n");
+    return 1;
+  }
+  memset(body,'x',sizeof(body));
+  v[0].iov_base = hdr;  v[0].iov_len = sizeof(hdr);
+  v[1].iov_base = body; v[1].iov_len = sizeof(body);
+  v[2].iov_base = tail; v[2].iov_len = sizeof(tail);
+  pthread_create(&thread,NULL,drain,NULL);
+  for (way = 0; way < 3; way++) {
+    TimeNs start = timing_clock();
+    for (i = 0; i < n; i++) {
+      if (way == 0) {
+        if (write(fds[1],hdr,sizeof(hdr)) < 0 || write(fds[1],body,sizeof(body)) < 0
+            || write(fds[1],tail,sizeof(tail)) < 0)
+          break;
+      } else if (way == 1) {
+        memcpy(buf,hdr,sizeof(hdr));
+        memcpy(buf + sizeof(hdr),body,sizeof(body));
+        memcpy(buf + sizeof(hdr) + sizeof(body),tail,sizeof(tail));
+        if (write(fds[1],buf,sizeof(hdr) + sizeof(body) + sizeof(tail)) < 0)
+          break;
+      } else {
+        if (writev(fds[1],v,3) < 0)
+          break;
+      }
+    }
+    printf("%-10s %d messages %.3f s\n",way == 0 ? "3 writes" : way == 1 ? "gathered" : "writev",
+      n,(timing_clock() - start)/1e9);
+  }
+  close(fds[1]);
+  pthread_join(thread,NULL);
+  return 0;
+}
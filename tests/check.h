@@ -0,0 +1,37 @@
+#ifndef CHECK_H
+#define CHECK_H
+// Just enough of a harness for the C tests: check() reports a failed
+// condition with its line and carries on, and check_done() prints the
+// result and gives the exit status for main.
+#include <stdio.h>
+
+static int check_failures = 0;
+
+#define check(cond) ((cond) ? (void)0 : check_failed(__FILE__,__LINE__,#cond))
+
+static inline void check_failed(const char *file, int line, const char *cond) {
+  // a fuzz loop which goes wrong once usually goes wrong a lot
+  if (++check_failures <= 10)
+    fprintf(stderr,"%s:%d: check failed: %s\n",file,line,cond);
+}
+
+static inline int check_done(const char *name) {
+  if (check_failures > 0) {
+    printf("%s: %d checks failed\n",name,check_failures);
+    return 1;
+  }
+  printf("%s: ok\n",name);
+  return 0;
+}
+
+// xorshift, so that a failing run can be repeated exactly
+static unsigned long long check_seed = 88172645463325252ULL;
+
+static inline unsigned check_rand(void) {
+  check_seed ^= check_seed << 13;
+  check_seed ^= check_seed >> 7;
+  check_seed ^= check_seed << 17;
+  return (unsigned)(check_seed >> 32);
+}
+
+#endif
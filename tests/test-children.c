@@ -0,0 +1,93 @@
+/* Supervising many child processes from the reactor, as wait_async does
+   for Processes. Each child is waited for through a pidfd, and its exit
+   status collected in the callback, which then frees the op and closes
+   the fd. All of them must be collected, and the process must never need
+   more than the main thread and the reactor thread, however many
+   children there are.
+*/
+#define _GNU_SOURCE  // for P_PIDFD
+#include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "reactor.h"
+#include "atomics.h"
+#include "check.h"
+
+#define NCHILD 300
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+typedef struct {
+  ReactorOp op;
+  pid_t pid;
+  int fd;
+} Child;
+
+static volatile long done = 0, bad = 0;
+
+static int child_exited(ReactorOp *op, int status) {
+  Child *c = (Child*)op->data;
+  siginfo_t si;
+  if (status != REACTOR_READY || waitid((idtype_t)P_PIDFD,c->fd,&si,WEXITED) != 0
+      || si.si_status != (c->pid & 0x7F))
+    atomic_inc(&bad);
+  close(c->fd);
+  free(c);
+  atomic_inc(&done);
+  return 0;
+}
+
+static int count_threads(void) {
+  int n = 0;
+  struct dirent *e;
+  DIR *d = opendir("/proc/self/task");
+  if (d == NULL)
+    return 0;
+  while ((e = readdir(d)) != NULL)
+    if (e->d_name[0] != '.')
+      ++n;
+  closedir(d);
+  return n;
+}
+
+int main() {
+  int i, most = 0, n;
+  for (i = 0; i < NCHILD; i++) {
+    Child *c;
+    pid_t pid = fork();
+    if (pid == 0) {
+      usleep(1000*(i % 50));
+      _exit(getpid() & 0x7F);
+    }
+    c = (Child*)malloc(sizeof(Child));
+    c->pid = pid;
+    c->fd = (int)syscall(SYS_pidfd_open,pid,0);
+    if (c->fd < 0) {
+      // before Linux 5.3; reap what there is and give up
+      printf("children: skipped, no pidfd_open (errno %d)\n",errno);
+      while (wait(NULL) > 0)
+        ;
+      return 0;
+    }
+    reactor_init_op(&c->op,c->fd,REACTOR_FOREVER,child_exited,c);
+    reactor_add(&c->op);
+    n = count_threads();
+    if (n > most)
+      most = n;
+  }
+  for (i = 0; i < 500 && load_acquire(&done) < NCHILD; i++) {
+    n = count_threads();
+    if (n > most)
+      most = n;
+    usleep(10000);
+  }
+  check(done == NCHILD);
+  check(bad == 0);
+  check(most <= 2);
+  return check_done("children");
+}
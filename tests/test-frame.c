@@ -0,0 +1,124 @@
+/* Tests for ring_frame and ring_put_length.
+   A thread writes framed messages of up to 70K down a Unix socket in
+   pieces of random size, and they are read into a ring buffer in pieces
+   of other random sizes, as File:read_message reads them. Every message
+   must come out whole and in order. Then the lengths at the edges of each
+   varint byte, up to RING_FRAME_MAX, must be read back with the right
+   header size, and a length which runs on too long must be refused.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "ring.h"
+#include "check.h"
+
+#define NMSG 200000
+#define BATCH (1<<19)
+
+static int sv[2];
+static char scratch[1<<20];
+
+static unsigned msg_len(unsigned i) {
+  unsigned r = i*2654435761u;
+  return r % 10 == 0 ? r % 70000 : r % 200;
+}
+
+static char msg_byte(unsigned i, unsigned j) {
+  return (char)(i*31 + j*7);
+}
+
+// check_rand is for the main thread, so this has its own
+static void *writer(void *arg) {
+  static char buf[BATCH + 70000 + RING_FRAME_HEADER];
+  unsigned i, j, n = 0, seed = 7;
+  (void)arg;
+  for (i = 0; i < NMSG; i++) {
+    unsigned len = msg_len(i), off = 0;
+    n += ring_put_length(buf + n,len);
+    for (j = 0; j < len; j++)
+      buf[n++] = msg_byte(i,j);
+    if (n < BATCH && i < NMSG - 1)
+      continue;
+    while (off < n) {
+      ssize_t w;
+      seed = seed*1103515245 + 12345;
+      w = write(sv[0],buf + off,1 + (seed >> 8) % (n - off));
+      if (w <= 0)
+        break;
+      off += w;
+    }
+    n = 0;
+  }
+  close(sv[0]);
+  return NULL;
+}
+
+static void test_stream(void) {
+  RingBuf r;
+  pthread_t thread;
+  unsigned got = 0, hdr, space, j;
+  int len = RING_PARTIAL;
+  check(socketpair(AF_UNIX,SOCK_STREAM,0,sv) == 0);
+  ring_init(&r);
+  pthread_create(&thread,NULL,writer,NULL);
+  for (;;) {
+    char *p = ring_space(&r,1 + check_rand() % 9000,&space);
+    ssize_t n = read(sv[1],p,1 + check_rand() % space);
+    if (n <= 0)
+      break;
+    ring_commit(&r,n);
+    while ((len = ring_frame(&r,&hdr)) >= 0) {
+      const char *q = ring_peek(&r,len,scratch);
+      unsigned mlen = len - hdr;
+      check(mlen == msg_len(got));
+      for (j = 0; j < mlen && j < msg_len(got); j++)
+        if (q[hdr + j] != msg_byte(got,j))
+          break;
+      check(j == mlen);
+      ++got;
+      ring_consume(&r,len);
+    }
+    check(len != RING_BAD);
+    if (len == RING_BAD)
+      break;
+  }
+  pthread_join(thread,NULL);
+  close(sv[1]);
+  check(got == NMSG);
+  check(ring_count(&r) == 0);
+  ring_free(&r);
+}
+
+static void test_lengths(void) {
+  unsigned lens[] = {0, 1, 127, 128, 16383, 16384, 2097151, 2097152, 268435455, 268435456, RING_FRAME_MAX};
+  unsigned hdr, space;
+  RingBuf r;
+  char *p;
+  int i, k;
+  for (i = 0; i < (int)(sizeof(lens)/sizeof(lens[0])); i++) {
+    char h[RING_FRAME_HEADER];
+    k = ring_put_length(h,lens[i]);
+    ring_init(&r);
+    p = ring_space(&r,k,&space);
+    memcpy(p,h,k);
+    ring_commit(&r,k);
+    // only the header is there, so all but the empty message are partial
+    check(ring_frame(&r,&hdr) == (lens[i] == 0 ? k : RING_PARTIAL));
+    check(hdr == (unsigned)k);
+    ring_free(&r);
+  }
+  ring_init(&r);
+  p = ring_space(&r,RING_FRAME_HEADER,&space);
+  memcpy(p,"\xff\xff\xff\xff\x7f",RING_FRAME_HEADER);
+  ring_commit(&r,RING_FRAME_HEADER);
+  check(ring_frame(&r,&hdr) == RING_BAD);
+  ring_free(&r);
+}
+
+int main() {
+  test_stream();
+  test_lengths();
+  return check_done("frame");
+}
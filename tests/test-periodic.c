@@ -0,0 +1,80 @@
+/* Tests for periodic reactor ops.
+   Ops with periods from half a msec to 10 msec run for a second, some of
+   them with a callback which is sometimes too slow, so that deadlines are
+   missed. No callback may come before the deadline it is for, and every
+   deadline must be a whole number of periods after the first, so that
+   nothing drifts. With 'catchup' every deadline gets a callback; with
+   'skip' the callbacks and the deadlines skipped between them must add up
+   to the time run for.
+*/
+#include <unistd.h>
+#include "reactor.h"
+#include "atomics.h"
+#include "check.h"
+
+#define NOPS 6
+#define RUN_USEC 1000000
+#define LAG_USEC 50000
+
+typedef struct {
+  ReactorOp op;
+  ReactorTime first, last;  // deadlines called back for
+  ReactorTime next;         // the one which should come next
+  long calls, missed, skipped;
+  int slow;                 // usec to sleep in every tenth callback
+} Periodic;
+
+static volatile int stop = 0;
+
+static int periodic_ready(ReactorOp *op, int status) {
+  Periodic *p = (Periodic*)op->data;
+  // the reactor has already moved the deadline on, past any it skipped
+  ReactorTime skipped = op->policy == REACTOR_SKIP ? op->overruns : 0;
+  ReactorTime due = op->deadline - (skipped + 1)*op->period;
+  check(status == REACTOR_TIMEOUT);
+  check(reactor_clock() >= due);
+  if (p->calls == 0) {
+    p->first = due;
+  } else {
+    check(due == p->next);
+    check((due - p->first) % op->period == 0);
+    p->missed += p->skipped;
+  }
+  p->last = due;
+  p->next = op->deadline;
+  p->skipped = (long)skipped;
+  ++p->calls;
+  if (p->slow && p->calls % 10 == 0)
+    usleep(p->slow);
+  return ! load_acquire(&stop);
+}
+
+int main() {
+  static Periodic ps[NOPS];
+  ReactorTime periods[NOPS] = {500, 1000, 2500, 10000, 1000, 1000};
+  int policies[NOPS] = {REACTOR_SKIP, REACTOR_SKIP, REACTOR_SKIP, REACTOR_SKIP, REACTOR_SKIP, REACTOR_CATCH_UP};
+  int slow[NOPS] = {0, 0, 0, 0, 3000, 3000};
+  int i;
+  for (i = 0; i < NOPS; i++) {
+    reactor_init_op(&ps[i].op,REACTOR_NO_HANDLE,REACTOR_FOREVER,periodic_ready,&ps[i]);
+    reactor_set_period(&ps[i].op,periods[i],policies[i]);
+    ps[i].slow = slow[i];
+    reactor_add(&ps[i].op);
+  }
+  usleep(RUN_USEC);
+  store_release(&stop,1);
+  usleep(100000);
+  for (i = 0; i < NOPS; i++) {
+    Periodic *p = &ps[i];
+    // deadlines from the first to the last, whether called back or skipped
+    long deadlines = (long)((p->last - p->first)/periods[i]) + 1;
+    long expect = RUN_USEC/(long)periods[i];
+    check(p->calls > 0);
+    check(deadlines == p->calls + p->missed);
+    // give or take the start and the stop; the slow callbacks hold up the
+    // others, and a catchup op may still be working through its backlog
+    check(deadlines >= expect - LAG_USEC/(long)periods[i] - 2);
+    check(deadlines <= expect + 100000/(long)periods[i] + 2);
+  }
+  return check_done("periodic");
+}
@@ -0,0 +1,132 @@
+/* Tests for pool.c.
+   Producer threads allocate callback parameters from a Pool and their text
+   from an Arena, fill them in, and push them onto a queue; one consumer
+   checks and frees them, as the dispatch queue does. Some texts are too big
+   for the arena and some parameters come when the pool is empty, so the
+   malloc fallbacks are freed through the same calls. The stress is run
+   again with the pool's ABA tag about to pass 2^31 and 2^32.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "queue.h"
+#include "pool.h"
+#include "check.h"
+
+#define PRODUCERS 8
+#define PER_PRODUCER 50000
+#define POOL_ITEMS 64
+#define ARENA_SIZE (1 << 14)
+#define IN_FLIGHT 100   // more than the pool holds, so that it sometimes runs out
+
+typedef struct {
+  QNode node;
+  int producer;
+  int seq;
+  char *text;
+  int len;
+} Event;
+
+static Queue q;
+static Pool pool;
+static Arena arena;
+static volatile long in_flight;
+
+static void *producer(void *arg) {
+  int p = (int)(size_t)arg, i, k;
+  unsigned r = p*7919 + 1;
+  for (i = 0; i < PER_PRODUCER; i++) {
+    Event *e;
+    while (__atomic_load_n(&in_flight,__ATOMIC_ACQUIRE) > IN_FLIGHT)
+      sched_yield();
+    __atomic_add_fetch(&in_flight,1,__ATOMIC_SEQ_CST);
+    e = (Event*)pool_alloc(&pool);
+    r = r*1103515245 + 12345;
+    e->len = (r >> 16) % 200;
+    if ((r >> 8) % 100 == 0)
+      e->len = ARENA_SIZE; // too big for the arena
+    e->text = (char*)arena_alloc(&arena,e->len + 1);
+    for (k = 0; k < e->len; k++)
+      e->text[k] = (char)(p + i + k);
+    e->text[e->len] = '\0';
+    e->producer = p;
+    e->seq = i;
+    queue_push(&q,&e->node);
+  }
+  return NULL;
+}
+
+static void stress(atomic64 tag) {
+  pthread_t threads[PRODUCERS];
+  int next[PRODUCERS], p, k, got = 0;
+  queue_init(&q);
+  pool_init(&pool,sizeof(Event),POOL_ITEMS);
+  pool.head = (atomic64)(((unsigned long long)tag << 32) | (unsigned)(pool.head & 0xFFFFFFFF));
+  arena_init(&arena,ARENA_SIZE);
+  in_flight = 0;
+  for (p = 0; p < PRODUCERS; p++) {
+    next[p] = 0;
+    pthread_create(&threads[p],NULL,producer,(void*)(size_t)p);
+  }
+  while (got < PRODUCERS*PER_PRODUCER) {
+    Event *e = (Event*)queue_pop(&q);
+    int ok = 1;
+    if (e == NULL) {
+      sched_yield();
+      continue;
+    }
+    check(e->seq == next[e->producer]);
+    next[e->producer] = e->seq + 1;
+    for (k = 0; k < e->len; k++)
+      ok = ok && e->text[k] == (char)(e->producer + e->seq + k);
+    check(ok && e->text[e->len] == '\0');
+    arena_free(&arena,e->text);
+    pool_free(&pool,e);
+    __atomic_sub_fetch(&in_flight,1,__ATOMIC_SEQ_CST);
+    ++got;
+  }
+  for (p = 0; p < PRODUCERS; p++)
+    pthread_join(threads[p],NULL);
+  check(pool.hits + pool.misses == PRODUCERS*PER_PRODUCER);
+  check(pool.hits > 0 && arena.hits > 0 && arena.misses > 0);
+  // everything has been given back
+  check(arena.tail == arena.head);
+  free(pool.items);
+  free((void*)pool.next);
+  free(arena.buf);
+}
+
+// one thread: the pool hands out each item once, then falls back to malloc
+static void test_exhaust(void) {
+  void *items[POOL_ITEMS + 1];
+  int i, j;
+  pool_init(&pool,16,POOL_ITEMS);
+  for (i = 0; i <= POOL_ITEMS; i++)
+    items[i] = pool_alloc(&pool);
+  check(pool.hits == POOL_ITEMS && pool.misses == 1);
+  for (i = 0; i < POOL_ITEMS; i++) {
+    check((char*)items[i] >= pool.items && (char*)items[i] < pool.items + 16*POOL_ITEMS);
+    for (j = 0; j < i; j++)
+      check(items[i] != items[j]);
+  }
+  check((char*)items[POOL_ITEMS] < pool.items || (char*)items[POOL_ITEMS] >= pool.items + 16*POOL_ITEMS);
+  for (i = POOL_ITEMS; i >= 0; i--)
+    pool_free(&pool,items[i]);
+  // all back, so the next round needs no malloc
+  for (i = 0; i < POOL_ITEMS; i++)
+    items[i] = pool_alloc(&pool);
+  check(pool.misses == 1);
+  for (i = 0; i < POOL_ITEMS; i++)
+    pool_free(&pool,items[i]);
+  free(pool.items);
+  free((void*)pool.next);
+}
+
+int main() {
+  test_exhaust();
+  stress(0);
+  stress(0x7FFFFFF0);
+  stress((atomic64)0xFFFFFFF0);
+  return check_done("pool");
+}
@@ -0,0 +1,92 @@
+/* Tests for queue.c.
+   Several producer threads push numbered nodes while one consumer pops
+   them. Every node must come out exactly once, and each producer's nodes
+   in the order it pushed them. The consumer also checks the queue when
+   it is empty and when it is refilled after being drained.
+*/
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "queue.h"
+#include "check.h"
+
+#define PRODUCERS 8
+#define PER_PRODUCER 200000
+
+typedef struct {
+  QNode node;
+  int producer;
+  int seq;
+} Item;
+
+static Queue q;
+static Item *items[PRODUCERS];
+
+static void *producer(void *arg) {
+  int p = (int)(size_t)arg, i;
+  for (i = 0; i < PER_PRODUCER; i++) {
+    Item *it = &items[p][i];
+    it->producer = p;
+    it->seq = i;
+    queue_push(&q,&it->node);
+    if (i % 1024 == 0)
+      sched_yield(); // so that the consumer sometimes catches up and finds it empty
+  }
+  return NULL;
+}
+
+// one thread on its own: FIFO, and the stub is recycled properly
+static void test_single(void) {
+  Item its[3];
+  int round, i;
+  queue_init(&q);
+  check(queue_empty(&q));
+  check(queue_pop(&q) == NULL);
+  for (round = 0; round < 3; round++) {
+    for (i = 0; i < 3; i++) {
+      its[i].seq = i;
+      queue_push(&q,&its[i].node);
+    }
+    check(! queue_empty(&q));
+    for (i = 0; i < 3; i++)
+      check(queue_pop(&q) == &its[i].node);
+    check(queue_pop(&q) == NULL);
+    check(queue_empty(&q));
+  }
+}
+
+static void test_producers(void) {
+  pthread_t threads[PRODUCERS];
+  int next[PRODUCERS], p, got = 0;
+  queue_init(&q);
+  for (p = 0; p < PRODUCERS; p++) {
+    items[p] = (Item*)calloc(PER_PRODUCER,sizeof(Item));
+    next[p] = 0;
+  }
+  for (p = 0; p < PRODUCERS; p++)
+    pthread_create(&threads[p],NULL,producer,(void*)(size_t)p);
+  while (got < PRODUCERS*PER_PRODUCER) {
+    Item *it = (Item*)queue_pop(&q);
+    if (it == NULL) {
+      sched_yield();
+      continue;
+    }
+    check(it->producer >= 0 && it->producer < PRODUCERS);
+    check(it->seq == next[it->producer]);
+    next[it->producer] = it->seq + 1;
+    ++got;
+  }
+  for (p = 0; p < PRODUCERS; p++) {
+    pthread_join(threads[p],NULL);
+    check(next[p] == PER_PRODUCER);
+    free(items[p]);
+  }
+  check(queue_pop(&q) == NULL);
+  check(queue_empty(&q));
+}
+
+int main() {
+  test_single();
+  test_producers();
+  return check_done("queue");
+}
@@ -0,0 +1,149 @@
+/* Tests for reactor.c, with epoll.
+   Thousands of eventfds are written by several threads at once while
+   hundreds of timers run; every write must be seen, every timer must fire
+   the right number of times, and cancelling must call back exactly the ops
+   cancelled, ignoring a stale id. A plain timeout must never come due
+   before its interval has passed.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "reactor.h"
+#include "atomics.h"
+#include "check.h"
+
+#define NFD 2000
+#define NTIMER 500
+#define FIRES 5
+#define PRODUCERS 4
+#define PER_PRODUCER 20000
+
+typedef struct {
+  ReactorOp op;
+  int fd;
+  unsigned id;
+} FdOp;
+
+typedef struct {
+  ReactorOp op;
+  int n;
+} TimerOp;
+
+static FdOp fds[NFD];
+static volatile long total = 0, timer_fires = 0, finished = 0, cancelled = 0, bad = 0;
+
+// wait up to about two seconds for a count to reach what it should
+static int wait_for(volatile long *count, long n) {
+  int i;
+  for (i = 0; i < 200 && load_acquire(count) < n; i++)
+    usleep(10000);
+  return load_acquire(count) == n;
+}
+
+static int fd_ready(ReactorOp *op, int status) {
+  FdOp *f = (FdOp*)op->data;
+  uint64_t v;
+  if (status == REACTOR_CANCELLED) {
+    atomic_inc(&cancelled);
+    return 0;
+  }
+  if (status == REACTOR_READY && read(f->fd,&v,sizeof(v)) == sizeof(v))
+    __sync_add_and_fetch(&total,(long)v);
+  return 1; // a timeout just waits again
+}
+
+static int timer_ready(ReactorOp *op, int status) {
+  TimerOp *t = (TimerOp*)op->data;
+  if (status != REACTOR_TIMEOUT)
+    atomic_inc(&bad);
+  atomic_inc(&timer_fires);
+  if (++t->n == FIRES) {
+    atomic_inc(&finished);
+    free(t);
+    return 0;
+  }
+  return 1;
+}
+
+static void *producer(void *arg) {
+  unsigned seed = (unsigned)(uintptr_t)arg;
+  int i;
+  for (i = 0; i < PER_PRODUCER; i++) {
+    uint64_t one = 1;
+    if (write(fds[rand_r(&seed) % NFD].fd,&one,sizeof(one)) != sizeof(one))
+      atomic_inc(&bad);
+  }
+  return NULL;
+}
+
+static void test_load(void) {
+  pthread_t threads[PRODUCERS];
+  int i;
+  for (i = 0; i < NFD; i++) {
+    fds[i].fd = eventfd(0,EFD_NONBLOCK);
+    // some of them time out over and over as well
+    reactor_init_op(&fds[i].op,fds[i].fd,i % 10 == 0 ? 20 : REACTOR_FOREVER,fd_ready,&fds[i]);
+    fds[i].id = reactor_add(&fds[i].op);
+  }
+  for (i = 0; i < NTIMER; i++) {
+    TimerOp *t = (TimerOp*)calloc(1,sizeof(TimerOp));
+    reactor_init_op(&t->op,REACTOR_NO_HANDLE,1 + i % 10,timer_ready,t);
+    reactor_add(&t->op);
+  }
+  for (i = 0; i < PRODUCERS; i++)
+    pthread_create(&threads[i],NULL,producer,(void*)(uintptr_t)(i + 1));
+  for (i = 0; i < PRODUCERS; i++)
+    pthread_join(threads[i],NULL);
+  check(wait_for(&total,PRODUCERS*PER_PRODUCER));
+  check(wait_for(&finished,NTIMER));
+  check(timer_fires == FIRES*NTIMER);
+
+  // cancel every other one, and once more with an id which is out of date
+  for (i = 0; i < NFD; i += 2)
+    check(reactor_cancel(&fds[i].op,fds[i].id));
+  check(reactor_cancel(&fds[1].op,fds[1].id + 12345));
+  check(wait_for(&cancelled,NFD/2));
+  usleep(50000);
+  check(cancelled == NFD/2);
+  check(bad == 0);
+}
+
+#define NEARLY 300
+
+typedef struct {
+  ReactorOp op;
+  ReactorTime start;
+} EarlyOp;
+
+static EarlyOp earlies[NEARLY];
+static volatile long early_done = 0, early = 0;
+
+static int early_ready(ReactorOp *op, int status) {
+  EarlyOp *e = (EarlyOp*)op->data;
+  if (status != REACTOR_TIMEOUT || reactor_clock() - e->start < (ReactorTime)op->timeout*1000)
+    atomic_inc(&early);
+  atomic_inc(&early_done);
+  return 0;
+}
+
+// timeouts started at odd moments within the msec
+static void test_not_early(void) {
+  int i;
+  for (i = 0; i < NEARLY; i++) {
+    EarlyOp *e = &earlies[i];
+    reactor_init_op(&e->op,REACTOR_NO_HANDLE,1 + i % 5,early_ready,e);
+    e->start = reactor_clock();
+    reactor_add(&e->op);
+    usleep(137);
+  }
+  check(wait_for(&early_done,NEARLY));
+  check(early == 0);
+}
+
+int main() {
+  test_load();
+  test_not_early();
+  return check_done("reactor");
+}
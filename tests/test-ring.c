@@ -0,0 +1,77 @@
+/* Tests for ring.c.
+   Random reads into the ring, searches for newlines and takes from the
+   tail are checked against a plain array model which holds the same bytes.
+   The ring must grow when asked for more than its free space, give back
+   the same bytes however they wrap around its end, and find the same
+   newline as memchr from any point, as a search resumed after more data
+   arrives does.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+#include "check.h"
+
+#define STEPS 1000000
+#define MAX_HELD (1<<21)
+
+static char model[1<<22], scratch[1<<22];
+static unsigned mhead, mtail;
+
+static void add(RingBuf *r) {
+  unsigned want = check_rand() % 5 == 0 ? check_rand() % 20000 : 0, n, k, i;
+  char *p = ring_space(r,want,&n);
+  check(p != NULL && n > 0);
+  if (p == NULL)
+    return;
+  check(r->size - ring_count(r) >= (want ? want : 1));
+  k = check_rand() % ((n < 3000 ? n : 3000) + 1);
+  for (i = 0; i < k; i++) {
+    char c = check_rand() % 4 == 0 ? '\n' : 'a' + check_rand() % 26;
+    p[i] = c;
+    model[mhead++] = c;
+  }
+  ring_commit(r,k);
+}
+
+static void find(RingBuf *r) {
+  unsigned count = mhead - mtail, from = check_rand() % (count + 1);
+  char *m = (char*)memchr(model + mtail + from,'\n',count - from);
+  int expect = m != NULL ? (int)(m - (model + mtail)) : -1;
+  check(ring_find(r,'\n',from) == expect);
+}
+
+static void take(RingBuf *r) {
+  unsigned n = check_rand() % (mhead - mtail + 1);
+  const char *p = ring_peek(r,n,scratch);
+  check(memcmp(p,model + mtail,n) == 0);
+  ring_consume(r,n);
+  mtail += n;
+}
+
+int main() {
+  RingBuf r;
+  long step;
+  ring_init(&r);
+  for (step = 0; step < STEPS; step++) {
+    int op = check_rand() % 3;
+    if (op == 0 && mhead - mtail < MAX_HELD)
+      add(&r);
+    else if (op == 1)
+      find(&r);
+    else if (mhead > mtail)
+      take(&r);
+    check(ring_count(&r) == mhead - mtail);
+    if (mtail > (1<<20)) {
+      memmove(model,model + mtail,mhead - mtail);
+      mhead -= mtail;
+      mtail = 0;
+    }
+    // now and then start again from nothing
+    if (mhead == mtail && check_rand() % 1000 == 0) {
+      ring_free(&r);
+      mhead = mtail = 0;
+    }
+  }
+  ring_free(&r);
+  return check_done("ring");
+}
@@ -0,0 +1,74 @@
+/* Tests for timing.c.
+   Percentiles from the histogram are compared with the exact ones from
+   the sorted samples, for distributions from small integers to values near
+   2^64: they must be within about 1.6% of the exact value, min and max must be
+   exact, and the clock must never go backwards.
+*/
+#include <stdlib.h>
+#include <math.h>
+#include "timing.h"
+#include "check.h"
+
+#define NSAMPLES 200000
+#define MAX_ERROR 0.0165  // half a bucket is 1/64, and a little more at the boundaries
+
+static int compare(const void *a, const void *b) {
+  TimeNs x = *(const TimeNs*)a, y = *(const TimeNs*)b;
+  return x < y ? -1 : x > y;
+}
+
+static TimeNs sample(int kind) {
+  double r = (double)check_rand()/4294967296.0;
+  switch (kind) {
+  case 0: return check_rand() % 40;                      // each in a bucket of its own
+  case 1: return (TimeNs)exp(r*40);                      // spread over many powers of two
+  case 2: return (TimeNs)1 << (check_rand() % 64);       // on bucket boundaries
+  case 3: return 0xFFFFFFFFFFFFFFFFULL - check_rand();   // in the top bucket
+  default: return (TimeNs)(1000 + r*r*1e6);              // a long tail, like real timings
+  }
+}
+
+static void test_percentiles(void) {
+  static TimingStats t;
+  double ps[] = {1, 10, 50, 90, 99, 99.9};
+  TimeNs *v = (TimeNs*)malloc(NSAMPLES*sizeof(TimeNs));
+  int kind, i, k;
+  for (kind = 0; kind < 5; kind++) {
+    timing_reset(&t);
+    for (i = 0; i < NSAMPLES; i++) {
+      v[i] = sample(kind);
+      timing_add(&t,v[i]);
+    }
+    qsort(v,NSAMPLES,sizeof(TimeNs),compare);
+    for (k = 0; k < (int)(sizeof(ps)/sizeof(ps[0])); k++) {
+      long idx = (long)ceil(ps[k]/100*NSAMPLES) - 1;
+      TimeNs exact = v[idx], got = timing_percentile(&t,ps[k]);
+      if (exact < 32)
+        check(got == exact);
+      else
+        check(fabs((double)got - (double)exact)/(double)exact <= MAX_ERROR);
+    }
+    check(t.count == NSAMPLES);
+    check(t.min == v[0] && t.max == v[NSAMPLES-1]);
+    check(timing_percentile(&t,0) == t.min && timing_percentile(&t,100) == t.max);
+  }
+  free(v);
+  timing_reset(&t);
+  check(timing_percentile(&t,50) == 0);
+}
+
+static void test_clock(void) {
+  TimeNs last = timing_clock(), now;
+  int i;
+  for (i = 0; i < 100000; i++) {
+    now = timing_clock();
+    check(now >= last);
+    last = now;
+  }
+}
+
+int main() {
+  test_percentiles();
+  test_clock();
+  return check_done("timing");
+}
@@ -0,0 +1,212 @@
+/* Tests for utf.c.
+   Well-formed text is made from random code points, so the expected UTF-8
+   and UTF-16 are known exactly. Ill-formed text is checked against the
+   maximal-subpart examples from the Unicode standard, and random bytes
+   must at least convert consistently: the size asked for is the size
+   given, a buffer one short is refused, and converting in pieces gives
+   the same as converting the whole.
+*/
+#include <string.h>
+#include "utf.h"
+#include "check.h"
+
+#define MAXLEN 512
+
+static int put_utf8(unsigned long cp, char *s) {
+  if (cp < 0x80) {
+    s[0] = (char)cp;
+    return 1;
+  } else if (cp < 0x800) {
+    s[0] = (char)(0xC0 | (cp >> 6));
+    s[1] = (char)(0x80 | (cp & 0x3F));
+    return 2;
+  } else if (cp < 0x10000) {
+    s[0] = (char)(0xE0 | (cp >> 12));
+    s[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    s[2] = (char)(0x80 | (cp & 0x3F));
+    return 3;
+  } else {
+    s[0] = (char)(0xF0 | (cp >> 18));
+    s[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    s[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    s[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+  }
+}
+
+static int put_utf16(unsigned long cp, utf16_t *w) {
+  if (cp < 0x10000) {
+    w[0] = (utf16_t)cp;
+    return 1;
+  }
+  cp -= 0x10000;
+  w[0] = (utf16_t)(0xD800 + (cp >> 10));
+  w[1] = (utf16_t)(0xDC00 + (cp & 0x3FF));
+  return 2;
+}
+
+// mostly ASCII runs, so that the vector paths are taken and left part way
+static unsigned long random_cp(void) {
+  unsigned long cp;
+  switch (check_rand() % 6) {
+  case 0: return 0x80 + check_rand() % 0x780;
+  case 1:
+    cp = 0x800 + check_rand() % 0xF800;
+    return cp >= 0xD800 && cp < 0xE000 ? 0x41 : cp;
+  case 2: return 0x10000 + check_rand() % 0x100000;
+  default: return check_rand() % 0x80;
+  }
+}
+
+// the text in random pieces must come out the same as the whole
+static void check_stream8(const char *s, int len, const utf16_t *whole, int wn) {
+  UtfStream st;
+  utf16_t out[MAXLEN*2];
+  int pos = 0, k = 0, r;
+  memset(&st,0,sizeof(st));
+  while (pos < len) {
+    int c = 1 + check_rand() % 8;
+    if (pos + c > len)
+      c = len - pos;
+    r = utf8_stream_to_utf16(&st,s + pos,c,out + k,c + 4,0);
+    check(r >= 0);
+    if (r < 0)
+      return;
+    k += r;
+    pos += c;
+  }
+  k += utf8_stream_to_utf16(&st,"",0,out + k,4,1);
+  check(k == wn && memcmp(out,whole,k*sizeof(utf16_t)) == 0);
+}
+
+static void check_stream16(const utf16_t *w, int wn) {
+  UtfStream st;
+  utf16_t out[MAXLEN*2];
+  const char *bytes = (const char*)w;
+  int pos = 0, k = 0, r, blen = wn*(int)sizeof(utf16_t);
+  memset(&st,0,sizeof(st));
+  while (pos < blen) {
+    int c = 1 + check_rand() % 7;
+    if (pos + c > blen)
+      c = blen - pos;
+    r = utf16_stream(&st,bytes + pos,c,out + k,c/2 + 2,0);
+    check(r >= 0);
+    if (r < 0)
+      return;
+    k += r;
+    pos += c;
+  }
+  k += utf16_stream(&st,"",0,out + k,2,1);
+  check(k == wn && memcmp(out,w,k*sizeof(utf16_t)) == 0);
+}
+
+static void test_well_formed(int iters) {
+  char s[MAXLEN + 4], back[MAXLEN*2];
+  utf16_t w[MAXLEN], out[MAXLEN];
+  int it;
+  for (it = 0; it < iters; it++) {
+    int len = 0, wn = 0, target = check_rand() % MAXLEN, n, m;
+    while (len < target) {
+      unsigned long cp = random_cp();
+      len += put_utf8(cp,s + len);
+      wn += put_utf16(cp,w + wn);
+    }
+    n = utf8_to_utf16(s,len,out,MAXLEN);
+    check(n == wn && memcmp(out,w,n*sizeof(utf16_t)) == 0);
+    check(utf8_to_utf16(s,len,NULL,0) == wn);
+    check(utf8_to_utf16(s,len,out,wn) == wn);
+    if (wn > 0)
+      check(utf8_to_utf16(s,len,out,wn - 1) == -1);
+    m = utf16_to_utf8(w,wn,back,sizeof(back));
+    check(m == len && memcmp(back,s,len) == 0);
+    check(utf16_to_utf8(w,wn,NULL,0) == len);
+    if (len > 0)
+      check(utf16_to_utf8(w,wn,back,len - 1) == -1);
+    check_stream8(s,len,w,wn);
+    check_stream16(w,wn);
+  }
+}
+
+typedef struct {
+  const char *in;
+  utf16_t out[16];
+} Example;
+
+// from the Unicode standard, 3.9: each maximal subpart becomes one U+FFFD
+static Example examples8[] = {
+  {"\x61\xF1\x80\x80\xE1\x80\xC2\x62\x80\x63\x80\xBF\x64",
+    {0x61,0xFFFD,0xFFFD,0xFFFD,0x62,0xFFFD,0x63,0xFFFD,0xFFFD,0x64,0}},
+  {"\xC0\xAF\xE0\x80\xBF\xF0\x81\x82\x41",
+    {0xFFFD,0xFFFD,0xFFFD,0xFFFD,0xFFFD,0xFFFD,0xFFFD,0xFFFD,0x41,0}},
+  {"\xED\xA0\x80\xED\xBF\xBF\xED\xAF\x41",
+    {0xFFFD,0xFFFD,0xFFFD,0xFFFD,0xFFFD,0xFFFD,0xFFFD,0xFFFD,0x41,0}},
+  {"\xF4\x91\x92\x93\xFF\x41\x80\xBF\x42",
+    {0xFFFD,0xFFFD,0xFFFD,0xFFFD,0xFFFD,0x41,0xFFFD,0xFFFD,0x42,0}},
+  {"\xE1\x80\xE2\xF0\x91\x92\xF1\xBF\x41",
+    {0xFFFD,0xFFFD,0xFFFD,0xFFFD,0x41,0}},
+  {"abc\xE2\x82",{0x61,0x62,0x63,0xFFFD,0}},
+};
+
+static void test_ill_formed8(void) {
+  utf16_t out[32];
+  int i, k;
+  for (i = 0; i < (int)(sizeof(examples8)/sizeof(examples8[0])); i++) {
+    const Example *ex = &examples8[i];
+    int n = utf8_to_utf16(ex->in,(int)strlen(ex->in),out,32);
+    for (k = 0; ex->out[k] != 0; k++)
+      ;
+    check(n == k && memcmp(out,ex->out,k*sizeof(utf16_t)) == 0);
+    check_stream8(ex->in,(int)strlen(ex->in),out,n);
+  }
+}
+
+// a lone surrogate becomes U+FFFD, which is three bytes of UTF-8
+static void test_ill_formed16(void) {
+  utf16_t lone[] = {0x41,0xD800,0x42,0xDC00,0xD800,0xD801,0xDC01};
+  const char *expect = "A\xEF\xBF\xBD" "B\xEF\xBF\xBD\xEF\xBF\xBD\xF0\x90\x90\x81";
+  char out[32];
+  int n = utf16_to_utf8(lone,7,out,32);
+  check(n == (int)strlen(expect) && memcmp(out,expect,n) == 0);
+  check(utf16_to_utf8(lone,7,NULL,0) == n);
+}
+
+// random bytes, with more bytes above 0x7F than real text would have
+static void test_random_bytes(int iters) {
+  char s[MAXLEN];
+  utf16_t w[MAXLEN];
+  char back[MAXLEN*3];
+  int it, i, k;
+  for (it = 0; it < iters; it++) {
+    int len = check_rand() % MAXLEN, mode = check_rand() % 3, n, m;
+    for (i = 0; i < len; i++) {
+      unsigned r = check_rand();
+      s[i] = (char)(mode == 0 ? r % 0x100 : mode == 1 ? r % 0x80 : (r & 3) ? r % 0x80 : 0x80 + (r >> 8) % 0x80);
+    }
+    n = utf8_to_utf16(s,len,w,MAXLEN);
+    check(n >= 0 && n <= len);
+    check(utf8_to_utf16(s,len,NULL,0) == n);
+    if (n > 0)
+      check(utf8_to_utf16(s,len,w,n - 1) == -1);
+    // what comes out is always well formed, so it goes back and forth exactly
+    for (k = 0; k < n; k++) {
+      if (w[k] >= 0xD800 && w[k] < 0xDC00) {
+        check(k + 1 < n && w[k+1] >= 0xDC00 && w[k+1] < 0xE000);
+        ++k;
+      } else {
+        check(w[k] < 0xDC00 || w[k] >= 0xE000);
+      }
+    }
+    m = utf16_to_utf8(w,n,back,sizeof(back));
+    check(m >= 0 && utf8_to_utf16(back,m,NULL,0) == n);
+    check_stream8(s,len,w,n);
+    check_stream16(w,n);
+  }
+}
+
+int main() {
+  test_well_formed(50000);
+  test_ill_formed8();
+  test_ill_formed16();
+  test_random_bytes(50000);
+  return check_done("utf");
+}
@@ -0,0 +1,112 @@
+/* Tests for wheel.c.
+   Random adds, removes and advances are checked against a plain model
+   which just remembers when each timer is due. A timer must fire on the
+   very tick it is due, never early, late or twice, including when it is
+   added again from inside its own callback; and wheel_next must never say
+   to sleep past the earliest timer. Each run starts at a different tick,
+   so that some of them cross the 32-bit wrap.
+*/
+#include <stdlib.h>
+#include "wheel.h"
+#include "check.h"
+
+#define NTIMERS 5000
+#define STEPS 5000
+
+typedef struct {
+  WheelTimer t;  // first, so that a WheelTimer* is a Timer*
+  int live;
+  unsigned due;
+} Timer;
+
+static Timer timers[NTIMERS];
+static TimerWheel w;
+
+static void fire(WheelTimer *wt, void *data) {
+  Timer *t = (Timer*)wt;
+  unsigned d;
+  (void)data;
+  check(t->live);
+  check(w.now == t->due);
+  t->live = 0;
+  if (check_rand() % 4 == 0) {
+    d = check_rand() % 3000;
+    t->live = 1;
+    t->due = w.now + (d ? d : 1);
+    wheel_add(&w,&t->t,w.now + d);
+  }
+}
+
+// mostly soon, but some for every level of the wheel and beyond it
+static unsigned random_delay(void) {
+  int r = check_rand() % 100;
+  if (r < 2)
+    return -(int)(check_rand() % 50); // already due
+  if (r < 60)
+    return check_rand() % 300;
+  if (r < 90)
+    return check_rand() % 100000;
+  if (r < 98)
+    return check_rand() % 20000000;
+  return 0x4000000u + check_rand() % 0x8000000u;
+}
+
+static void check_next(void) {
+  int next = wheel_next(&w), any = 0, i;
+  unsigned earliest = 0;
+  for (i = 0; i < NTIMERS; i++) {
+    if (timers[i].live) {
+      unsigned left = timers[i].due - w.now;
+      if (! any || left < earliest)
+        earliest = left;
+      any = 1;
+    }
+  }
+  check(any == (next >= 0));
+  check(! any || (unsigned)next <= earliest);
+}
+
+static void run(unsigned start) {
+  long step;
+  int i, live = 0;
+  for (i = 0; i < NTIMERS; i++)
+    timers[i].live = 0;
+  wheel_init(&w,start);
+  for (step = 0; step < STEPS; step++) {
+    int op = check_rand() % 10;
+    Timer *t = &timers[check_rand() % NTIMERS];
+    if (op < 4 && ! t->live) {
+      unsigned d = random_delay();
+      t->live = 1;
+      t->due = (int)d <= 0 ? w.now + 1 : w.now + d;
+      wheel_add(&w,&t->t,w.now + d);
+    } else if (op < 5 && t->live) {
+      wheel_remove(&w,&t->t);
+      t->live = 0;
+    } else {
+      int next = wheel_next(&w);
+      unsigned by;
+      check_next();
+      if (check_rand() % 3 == 0)
+        by = next > 0 ? (unsigned)next : 1;
+      else
+        by = check_rand() % (check_rand() % 20 == 0 ? 300000 : 400);
+      wheel_advance(&w,w.now + by,fire,NULL);
+      // anything due by now has fired
+      for (i = 0; i < NTIMERS; i++)
+        check(! timers[i].live || (int)(timers[i].due - w.now) > 0);
+    }
+  }
+  for (i = 0; i < NTIMERS; i++)
+    live += timers[i].live;
+  check(live == w.count);
+}
+
+int main() {
+  run(0);
+  run(12345);
+  run(0xFFFFF000u);
+  run(0xFFFFFFF0u);
+  run(0x7FFFFF00u);
+  return check_done("wheel");
+}
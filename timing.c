@@ -0,0 +1,116 @@
+/* Timing statistics. A value below 32 has a bucket of its own; above
+   that, each power of two gets 32 buckets, so a bucket is never wider than
+   1/32 of the values in it. A percentile is reported as the middle of the
+   bucket it falls in.
+*/
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "timing.h"
+
+#define SUB (1 << TIMING_SUB_BITS)
+
+/// the time in nsec, from a clock which only goes forward.
+// This is QueryPerformanceCounter on Windows, and CLOCK_MONOTONIC elsewhere.
+// @function timing_clock
+#ifdef _WIN32
+TimeNs timing_clock(void) {
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if (freq.QuadPart == 0)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (TimeNs)(now.QuadPart/freq.QuadPart)*1000000000
+    + (TimeNs)(now.QuadPart%freq.QuadPart)*1000000000/freq.QuadPart;
+}
+#else
+TimeNs timing_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (TimeNs)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+#endif
+
+// index of the highest bit set
+static int top_bit(TimeNs v) {
+  int e = 0;
+  if (v >> 32) { v >>= 32; e += 32; }
+  if (v >> 16) { v >>= 16; e += 16; }
+  if (v >> 8) { v >>= 8; e += 8; }
+  if (v >> 4) { v >>= 4; e += 4; }
+  if (v >> 2) { v >>= 2; e += 2; }
+  if (v >> 1) e += 1;
+  return e;
+}
+
+static int bucket_of(TimeNs v) {
+  int e;
+  if (v < SUB)
+    return (int)v;
+  e = top_bit(v);
+  return ((e - TIMING_SUB_BITS + 1) << TIMING_SUB_BITS) + (int)((v >> (e - TIMING_SUB_BITS)) - SUB);
+}
+
+// the middle of a bucket
+static TimeNs bucket_value(int b) {
+  int shift;
+  if (b < SUB)
+    return b;
+  shift = (b >> TIMING_SUB_BITS) - 1;
+  return ((TimeNs)(SUB + (b & (SUB - 1))) << shift) + (((TimeNs)1 << shift) >> 1);
+}
+
+/// clear the statistics.
+// @param t the statistics
+// @function timing_reset
+void timing_reset(TimingStats *t) {
+  int i;
+  t->count = 0;
+  t->min = t->max = 0;
+  t->sum = 0;
+  for (i = 0; i < TIMING_BUCKETS; i++)
+    t->buckets[i] = 0;
+}
+
+/// add a timing.
+// @param t the statistics
+// @param ns the time taken
+// @function timing_add
+void timing_add(TimingStats *t, TimeNs ns) {
+  if (t->count == 0 || ns < t->min)
+    t->min = ns;
+  if (ns > t->max)
+    t->max = ns;
+  ++t->count;
+  t->sum += (double)ns;
+  ++t->buckets[bucket_of(ns)];
+}
+
+/// a percentile of the timings.
+// @param t the statistics
+// @param p the percentile, from 0 to 100
+// @return the time, or 0 if there are no timings
+// @function timing_percentile
+TimeNs timing_percentile(TimingStats *t, double p) {
+  unsigned long long rank, seen = 0;
+  TimeNs v;
+  int b;
+  if (t->count == 0)
+    return 0;
+  if (p <= 0)
+    return t->min;
+  if (p >= 100)
+    return t->max;
+  rank = (unsigned long long)(p/100*t->count);
+  if (rank < p/100*t->count || rank == 0)
+    ++rank;
+  for (b = 0; b < TIMING_BUCKETS; b++) {
+    seen += t->buckets[b];
+    if (seen >= rank)
+      break;
+  }
+  v = bucket_value(b);
+  return v < t->min ? t->min : (v > t->max ? t->max : v);
+}
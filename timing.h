@@ -0,0 +1,24 @@
+#ifndef TIMING_H
+#define TIMING_H
+// A monotonic clock in nsec, and running statistics for timings. These are
+// kept in a log-linear histogram, so percentiles need no memory per sample
+// and are good to within about 1.6%. This does not depend on windows.h.
+
+typedef unsigned long long TimeNs;
+
+#define TIMING_SUB_BITS 5  // each power of two is split into 32 buckets
+#define TIMING_BUCKETS ((65 - TIMING_SUB_BITS) << TIMING_SUB_BITS)
+
+typedef struct {
+  unsigned long long count;
+  TimeNs min, max;
+  double sum;
+  unsigned int buckets[TIMING_BUCKETS];
+} TimingStats;
+
+TimeNs timing_clock(void);
+void timing_reset(TimingStats *t);
+void timing_add(TimingStats *t, TimeNs ns);
+TimeNs timing_percentile(TimingStats *t, double p);
+
+#endif
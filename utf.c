@@ -0,0 +1,391 @@
+/* Fast UTF-8 <-> UTF-16 conversion.
+   This is used instead of MultiByteToWideChar/WideCharToMultiByte when
+   the encoding is CP_UTF8. Runs of ASCII are converted 16 (SSE2) or 32 (AVX2)
+   characters at a time; everything else goes through a scalar decoder which
+   follows the Windows convention of replacing bad sequences with U+FFFD.
+*/
+#include <stddef.h>
+#include <string.h>
+#include "utf.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define UTF_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTF_SSE2
+#endif
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+// returned by decode_utf8 when the input ends part way through a sequence
+#define UTF_INCOMPLETE 0xFFFFFFFFUL
+
+// length of the leading run of ASCII bytes; if out is not NULL, they are
+// also widened into it.
+static int ascii_to_utf16(const unsigned char *s, int n, utf16_t *out) {
+  int i = 0;
+#ifdef UTF_AVX2
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(s+i));
+    if (_mm256_movemask_epi8(v) != 0) break;
+    if (out) {
+      _mm256_storeu_si256((__m256i*)(out+i),_mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+      _mm256_storeu_si256((__m256i*)(out+i+16),_mm256_cvtepu8_epi16(_mm256_extracti128_si256(v,1)));
+    }
+  }
+#endif
+#ifdef UTF_SSE2
+  {
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(s+i));
+      if (_mm_movemask_epi8(v) != 0) break;
+      if (out) {
+        _mm_storeu_si128((__m128i*)(out+i),_mm_unpacklo_epi8(v,zero));
+        _mm_storeu_si128((__m128i*)(out+i+8),_mm_unpackhi_epi8(v,zero));
+      }
+    }
+  }
+#endif
+  if (out) {
+    for (; i < n && s[i] < 0x80; i++)
+      out[i] = s[i];
+  } else {
+    for (; i < n && s[i] < 0x80; i++)
+      ;
+  }
+  return i;
+}
+
+// length of the leading run of UTF-16 units below 0x80; if out is not NULL,
+// they are also narrowed into it.
+static int ascii_from_utf16(const utf16_t *w, int n, unsigned char *out) {
+  int i = 0;
+#ifdef UTF_AVX2
+  {
+    __m256i mask = _mm256_set1_epi16((short)0xFF80);
+    for (; i + 32 <= n; i += 32) {
+      __m256i a = _mm256_loadu_si256((const __m256i*)(w+i));
+      __m256i b = _mm256_loadu_si256((const __m256i*)(w+i+16));
+      if (! _mm256_testz_si256(_mm256_or_si256(a,b),mask)) break;
+      if (out) {
+        // packus works within 128-bit lanes, so put the quadwords back in order
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(a,b),0xD8);
+        _mm256_storeu_si256((__m256i*)(out+i),p);
+      }
+    }
+  }
+#endif
+#ifdef UTF_SSE2
+  {
+    __m128i mask = _mm_set1_epi16((short)0xFF80), zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i*)(w+i));
+      __m128i b = _mm_loadu_si128((const __m128i*)(w+i+8));
+      __m128i hi = _mm_and_si128(_mm_or_si128(a,b),mask);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi16(hi,zero)) != 0xFFFF) break;
+      if (out) {
+        _mm_storeu_si128((__m128i*)(out+i),_mm_packus_epi16(a,b));
+      }
+    }
+  }
+#endif
+  if (out) {
+    for (; i < n && w[i] < 0x80; i++)
+      out[i] = (unsigned char)w[i];
+  } else {
+    for (; i < n && w[i] < 0x80; i++)
+      ;
+  }
+  return i;
+}
+
+// decode one non-ASCII sequence. A bad sequence gives U+FFFD and consumes
+// its maximal valid prefix (at least one byte). If the input runs out before
+// a valid sequence is complete, we get UTF_INCOMPLETE and all of it is consumed.
+static unsigned long decode_utf8(const unsigned char **ps, const unsigned char *end) {
+  const unsigned char *s = *ps;
+  unsigned int c = *s++, lo = 0x80, hi = 0xBF;
+  unsigned long cp;
+  int need;
+  if (c >= 0xC2 && c <= 0xDF) {
+    need = 1;
+    cp = c & 0x1F;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    need = 2;
+    cp = c & 0x0F;
+    if (c == 0xE0) lo = 0xA0;  // overlong
+    else if (c == 0xED) hi = 0x9F; // surrogates
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    need = 3;
+    cp = c & 0x07;
+    if (c == 0xF0) lo = 0x90;  // overlong
+    else if (c == 0xF4) hi = 0x8F; // > U+10FFFF
+  } else {
+    *ps = s;
+    return UTF_REPLACEMENT;
+  }
+  while (need--) {
+    if (s == end) {
+      *ps = s;
+      return UTF_INCOMPLETE;
+    }
+    if (*s < lo || *s > hi) {
+      *ps = s;
+      return UTF_REPLACEMENT;
+    }
+    cp = (cp << 6) | (*s++ & 0x3F);
+    lo = 0x80;
+    hi = 0xBF;
+  }
+  *ps = s;
+  return cp;
+}
+
+// put a code point as UTF-16, returning the new output count or -1
+static int put_utf16(unsigned long cp, utf16_t *out, int k, int outsz) {
+  if (cp < 0x10000) {
+    if (out) {
+      if (k >= outsz) return -1;
+      out[k] = (utf16_t)cp;
+    }
+    return k + 1;
+  } else {
+    if (out) {
+      if (k + 2 > outsz) return -1;
+      cp -= 0x10000;
+      out[k] = (utf16_t)(0xD800 + (cp >> 10));
+      out[k+1] = (utf16_t)(0xDC00 + (cp & 0x3FF));
+    }
+    return k + 2;
+  }
+}
+
+// the conversion loop. If keep_tail is true, then an incomplete sequence at
+// the end is not converted, and *ps is left pointing at it.
+static int convert_utf8(const unsigned char **ps, const unsigned char *end,
+    utf16_t *out, int outsz, int k, int keep_tail) {
+  const unsigned char *s = *ps;
+  while (s < end) {
+    const unsigned char *start = s;
+    unsigned long cp;
+    if (*s < 0x80) {
+      int n = (int)(end - s);
+      if (out) {
+        n = MIN(n,outsz - k);
+        if (n <= 0) return -1;
+        n = ascii_to_utf16(s,n,out + k);
+      } else {
+        n = ascii_to_utf16(s,n,NULL);
+      }
+      s += n;
+      k += n;
+      continue;
+    }
+    cp = decode_utf8(&s,end);
+    if (cp == UTF_INCOMPLETE) {
+      if (keep_tail) {
+        s = start;
+        break;
+      }
+      cp = UTF_REPLACEMENT;
+    }
+    k = put_utf16(cp,out,k,outsz);
+    if (k == -1) return -1;
+  }
+  *ps = s;
+  return k;
+}
+
+/// convert UTF-8 to UTF-16.
+// @param s the UTF-8 text
+// @param len number of bytes to convert (include the NUL if you want it copied)
+// @param out the output buffer; if NULL, just work out the size needed
+// @param outsz size of the output buffer in UTF-16 units
+// @return number of UTF-16 units, or -1 if the output buffer is too small.
+// @function utf8_to_utf16
+int utf8_to_utf16(const char *src, int len, utf16_t *out, int outsz) {
+  const unsigned char *s = (const unsigned char*)src;
+  return convert_utf8(&s,s + len,out,outsz,0,0);
+}
+
+/// convert UTF-16 to UTF-8.
+// Unpaired surrogates become U+FFFD.
+// @param ws the UTF-16 text
+// @param len number of UTF-16 units to convert
+// @param out the output buffer; if NULL, just work out the size needed
+// @param outsz size of the output buffer in bytes
+// @return number of bytes, or -1 if the output buffer is too small.
+// @function utf16_to_utf8
+int utf16_to_utf8(const utf16_t *ws, int len, char *dst, int outsz) {
+  const utf16_t *w = ws, *end = ws + len;
+  unsigned char *out = (unsigned char*)dst;
+  int k = 0;
+  while (w < end) {
+    unsigned long c = *w;
+    int n;
+    if (c < 0x80) {
+      n = (int)(end - w);
+      if (out) {
+        n = MIN(n,outsz - k);
+        if (n <= 0) return -1;
+        n = ascii_from_utf16(w,n,out + k);
+      } else {
+        n = ascii_from_utf16(w,n,NULL);
+      }
+      w += n;
+      k += n;
+      continue;
+    }
+    ++w;
+    if (c < 0x800) {
+      n = 2;
+    } else if (c >= 0xD800 && c <= 0xDFFF) {
+      if (c <= 0xDBFF && w < end && *w >= 0xDC00 && *w <= 0xDFFF) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (*w++ - 0xDC00);
+        n = 4;
+      } else {
+        c = UTF_REPLACEMENT;
+        n = 3;
+      }
+    } else {
+      n = 3;
+    }
+    if (out) {
+      unsigned char *p;
+      if (k + n > outsz) return -1;
+      p = out + k;
+      switch (n) {
+      case 2:
+        p[0] = (unsigned char)(0xC0 | (c >> 6));
+        p[1] = (unsigned char)(0x80 | (c & 0x3F));
+        break;
+      case 3:
+        p[0] = (unsigned char)(0xE0 | (c >> 12));
+        p[1] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+        p[2] = (unsigned char)(0x80 | (c & 0x3F));
+        break;
+      case 4:
+        p[0] = (unsigned char)(0xF0 | (c >> 18));
+        p[1] = (unsigned char)(0x80 | ((c >> 12) & 0x3F));
+        p[2] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+        p[3] = (unsigned char)(0x80 | (c & 0x3F));
+        break;
+      }
+    }
+    k += n;
+  }
+  return k;
+}
+
+/// convert a piece of a UTF-8 stream to UTF-16.
+// A sequence split between pieces is kept in `st` and completed by the next
+// call, so the result is the same as converting the whole stream at once.
+// There is always room if `outsz` is at least `len + 4`.
+// @param st the stream state; initially all zero
+// @param s the next piece of UTF-8 text
+// @param len its size in bytes
+// @param out the output buffer
+// @param outsz size of the output buffer in UTF-16 units
+// @param last true if this is the end of the stream; any pending bytes
+// are then flushed as U+FFFD
+// @return number of UTF-16 units, or -1 if the output buffer is too small.
+// @function utf8_stream_to_utf16
+int utf8_stream_to_utf16(UtfStream *st, const char *src, int len, utf16_t *out, int outsz, int last) {
+  const unsigned char *s = (const unsigned char*)src, *end = s + len;
+  int k = 0;
+  // finish off a sequence left over from last time, a byte at a time
+  while (st->n > 0 && s < end) {
+    const unsigned char *p = st->pend;
+    unsigned long cp;
+    st->pend[st->n++] = *s++;
+    cp = decode_utf8(&p,st->pend + st->n);
+    if (cp == UTF_INCOMPLETE)
+      continue;
+    // a bad byte ends the sequence, but is not part of it
+    if (p < st->pend + st->n)
+      --s;
+    st->n = 0;
+    k = put_utf16(cp,out,k,outsz);
+    if (k == -1) return -1;
+  }
+  k = convert_utf8(&s,end,out,outsz,k,! last);
+  if (k == -1) return -1;
+  if (s < end) {
+    st->n = (int)(end - s);
+    memcpy(st->pend,s,st->n);
+  }
+  if (last && st->n > 0) {
+    st->n = 0;
+    k = put_utf16(UTF_REPLACEMENT,out,k,outsz);
+  }
+  return k;
+}
+
+#define IS_HIGH(u) ((u) >= 0xD800 && (u) <= 0xDBFF)
+#define UNIT(p) ((utf16_t)((p)[0] | ((p)[1] << 8)))
+
+/// collect UTF-16 units from a stream of little-endian bytes.
+// Units are copied as they are, except that neither a unit nor a surrogate
+// pair is ever split between calls; such pieces are kept in `st`.
+// There is always room if `outsz` is at least `len/2 + 2`.
+// @param st the stream state; initially all zero
+// @param s the next piece of UTF-16 text
+// @param len its size in bytes
+// @param out the output buffer
+// @param outsz size of the output buffer in UTF-16 units
+// @param last true if this is the end of the stream; an odd byte left
+// over then becomes U+FFFD
+// @return number of UTF-16 units, or -1 if the output buffer is too small.
+// @function utf16_stream
+int utf16_stream(UtfStream *st, const char *src, int len, utf16_t *out, int outsz, int last) {
+  const unsigned char *s = (const unsigned char*)src, *end = s + len;
+  int k = 0, n, keep;
+  // complete a unit or pair left over from last time
+  while (st->n > 0 && s < end) {
+    st->pend[st->n++] = *s++;
+    if (st->n == 2 && ! IS_HIGH(UNIT(st->pend))) {
+      if (k >= outsz) return -1;
+      out[k++] = UNIT(st->pend);
+      st->n = 0;
+    } else if (st->n == 4) {
+      utf16_t u = UNIT(st->pend + 2);
+      if (k + 2 > outsz) return -1;
+      out[k++] = UNIT(st->pend);
+      st->n = 0;
+      if (IS_HIGH(u)) { // unpaired; but this one may start a pair
+        st->pend[0] = st->pend[2];
+        st->pend[1] = st->pend[3];
+        st->n = 2;
+      } else {
+        out[k++] = u;
+      }
+    }
+  }
+  n = (int)(end - s)/2;
+  keep = (int)(end - s) & 1;
+  if (! last && n > 0 && IS_HIGH(UNIT(s + 2*(n-1)))) {
+    --n;
+    keep += 2;
+  }
+  if (k + n > outsz) return -1;
+  // Windows is always little-endian
+  memcpy(out + k,s,n*sizeof(utf16_t));
+  k += n;
+  s += 2*n;
+  if (keep) {
+    memcpy(st->pend + st->n,s,keep);
+    st->n += keep;
+  }
+  if (last && st->n > 0) {
+    if (k + (st->n >= 2) + (st->n & 1) > outsz) return -1;
+    if (st->n >= 2)
+      out[k++] = UNIT(st->pend);
+    if (st->n & 1)
+      out[k++] = UTF_REPLACEMENT;
+    st->n = 0;
+  }
+  return k;
+}
@@ -0,0 +1,22 @@
+#ifndef UTF_H
+#define UTF_H
+// Portable UTF-8 <-> UTF-16 conversion; does not depend on windows.h,
+// so it can be built and tested anywhere.
+
+typedef unsigned short utf16_t;
+
+#define UTF_REPLACEMENT 0xFFFD
+
+int utf8_to_utf16(const char *s, int len, utf16_t *out, int outsz);
+int utf16_to_utf8(const utf16_t *ws, int len, char *out, int outsz);
+
+// state for converting text which arrives in pieces
+typedef struct {
+  int n;  // number of pending bytes
+  unsigned char pend[4];
+} UtfStream;
+
+int utf8_stream_to_utf16(UtfStream *st, const char *s, int len, utf16_t *out, int outsz, int last);
+int utf16_stream(UtfStream *st, const char *s, int len, utf16_t *out, int outsz, int last);
+
+#endif
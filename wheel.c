@@ -0,0 +1,171 @@
+/* Hierarchical timing wheel, after Varghese & Lauck (and the old Linux
+   kernel timers). Level 0 has a slot for each of the next 256 msec; each
+   level above has 64 slots, each as long as the whole of the level below.
+   Whenever level 0 comes round to its first slot, the current slot of
+   level 1 is emptied into the levels below, and so on up. Timers further
+   off than the top level can reach are parked there, and sorted out when
+   they come round again.
+*/
+#include <stddef.h>
+#include "wheel.h"
+
+#define SIZE0 (1 << WHEEL_BITS0)
+#define MASK0 (SIZE0 - 1)
+#define SIZE (1 << WHEEL_BITS)
+#define MASK (SIZE - 1)
+
+// where the slots of a level start, and how far to shift a time for its slot index
+#define level_base(l) ((l) == 0 ? 0 : SIZE0 + ((l) - 1)*SIZE)
+#define level_shift(l) ((l) == 0 ? 0 : WHEEL_BITS0 + ((l) - 1)*WHEEL_BITS)
+
+static void link_timer(WheelTimer *head, WheelTimer *t) {
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+static void unlink_timer(WheelTimer *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+// move all the timers in a slot onto a list of our own, since
+// they may be added back while we go through them.
+static void take_slot(WheelTimer *head, WheelTimer *list) {
+  if (head->next == head) {
+    list->next = list->prev = list;
+    return;
+  }
+  list->next = head->next;
+  list->prev = head->prev;
+  list->next->prev = list;
+  list->prev->next = list;
+  head->next = head->prev = head;
+}
+
+// timers which are already due go into the slot for `due`
+static WheelTimer *slot_for(TimerWheel *w, unsigned int expires, unsigned int due) {
+  unsigned int delta = expires - w->now;
+  int l;
+  if (delta == 0 || (int)delta < 0)
+    return &w->slots[due & MASK0];
+  if (delta < SIZE0)
+    return &w->slots[expires & MASK0];
+  for (l = 1; l < WHEEL_LEVELS; l++) {
+    int shift = level_shift(l);
+    if (delta < (1u << (shift + WHEEL_BITS)))
+      return &w->slots[level_base(l) + ((expires >> shift) & MASK)];
+  }
+  // too far off; the current top slot is the last to come round again
+  l = WHEEL_LEVELS - 1;
+  return &w->slots[level_base(l) + ((w->now >> level_shift(l)) & MASK)];
+}
+
+/// initialize a wheel.
+// @param w the wheel
+// @param now the current time in msec
+// @function wheel_init
+void wheel_init(TimerWheel *w, unsigned int now) {
+  int i;
+  w->now = now;
+  w->count = 0;
+  for (i = 0; i < WHEEL_SLOTS; i++)
+    w->slots[i].next = w->slots[i].prev = &w->slots[i];
+}
+
+/// add a timer. It must not already be pending.
+// @param w the wheel
+// @param t the timer
+// @param expires when it is due, in msec; if this has passed, it fires on the next tick
+// @function wheel_add
+void wheel_add(TimerWheel *w, WheelTimer *t, unsigned int expires) {
+  t->expires = expires;
+  link_timer(slot_for(w,expires,w->now + 1),t);
+  ++w->count;
+}
+
+/// remove a pending timer.
+// @param w the wheel
+// @param t the timer
+// @function wheel_remove
+void wheel_remove(TimerWheel *w, WheelTimer *t) {
+  unlink_timer(t);
+  --w->count;
+}
+
+// the current slot of level l has come round, so share out its timers
+// below; when its own first slot comes round, the level above follows.
+static void cascade(TimerWheel *w, int l) {
+  int idx = (w->now >> level_shift(l)) & MASK;
+  WheelTimer list, *t;
+  take_slot(&w->slots[level_base(l) + idx],&list);
+  while (list.next != &list) {
+    t = list.next;
+    unlink_timer(t);
+    link_timer(slot_for(w,t->expires,w->now),t);
+  }
+  if (idx == 0 && l + 1 < WHEEL_LEVELS)
+    cascade(w,l + 1);
+}
+
+/// fire all timers which are due, tick by tick.
+// The fire function may add and remove timers, including the one fired.
+// @param w the wheel
+// @param now the current time in msec
+// @param fire called for each timer, which is no longer pending
+// @param data passed to fire
+// @function wheel_advance
+void wheel_advance(TimerWheel *w, unsigned int now, WheelFn fire, void *data) {
+  while ((int)(now - w->now) > 0) {
+    WheelTimer list, *t;
+    if (w->count == 0) {
+      w->now = now;
+      break;
+    }
+    ++w->now;
+    if ((w->now & MASK0) == 0)
+      cascade(w,1);
+    take_slot(&w->slots[w->now & MASK0],&list);
+    while (list.next != &list) {
+      t = list.next;
+      unlink_timer(t);
+      --w->count;
+      fire(t,data);
+    }
+  }
+}
+
+/// how long until something needs doing.
+// This is either the next timer in level 0, or the next time a slot
+// above has to be shared out, whichever is sooner.
+// @param w the wheel
+// @return msec, or -1 if there are no timers
+// @function wheel_next
+int wheel_next(TimerWheel *w) {
+  int k, l, best = -1;
+  if (w->count == 0)
+    return -1;
+  for (k = 1; k <= SIZE0; k++) {
+    WheelTimer *head = &w->slots[(w->now + k) & MASK0];
+    if (head->next != head) {
+      best = k;
+      break;
+    }
+  }
+  for (l = 1; l < WHEEL_LEVELS; l++) {
+    int shift = level_shift(l);
+    unsigned int base = w->now >> shift;
+    for (k = 1; k <= SIZE; k++) {
+      WheelTimer *head = &w->slots[level_base(l) + ((base + k) & MASK)];
+      if (head->next != head) {
+        int left = (int)(((base + k) << shift) - w->now);
+        if (best < 0 || left < best)
+          best = left;
+        break;
+      }
+    }
+  }
+  return best;
+}
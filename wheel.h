@@ -0,0 +1,32 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+// A hierarchical timing wheel, with a tick of one msec. Adding, removing
+// and firing a timer all cost O(1), however many timers there are.
+// This does not depend on windows.h.
+
+#define WHEEL_BITS0 8
+#define WHEEL_BITS 6
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOTS ((1 << WHEEL_BITS0) + (WHEEL_LEVELS - 1)*(1 << WHEEL_BITS))
+
+typedef struct WheelTimer {
+  struct WheelTimer *next, *prev;  // next is NULL if not pending
+  unsigned int expires;
+} WheelTimer;
+
+typedef void (*WheelFn)(WheelTimer *t, void *data);
+
+typedef struct {
+  unsigned int now;  // timers up to this time have fired
+  int count;
+  WheelTimer slots[WHEEL_SLOTS];
+} TimerWheel;
+
+void wheel_init(TimerWheel *w, unsigned int now);
+void wheel_add(TimerWheel *w, WheelTimer *t, unsigned int expires);
+void wheel_remove(TimerWheel *w, WheelTimer *t);
+#define wheel_pending(t) ((t)->next != NULL)
+void wheel_advance(TimerWheel *w, unsigned int now, WheelFn fire, void *data);
+int wheel_next(TimerWheel *w);
+
+#endif
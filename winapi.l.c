@@ -16,6 +16,8 @@ A useful set of Windows API functions.
 #define WINDOWS_LEAN_AND_MEAN
 #include <windows.h>
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 #ifdef __GNUC__
 #include <winable.h> /* GNU GCC specific */
 #endif
@@ -29,21 +31,24 @@ A useful set of Windows API functions.
 #define MAX_PROCESSES 1024
 #define MAX_KEYS 512
 #define FILE_BUFF_SIZE 2048
+#define WRITEV_GATHER_MAX (256*1024)
 #define MAX_WATCH 20
 #define MAX_WPATH 1024
 
 #define TIMEOUT(timeout) timeout == 0 ? INFINITE : timeout
 
-static wchar_t wbuff[WBUFF];
-
 typedef LPCWSTR WStr;
 
 module "winapi" {
 
 #include "wutils.h"
+#include "utf.h"
+#include "reactor.h"
+#include "timing.h"
+#include "ring.h"
 
 static WStr wstring(Str text) {
-  return wstring_buff(text,wbuff,sizeof(wbuff));
+  return wstring_l(text,strlen(text),NULL);
 }
 
 /// Text encoding.
@@ -66,28 +71,29 @@ def get_encoding () {
 }
 
 /// encode a string in another encoding.
-// Note: currently there's a limit of about 2K on the string buffer.
+// There is no limit on the size of the string.
 // @param e_in `CP_ACP`, `CP_UTF8` or `CP_UTF16`
 // @param e_out likewise
 // @param text the string
 // @function encode
 def encode(Int e_in, Int e_out, Str text) {
-  int ce = get_encoding();
+  int len = lua_objlen(L,3), wlen;
   LPCWSTR ws;
   if (e_in != -1) {
-    set_encoding(e_in);
-    ws = wstring(text);
+    ws = wstring_cp(e_in,text,len,&wlen);
+    if (ws == NULL) {
+      return push_error(L);
+    }
   } else {
     ws = (LPCWSTR)text;
+    wlen = len/sizeof(WCHAR);
   }
   if (e_out != -1) {
-    set_encoding(e_out);
-    push_wstring(L,ws);
+    return push_wstring_cp(L,e_out,ws,wlen);
   } else {
-    lua_pushlstring(L,(LPCSTR)ws,wcslen(ws)*sizeof(WCHAR));
+    lua_pushlstring(L,(LPCSTR)ws,wlen*sizeof(WCHAR));
+    return 1;
   }
-  set_encoding(ce);
-  return 1;
 }
 
 /// expand # unicode escapes in a string.
@@ -96,13 +102,14 @@ def encode(Int e_in, Int e_out, Str text) {
 // @see testu.lua
 // @function utf8_expand
 def utf8_expand(Str text) {
-  int len = strlen(text), i = 0, enc = get_encoding();
+  int len = lua_objlen(L,1), i = 0;
   WCHAR wch;
-  LPWSTR P = wbuff;
-  if (len > sizeof(wbuff)) {
-    return push_error_msg(L,"string too big");
+  // each input byte gives at most one wide char
+  LPWSTR ws = wide_scratch(len+1), P = ws;
+  if (ws == NULL) {
+    return push_error_msg(L,"out of memory");
   }
-  while (i <= len) {
+  while (i < len) {
     if (text[i] == '#') {
       ++i;
       if (text[i] == '#') {
@@ -123,11 +130,111 @@ def utf8_expand(Str text) {
     *P++ = wch;
     ++i;
   }
-  *P++ = 0;
-  set_encoding(CP_UTF8);
-  push_wstring(L,wbuff);
-  set_encoding(enc);
-  return 1;
+  return push_wstring_cp(L,CP_UTF8,ws,P - ws);
+}
+
+// forward reference to Decoder constructor
+static int push_new_Decoder(lua_State *L,Int e_in, Int e_out);
+
+/// make a decoder for converting text which arrives in pieces.
+// This is useful for the output of @{File:read_async}, where chunks may
+// split multi-byte sequences.
+// @param e_in `CP_ACP`, `CP_UTF8` or `CP_UTF16`
+// @param e_out likewise
+// @return @{Decoder}
+// @see test-decoder.lua
+// @function decoder
+def decoder(Int e_in, Int e_out) {
+  return push_new_Decoder(L,e_in,e_out);
+}
+
+/// a class representing a text decoder.
+// Any incomplete sequence at the end of a piece is kept until the rest of
+// it arrives, so the result is the same as converting the whole text in one go.
+// @type Decoder
+class Decoder {
+  int e_in;
+  int e_out;
+  BOOL dbcs;
+  UtfStream st;
+
+  constructor (Int e_in, Int e_out) {
+    CPINFO info;
+    this->e_in = e_in;
+    this->e_out = e_out;
+    this->st.n = 0;
+    this->dbcs = e_in != -1 && e_in != CP_UTF8 && GetCPInfo(e_in,&info) && info.MaxCharSize > 1;
+  }
+
+  // code page text; a DBCS lead byte at the end is kept for next time
+  static int mb_stream(Decoder *this, Str text, int len, LPWSTR ws, BOOL last) {
+    int i = 0, k = 0, n;
+    if (this->st.n > 0 && len > 0) {
+      char pair[2];
+      pair[0] = this->st.pend[0];
+      pair[1] = text[i++];
+      k = MultiByteToWideChar(this->e_in,0,pair,2,ws,2);
+      this->st.n = 0;
+    }
+    n = len - i;
+    if (this->dbcs && ! last && n > 0) {
+      int j = i;
+      while (j < len - 1)
+        j += IsDBCSLeadByteEx(this->e_in,text[j]) ? 2 : 1;
+      if (j == len - 1 && IsDBCSLeadByteEx(this->e_in,text[j])) {
+        this->st.pend[0] = text[j];
+        this->st.n = 1;
+        --n;
+      }
+    }
+    if (n > 0) {
+      k += MultiByteToWideChar(this->e_in,0,text+i,n,ws+k,n);
+    }
+    if (last && this->st.n > 0) {
+      k += MultiByteToWideChar(this->e_in,0,(LPCSTR)this->st.pend,1,ws+k,1);
+      this->st.n = 0;
+    }
+    return k;
+  }
+
+  static int convert(lua_State *L, Decoder *this, Str text, int len, BOOL last) {
+    // no input byte gives more than one wide char, apart from what's pending
+    int wsz = len + 4, wlen;
+    LPWSTR ws = wide_scratch(wsz);
+    if (ws == NULL) {
+      return push_error_msg(L,"out of memory");
+    }
+    if (this->e_in == -1) {
+      wlen = utf16_stream(&this->st,text,len,(utf16_t*)ws,wsz,last);
+    } else if (this->e_in == CP_UTF8) {
+      wlen = utf8_stream_to_utf16(&this->st,text,len,(utf16_t*)ws,wsz,last);
+    } else {
+      wlen = mb_stream(this,text,len,ws,last);
+    }
+    if (this->e_out == -1) {
+      lua_pushlstring(L,(LPCSTR)ws,wlen*sizeof(WCHAR));
+      return 1;
+    }
+    return push_wstring_cp(L,this->e_out,ws,wlen);
+  }
+
+  /// convert the next piece of text.
+  // @param text the text
+  // @return the converted text, which may be empty
+  // @function feed
+  def feed(Str text) {
+    return convert(L,this,text,lua_objlen(L,2),FALSE);
+  }
+
+  /// finish converting.
+  // Anything left over is converted, with incomplete sequences becoming
+  // U+FFFD. The decoder can then be used again.
+  // @param text optional last piece of text
+  // @return the converted text
+  // @function finish
+  def finish(Str text = "") {
+    return convert(L,this,text,lua_objlen(L,2),TRUE);
+  }
 }
 
 // forward reference to Process constructor
@@ -172,8 +279,10 @@ class Window {
   /// get the window text.
   // @function get_text
   def get_text() {
-    GetWindowTextW(this->hwnd,wbuff,sizeof(wbuff));
-    return push_wstring(L,wbuff);
+    int len = GetWindowTextLengthW(this->hwnd) + 1;
+    LPWSTR wbuff = wide_result(len);
+    len = GetWindowTextW(this->hwnd,wbuff,len);
+    return push_wstring_l(L,wbuff,len);
   }
 
   /// set the window text.
@@ -306,9 +415,9 @@ class Window {
   /// get the name of the program owning this window.
   // @function get_module_filename
   def get_module_filename() {
-    int sz = GetWindowModuleFileNameW(this->hwnd,wbuff,sizeof(wbuff));
-    wbuff[sz] = 0;
-    return push_wstring(L,wbuff);
+    LPWSTR wbuff = wide_result(WBUFF);
+    int sz = GetWindowModuleFileNameW(this->hwnd,wbuff,WBUFF);
+    return push_wstring_l(L,wbuff,sz);
   }
 
   /// get the window class name.
@@ -345,11 +454,9 @@ class Window {
   // @function __tostring
   def __tostring() {
     int ret;
-    int sz = GetWindowTextW(this->hwnd,wbuff,sizeof(wbuff));
-    if (sz > MAX_SHOW) {
-      wbuff[MAX_SHOW] = '\0';
-    }
-    ret = push_wstring(L,wbuff);
+    LPWSTR wbuff = wide_result(MAX_SHOW+1);
+    int sz = GetWindowTextW(this->hwnd,wbuff,MAX_SHOW+1);
+    ret = push_wstring_l(L,wbuff,sz);
     if (ret == 2) { // we had a conversion error
       lua_pushliteral(L,"");
     }
@@ -448,6 +555,82 @@ def use_gui() {
   return 0;
 }
 
+static BOOL s_stop_run = FALSE;
+
+/// route callbacks through a dispatch queue.
+// Background threads then never enter Lua themselves; they put their callbacks
+// on a lock-free queue, and these are run in order on the main thread by
+// @{dispatch}, @{run} or @{sleep}. Note that the results of callbacks are
+// then ignored, so a timer cannot cancel itself by returning true.
+// @function use_dispatch
+def use_dispatch() {
+  make_dispatch_queue();
+  return 0;
+}
+
+/// run any queued callbacks.
+// Only useful after @{use_dispatch}.
+// @param timeout how long to wait for a callback, in msec; defaults to waiting
+// indefinitely. A negative value means don't wait.
+// @return the number of callbacks run
+// @function dispatch
+def dispatch(Int timeout = 0) {
+  if (! dispatching()) {
+    return push_error_msg(L,"use_dispatch() has not been called");
+  }
+  lua_pushinteger(L,dispatch_events(timeout < 0 ? 0 : TIMEOUT(timeout),FALSE));
+  return 1;
+}
+
+/// statistics for callback allocation.
+// Queued callbacks (see @{use_gui} and @{use_dispatch}) take their parameters
+// from a fixed pool and their text from a ring buffer; when these are
+// full, they fall back to `malloc`.
+// @return a table with fields `pool_hits`, `pool_misses`, `text_hits` and `text_misses`
+// @function callback_stats
+def callback_stats() {
+  return push_call_stats(L);
+}
+
+/// run queued callbacks until @{stop} is called.
+// Only useful after @{use_dispatch}.
+// @function run
+def run() {
+  if (! dispatching()) {
+    return push_error_msg(L,"use_dispatch() has not been called");
+  }
+  s_stop_run = FALSE;
+  while (! s_stop_run) {
+    dispatch_events(INFINITE,FALSE);
+  }
+  return 0;
+}
+
+/// make @{run} return, after the current callback.
+// @function stop
+def stop() {
+  s_stop_run = TRUE;
+  return 0;
+}
+
+/// run a function as a task.
+// A task is a coroutine which is resumed in the background. Inside a task,
+// the `wait` methods of @{Event}, @{Process} and @{Thread}, @{File:read}
+// and @{sleep} do not block; the task is suspended until they are done, and
+// other tasks and callbacks carry on meanwhile. Tasks are resumed like any
+// other callback, so the main thread must @{sleep} or @{run}.
+// In Lua 5.1, a task cannot wait inside `pcall`.
+// @param fun a function
+// @param ... any arguments for the function
+// @return the task, which is a coroutine
+// @see pipe-server.lua
+// @function go
+def go(Value fun) {
+  luaL_checktype(L,fun,LUA_TFUNCTION);
+  start_task(L,lua_gettop(L) - fun);
+  return 1;
+}
+
 static INPUT *add_input(INPUT *pi, WORD vkey, BOOL up) {
   pi->type = INPUT_KEYBOARD;
   pi->ki.dwFlags =  up ? KEYEVENTF_KEYUP : 0;
@@ -549,11 +732,23 @@ def tile_windows(Window parent, Boolean horiz, Value kids, Value bounds) {
 // @section miscellaneous
 
 static int push_new_File(lua_State *L,HANDLE hread, HANDLE hwrite);
+static int push_overlapped_File(lua_State *L, HANDLE h);
+static int push_serial_File(lua_State *L, HANDLE h, BOOL overlapped);
+
+static int task_wait(lua_State *L, HANDLE h, int timeout);
 
 /// sleep and use no processing time.
+// Inside a task (see @{go}) only the task sleeps.
 // @param millisec sleep period
 // @function sleep
 def sleep(Int millisec) {
+  if (in_task(L)) {
+    return task_wait(L,NULL,millisec);
+  }
+  if (dispatching()) {
+    dispatch_events(millisec,TRUE);
+    return 0;
+  }
   release_mutex();
   Sleep(millisec);
   lock_mutex();
@@ -574,7 +769,7 @@ def show_message(Str caption, Str msg, Str btns = "ok", Str icon = "information"
   int res, type;
   WCHAR capb [512];
   type = mb_const(btns) | mb_const(icon);
-  wstring_buff(caption,capb,sizeof(capb));
+  wstring_buff(caption,capb,sizeof(capb)/sizeof(WCHAR));
   res = MessageBoxW( NULL, wstring(msg), capb, type);
   lua_pushstring(L,mb_result(res));
   return 1;
@@ -614,7 +809,7 @@ def move_file(Str src, Str dest) {
   return push_bool(L, MoveFile(src,dest));
 }
 
-#define wconv(name) (name ? wstring_buff(name,w##name,sizeof(w##name)) : NULL)
+#define wconv(name) (name ? wstring_buff(name,w##name,sizeof(w##name)/sizeof(WCHAR)) : NULL)
 
 /// execute a shell command.
 // @param verb the action (e.g. 'open' or 'edit') can be nil.
@@ -635,12 +830,12 @@ def shell_exec(StrNil verb, Str file, StrNil parms, StrNil dir, Int show=SW_SHOW
 def set_clipboard(Str text) {
   HGLOBAL glob;
   LPWSTR p;
-  int bufsize = 3*strlen(text);
+  int bufsize = strlen(text) + 1;
   if (! OpenClipboard(NULL)) {
     return push_perror(L,"openclipboard");
   }
   EmptyClipboard();
-  glob = GlobalAlloc(GMEM_MOVEABLE, bufsize);
+  glob = GlobalAlloc(GMEM_MOVEABLE, bufsize*sizeof(WCHAR));
   p = (LPWSTR)GlobalLock(glob);
   wstring_buff(text,p,bufsize);
   GlobalUnlock(glob);
@@ -693,23 +888,92 @@ def pipe() {
   }
 }
 
+// the driver's queue sizes, and the read and write timeouts in msec;
+// anything not given is left as it was
+typedef struct {
+  int rx, tx, timeout;
+  int timeouts[5];    // the fields of COMMTIMEOUTS, in order
+  BOOL given[5];
+} SerialOptions;
+
+static const char *serial_timeouts[] = {
+  "read_interval","read_multiplier","read_total","write_multiplier","write_total"
+};
+
+// a bad option raises an error, so they are all read before the port is opened
+static void get_serial_options(lua_State *L, int opts, SerialOptions *so) {
+  int i;
+  so->rx = opt_int_field(L,opts,"rx_queue",0);
+  so->tx = opt_int_field(L,opts,"tx_queue",0);
+  so->timeout = opt_int_field(L,opts,"timeout",-1);
+  for (i = 0; i < 5; i++) {
+    lua_getfield(L,opts,serial_timeouts[i]);
+    so->given[i] = ! lua_isnil(L,-1);
+    lua_pop(L,1);
+    so->timeouts[i] = opt_int_field(L,opts,serial_timeouts[i],0);
+  }
+}
+
+static BOOL set_serial_options(HANDLE h, SerialOptions *so) {
+  COMMTIMEOUTS ct;
+  DWORD *fields[5];
+  int i;
+  fields[0] = &ct.ReadIntervalTimeout;
+  fields[1] = &ct.ReadTotalTimeoutMultiplier;
+  fields[2] = &ct.ReadTotalTimeoutConstant;
+  fields[3] = &ct.WriteTotalTimeoutMultiplier;
+  fields[4] = &ct.WriteTotalTimeoutConstant;
+  if ((so->rx > 0 || so->tx > 0) && ! SetupComm(h,so->rx > 0 ? so->rx : 4096,so->tx > 0 ? so->tx : 4096))
+    return FALSE;
+  if (! GetCommTimeouts(h,&ct))
+    return FALSE;
+  if (so->timeout >= 0) {
+    // wait this long for the first byte, and then return what has arrived
+    ct.ReadIntervalTimeout = MAXDWORD;
+    ct.ReadTotalTimeoutMultiplier = MAXDWORD;
+    ct.ReadTotalTimeoutConstant = so->timeout;
+  }
+  for (i = 0; i < 5; i++)
+    if (so->given[i])
+      *fields[i] = (DWORD)so->timeouts[i];
+  return SetCommTimeouts(h,&ct);
+}
+
 /// open a serial port for reading and writing.
+// A read which times out returns nil and an error, but the port can be
+// read again afterwards.
 // @param defn a string as used by the [mode command](http://technet.microsoft.com/en-us/library/cc732236%28WS.10%29.aspx)
+// @param opts optional; if true, open the port for overlapped I/O, see @{File:write_async}.
+// Otherwise a table with fields:
+//
+// * `overlapped` as above
+// * `timeout` msec to wait for the first byte of a read, after which it returns
+// whatever has arrived; this is usually what is wanted for streaming
+// * `read_interval`, `read_multiplier`, `read_total`, `write_multiplier`, `write_total`
+// the fields of `COMMTIMEOUTS` in msec, where -1 is `MAXDWORD`
+// * `rx_queue`, `tx_queue` sizes of the driver's queues in bytes, see `SetupComm`
+//
 // @return @{File}
 // @function open_serial
-def open_serial(Str defn) {
+def open_serial(Str defn, Value opts) {
+  BOOL overlapped = lua_toboolean(L,opts);
   DCB dcb = {0};
+  SerialOptions so;
   char port[20];
   HANDLE hSerial;
   const char *p = defn;
   char *q = port;
+  if (lua_istable(L,opts)) {
+    overlapped = opt_bool_field(L,opts,"overlapped",FALSE);
+    get_serial_options(L,opts,&so);
+  }
   for (; *p != ' '; p++) {
     *q++ = *p;
   }
   *q = '\0';
   dcb.DCBlength = sizeof(dcb);
   hSerial = CreateFile(port,GENERIC_READ | GENERIC_WRITE, 0, 0,
-      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+      OPEN_EXISTING, overlapped ? FILE_FLAG_OVERLAPPED : FILE_ATTRIBUTE_NORMAL, 0);
   if (hSerial == INVALID_HANDLE_VALUE) {
     return push_perror(L,"createfile");
   }
@@ -722,7 +986,11 @@ def open_serial(Str defn) {
     CloseHandle(hSerial);
     return push_perror(L,"setcomm");
   }
-  return push_new_File(L,hSerial,hSerial);
+  if (lua_istable(L,opts) && ! set_serial_options(hSerial,&so)) {
+    CloseHandle(hSerial);
+    return push_perror(L,"serial options");
+  }
+  return push_serial_File(L,hSerial,overlapped);
 }
 
 static int push_wait_result(lua_State *L, DWORD res) {
@@ -747,8 +1015,11 @@ static int wait_single(HANDLE h, int timeout) {
   return res;
 }
 
+// inside a task, waiting yields until the reactor thread sees the handle signalled
 static int push_wait(lua_State *L, HANDLE h, int timeout) {
-    return push_wait_result(L,wait_single(h,timeout));
+  if (in_task(L))
+    return task_wait(L,h,timeout);
+  return push_wait_result(L,wait_single(h,timeout));
 }
 
 static int push_wait_async(lua_State *L, HANDLE h, int timeout, int callback);
@@ -772,6 +1043,8 @@ class Event {
   }
 
   /// run callback when this process is finished.
+  // The callback comes from the background thread shared with timers,
+  // so it should not block (see @{make_timer}).
   // @param callback the callback
   // @param timeout optional timeout in millisec; defaults to waiting indefinitely.
   // @return this process object
@@ -967,6 +1240,8 @@ class Process {
   }
 
   /// run callback when this process is finished.
+  // The callback comes from the background thread shared with timers,
+  // so it should not block (see @{make_timer}).
   // @param callback the callback
   // @param timeout optional timeout in millisec; defaults to waiting indefinitely.
   // @return this process object
@@ -1134,6 +1409,16 @@ BOOL lcb_call(void *data, int idx, Str text, int flags) {
   return call_lua(lcb->L,lcb->callback,idx,text,flags);
 }
 
+BOOL lcb_call_len(void *data, Str text, int len, int flags) {
+  LuaCallback *lcb = (LuaCallback*)data;
+  return call_lua_len(lcb->L,lcb->callback,text,len,flags);
+}
+
+BOOL lcb_call_push(void *data, LuaPusher push, void *pdata, Str text, int flags) {
+  LuaCallback *lcb = (LuaCallback*)data;
+  return call_lua_push(lcb->L,lcb->callback,push,pdata,text,flags);
+}
+
 void lcb_allocate_buffer(void *data, int size) {
   LuaCallback *lcb = (LuaCallback*)data;
   lcb->buf = malloc(size);
@@ -1158,17 +1443,34 @@ void lcb_free(void *data) {
 #define lcb_bufsz(data) ((LuaCallback *)data)->bufsz
 #define lcb_handle(data) ((LuaCallback *)data)->handle
 
+typedef ReactorOp *PReactorOp;
+
+// Some threads are asked to stop rather than terminated, so that they can
+// let go of what they hold. This is called with kill TRUE by Thread:kill,
+// and with FALSE when the Thread object is collected.
+typedef BOOL (*ThreadStop)(void *lcb, HANDLE thread, BOOL kill);
+
 /// Thread object. This is returned by the @{File:read_async} method and the @{make_timer},
 // @{make_pipe_server} and @{watch_for_file_changes} functions. Useful to kill a thread
 // and free associated resources.
+//
+// Timers, directory watchers and `wait_async` do not get a thread of their own;
+// they share one background thread which waits for all of them. For these,
+// only @{Thread:kill} is meaningful.
 // @type Thread
 class Thread {
   HANDLE thread;
   LuaCallback *lcb;
+  ReactorOp *op;
+  DWORD op_id;
+  ThreadStop stop;  // if set, how to stop the thread instead of terminating it
 
-  constructor (PLuaCallback lcb, HANDLE thread) {
+  constructor (PLuaCallback lcb, HANDLE thread, PReactorOp op, DWORD op_id) {
     this->lcb = lcb;
     this->thread = thread;
+    this->op = op;
+    this->op_id = op_id;
+    this->stop = NULL;
   }
 
   /// suspend this thread.
@@ -1186,9 +1488,25 @@ class Thread {
   /// kill this thread. Generally considered a 'nuclear' option, but
   // this implementation will free any associated callback references, buffers
   // and handles. @{test-timer.lua} shows how a timer can be terminated.
+  // A @{pump} is stopped instead, and does not call back; so is a pipe
+  // server with a pool of instances, which closes them all first.
   // @function kill
   def kill() {
-    BOOL ret = TerminateThread(this->thread,1);
+    BOOL ret;
+    if (this->stop != NULL) {
+      ret = this->stop(this->lcb,this->thread,TRUE);
+      if (ret)
+        this->stop = NULL;
+      return push_bool(L,ret);
+    }
+    if (this->op != NULL) {
+      // the reactor thread frees everything, unless it has already finished
+      if (! reactor_cancel(this->op,this->op_id))
+        return push_error_msg(L,"out of memory");
+      this->op = NULL;
+      return push_bool(L,TRUE);
+    }
+    ret = TerminateThread(this->thread,1);
     lcb_free(this->lcb);
     return push_bool(L,ret);
   }
@@ -1221,6 +1539,8 @@ class Thread {
   }
 
   /// run callback when this thread is finished.
+  // The callback comes from the background thread shared with timers,
+  // so it should not block (see @{make_timer}).
   // @param callback the callback
   // @param timeout optional timeout in millisec; defaults to waiting indefinitely.
   // @return this thread object
@@ -1233,6 +1553,8 @@ class Thread {
 
   def __gc() {
     // lcb_free(this->lcb); concerned that this cd kick in prematurely!
+    if (this->stop != NULL)
+      this->stop(this->lcb,this->thread,FALSE);
     CloseHandle(this->thread);
     return 0;
   }
@@ -1240,22 +1562,143 @@ class Thread {
 
 typedef LPTHREAD_START_ROUTINE  TCB;
 
+typedef struct {
+  TCB fun;
+  void *data;
+} ThreadStart;
+
+// all our threads start here, so that their scratch buffers can be freed at the end.
+static DWORD WINAPI thread_start(ThreadStart *ts) {
+  TCB fun = ts->fun;
+  void *data = ts->data;
+  DWORD res;
+  free(ts);
+  res = fun(data);
+  free_scratch();
+  return res;
+}
+
+static HANDLE start_thread(TCB fun, void *data) {
+  ThreadStart *ts = (ThreadStart*)malloc(sizeof(ThreadStart));
+  ts->fun = fun;
+  ts->data = data;
+  return CreateThread(NULL,THREAD_STACK_SIZE,(TCB)thread_start,ts,0,NULL);
+}
+
 int lcb_new_thread(TCB fun, void *data) {
   LuaCallback *lcb = (LuaCallback*)data;
-  HANDLE thread = CreateThread(NULL,THREAD_STACK_SIZE,fun,data,0,NULL);
-  return push_new_Thread(lcb->L,lcb,thread);
+  return push_new_Thread(lcb->L,lcb,start_thread(fun,data),NULL,0);
+}
+
+// Anything which only waits for a handle or a timeout is given to the reactor,
+// which waits for all of them on one background thread. The callback fn runs
+// on that thread.
+// hand over an op which has been set up already
+int lcb_reactor_push(void *data, ReactorOp *op) {
+  LuaCallback *lcb = (LuaCallback*)data;
+  lua_State *L = lcb->L;
+  DWORD id;
+  // from now on, the reactor thread may free data at any time
+  id = reactor_add(op);
+  return push_new_Thread(L,lcb,NULL,op,id);
+}
+
+int lcb_reactor_add(void *data, ReactorOp *op, HANDLE h, int timeout, ReactorFn fn) {
+  reactor_init_op(op,h,timeout,fn,data);
+  return lcb_reactor_push(data,op);
+}
+
+// like lcb_free, but safe for background threads, which cannot release the
+// callback reference directly. If the callback has already been discarded,
+// then release is FALSE.
+void lcb_done(void *data, BOOL release) {
+  LuaCallback *lcb = (LuaCallback*)data;
+  if (release) {
+    call_lua(lcb->L,lcb->callback,0,NULL,NO_CALL | DISCARD);
+  }
+  if (lcb->buf) {
+    free(lcb->buf);
+  }
+  if (lcb->handle) {
+    CloseHandle(lcb->handle);
+  }
+  free(lcb);
 }
 
-static void handle_waiter (LuaCallback *lcb) {
-  DWORD res = WaitForSingleObject(lcb->handle,lcb->bufsz);
-  lcb_call(lcb,0,res == WAIT_TIMEOUT ? "TIMEOUT" : "OK",0);
+typedef struct {
+  callback_data_
+  ReactorOp op;
+} WaitData;
+
+static int handle_ready(ReactorOp *op, int status) {
+  WaitData *wd = (WaitData*)op->data;
+  lcb_handle(wd) = NULL; // this belongs to the object being waited for
+  if (status == REACTOR_CANCELLED) {
+    lcb_done(wd,TRUE);
+  } else {
+    lcb_call(wd,0,status == REACTOR_READY ? "OK" :
+      (status == REACTOR_TIMEOUT ? "TIMEOUT" : "ERROR"),DISCARD);
+    lcb_done(wd,FALSE);
+  }
+  return 0;
 }
 
 static int push_wait_async(lua_State *L, HANDLE h, int timeout, int callback) {
-  LuaCallback *lcb = lcb_callback(NULL,L,callback);
-  lcb->handle = h;
-  lcb->bufsz = timeout;
-  return lcb_new_thread((TCB)handle_waiter,lcb);
+  WaitData *wd = (WaitData*)malloc(sizeof(WaitData));
+  lcb_callback(wd,L,callback);
+  return lcb_reactor_add(wd,&wd->op,h,timeout,handle_ready);
+}
+
+static void push_nil_arg(lua_State *L, void *data) {
+  lua_pushnil(L);
+}
+
+// The callback for a task is the task itself, which is resumed with the
+// callback's arguments. This must happen from the main thread.
+static void lcb_task(void *data, lua_State *L) {
+  lua_pushthread(L);
+  lcb_callback(data,L,-1);
+  lua_pop(L,1);
+  ((LuaCallback*)data)->L = main_state(L);
+}
+
+typedef struct {
+  callback_data_
+  Ref obj;      // the object waited on, or LUA_NOREF if sleeping
+  ReactorOp op;
+} TaskWait;
+
+static void push_task_obj(lua_State *L, void *data) {
+  Ref obj = (Ref)(INT_PTR)data;
+  push_ref(L,obj);
+  release_ref(L,obj);
+}
+
+static int task_wait_ready(ReactorOp *op, int status) {
+  TaskWait *tw = (TaskWait*)op->data;
+  lcb_handle(tw) = NULL; // this belongs to the object being waited for
+  if (tw->obj == LUA_NOREF) {
+    lcb_call(tw,0,NULL,DISCARD);
+  } else if (status == REACTOR_ERROR) {
+    call_lua(tw->L,tw->obj,0,NULL,NO_CALL | DISCARD);
+    lcb_call_push(tw,push_nil_arg,NULL,"cannot wait for this object",DISCARD);
+  } else {
+    // the task gets the same results as a blocking wait
+    lcb_call_push(tw,push_task_obj,(void*)(INT_PTR)tw->obj,
+      status == REACTOR_READY ? "OK" : "TIMEOUT",DISCARD);
+  }
+  lcb_done(tw,FALSE);
+  return 0;
+}
+
+// yield the task until h is signalled, or the timeout is up. If h is NULL, just sleep.
+static int task_wait(lua_State *L, HANDLE h, int timeout) {
+  TaskWait *tw = (TaskWait*)malloc(sizeof(TaskWait));
+  lcb_task(tw,L);
+  tw->obj = h ? make_ref(L,1) : LUA_NOREF;
+  reactor_init_op(&tw->op,h,timeout,task_wait_ready,tw);
+  reactor_add(&tw->op);
+  return lua_yield(L,0);
 }
 
 /// this represents a raw Windows file handle.
@@ -1264,144 +1707,1658 @@ static int push_wait_async(lua_State *L, HANDLE h, int timeout, int callback) {
 class File {
   callback_data_
   HANDLE hWrite;
+  RingBuf in;         // for buffered reads
+  unsigned scanned;   // how much of it is known not to hold a newline
+  BOOL at_end;
+  DWORD read_err;     // why it ended
+  BOOL reading;       // read_async has started
+  BOOL overlapped;    // opened with FILE_FLAG_OVERLAPPED
+  BOOL framed;        // read_async passes on whole messages
+  BOOL serial;        // reads which time out with nothing are not the end
+  HANDLE read_event, write_event;  // for waiting on our own overlapped reads and writes
 
   constructor (HANDLE hread, HANDLE hwrite) {
     lcb_handle(this) = hread;
     this->hWrite = hwrite;
     this->L = L;
+    this->callback = LUA_NOREF;  // only read_async without overlapped I/O sets this
     lcb_allocate_buffer(this,FILE_BUFF_SIZE);
+    ring_init(&this->in);
+    this->scanned = 0;
+    this->at_end = FALSE;
+    this->read_err = 0;
+    this->reading = FALSE;
+    this->overlapped = FALSE;
+    this->framed = FALSE;
+    this->serial = FALSE;
+    this->read_event = this->write_event = NULL;
+  }
+
+  // ReadFile or WriteFile, which waits until it is done even if the
+  // file is overlapped. Reads and writes have their own events, since a
+  // task may be reading in the background while the main thread writes.
+  static BOOL file_io(File *this, BOOL write, void *p, DWORD n, DWORD *done) {
+    HANDLE h = write ? this->hWrite : lcb_handle(this);
+    HANDLE *ev = write ? &this->write_event : &this->read_event;
+    OVERLAPPED ov, *pov = NULL;
+    BOOL ok;
+    if (this->overlapped) {
+      if (*ev == NULL)
+        *ev = CreateEvent(NULL,TRUE,FALSE,NULL);
+      memset(&ov,0,sizeof(ov));
+      ov.hEvent = *ev;
+      pov = &ov;
+    }
+    ok = write ? WriteFile(h,p,n,done,pov) : ReadFile(h,p,n,done,pov);
+    if (pov != NULL && (ok || GetLastError() == ERROR_IO_PENDING))
+      ok = GetOverlappedResult(h,pov,done,TRUE);
+    return ok;
+  }
+
+  static BOOL write_all(File *this, const char *p, DWORD n) {
+    DWORD wrote;
+    while (n > 0) {
+      if (! file_io(this,TRUE,(void*)p,n,&wrote))
+        return FALSE;
+      p += wrote;
+      n -= wrote;
+    }
+    return TRUE;
+  }
+
+  // The main thread lets go of the Lua mutex while it waits for a write,
+  // as it does for any other wait, so that callbacks can run meanwhile;
+  // otherwise a reader at the other end which calls back into Lua could
+  // never make room.
+  static BOOL write_waiting(File *this, const char *p, DWORD n) {
+    BOOL ok;
+    DWORD err;
+    release_mutex();
+    ok = write_all(this,p,n);
+    err = GetLastError();
+    lock_mutex();
+    SetLastError(err);
+    return ok;
   }
 
   /// write to a file.
   // @param s text
-  // @return number of bytes written.
+  // @return number of bytes written, or nil and the error.
   // @function write
   def write(Str s) {
-    DWORD bytesWrote;
-    WriteFile(this->hWrite, s, lua_objlen(L,2), &bytesWrote, NULL);
-    lua_pushinteger(L,bytesWrote);
+    size_t len = lua_objlen(L,2);
+    if (! write_waiting(this,s,(DWORD)len)) {
+      return push_error(L);
+    }
+    lua_pushinteger(L,len);
     return 1;
   }
 
-  static BOOL raw_read (File *this) {
-    DWORD bytesRead = 0;
-    BOOL res = ReadFile(lcb_handle(this), lcb_buf(this), lcb_bufsz(this), &bytesRead, NULL);
-    lcb_buf(this)[bytesRead] = '\0';
-    return res && bytesRead;
+  // the i'th piece, either in the table at idx or as an argument
+  static const char *piece(lua_State *L, int idx, BOOL list, int i, size_t *len) {
+    const char *s;
+    if (! list)
+      return luaL_checklstring(L,idx + i - 1,len);
+    lua_rawgeti(L,idx,i);
+    s = lua_tolstring(L,-1,len);
+    lua_pop(L,1); // still referenced by the table
+    if (s == NULL)
+      luaL_error(L,"writev: item %d is not a string",i);
+    return s;
   }
 
-  /// read from a file.
-  // Please note that this is not buffered, and you will have to
-  // split into lines, etc yourself.
-  // @return text if successful, nil plus error otherwise.
-  // @function read
-  def read() {
-    if (raw_read(this)) {
-      lua_pushstring(L,lcb_buf(this));
-      return 1;
+  /// write several strings at once.
+  // `WriteFileGather` only works for unbuffered files, so the strings
+  // are gathered up in C and written with one call to the system, rather
+  // than one each, and without joining them in Lua first. Very big
+  // writes are not gathered, since the copying would cost more than the
+  // calls it saves.
+  // @param ... strings, or a table of strings
+  // @return total number of bytes written
+  // @function writev
+  def writev(Value parts) {
+    BOOL list = lua_istable(L,parts);
+    int i, n = list ? (int)lua_objlen(L,parts) : lua_gettop(L) - 1;
+    size_t len, total = 0;
+    char *buf = NULL;
+    for (i = 1; i <= n; i++) {
+      piece(L,parts,list,i,&len);
+      total += len;
+    }
+    if (total <= WRITEV_GATHER_MAX) {
+      buf = (char*)scratch_buff(SCRATCH_BYTES,(int)total);
+    }
+    if (buf != NULL) {
+      char *p = buf;
+      for (i = 1; i <= n; i++) {
+        const char *s = piece(L,parts,list,i,&len);
+        memcpy(p,s,len);
+        p += len;
+      }
+      if (! write_waiting(this,buf,(DWORD)total)) {
+        return push_error(L);
+      }
     } else {
-      return push_error(L);
+      for (i = 1; i <= n; i++) {
+        const char *s = piece(L,parts,list,i,&len);
+        if (! write_waiting(this,s,(DWORD)len)) {
+          return push_error(L);
+        }
+      }
     }
+    lua_pushinteger(L,(lua_Integer)total);
+    return 1;
   }
 
-  static void file_reader (File *this) { // background reader thread
-    int n;
-    do {
-      n = raw_read(this);
-      // empty buffer is passed at end - we can discard the callback then.
-      lcb_call (this,0,lcb_buf(this),n == 0 ? DISCARD : 0);
-    } while (n);
+  // the text is not NUL-terminated, since it may contain NULs
+  static DWORD raw_read (File *this) {
+    DWORD bytesRead = 0;
+    this->read_err = 0;
+    if (! file_io(this,FALSE,lcb_buf(this),lcb_bufsz(this),&bytesRead)) {
+      this->read_err = GetLastError();
+      return 0;
+    }
+    return bytesRead;
+  }
 
+  /// set the size of each read.
+  // Bigger reads mean fewer calls to the system, and fewer strings, when
+  // moving a lot of data; this affects @{File:read} and @{File:read_async},
+  // and must be called before the latter. The default is 2048 bytes.
+  // @param size in bytes
+  // @function set_buffer_size
+  def set_buffer_size(Int size) {
+    char *buf;
+    if (size <= 0) {
+      return push_error_msg(L,"buffer size must be positive");
+    }
+    if (this->reading) {
+      return push_error_msg(L,"already reading asynchronously");
+    }
+    buf = (char*)realloc(lcb_buf(this),size);
+    if (buf == NULL) {
+      return push_error_msg(L,"out of memory");
+    }
+    lcb_buf(this) = buf;
+    lcb_bufsz(this) = size;
+    return push_ok(L);
   }
 
-  /// asynchronous read.
-  // @param callback function that will receive each chunk of text
-  // as it comes in.
-  // @return @{Thread}
-  // @function read_async
-  def read_async (Value callback) {
-    this->callback = make_ref(L,callback);
-    return lcb_new_thread((TCB)&file_reader,this);
+  // Buffered reads. The buffer is filled until what is asked for is there,
+  // or the file ends; then it is taken out as one Lua string.
+  enum {
+    READ_SOME,  // whatever is there, reading once if there is nothing
+    READ_LINE,
+    READ_N,
+    READ_ALL,
+    READ_MESSAGE  // a message framed by its length, see ring_frame
+  };
+
+  static BOOL fill(File *this) {
+    DWORD n = 0;
+    unsigned space;
+    char *p;
+    if (this->at_end)
+      return FALSE;
+    p = ring_space(&this->in,lcb_bufsz(this),&space);
+    if (p == NULL) {
+      this->read_err = ERROR_NOT_ENOUGH_MEMORY;
+      this->at_end = TRUE;
+    } else if (! file_io(this,FALSE,p,space,&n)) {
+      this->read_err = GetLastError();
+      this->at_end = TRUE;
+    } else if (n == 0) {
+      this->read_err = this->serial ? ERROR_TIMEOUT : ERROR_HANDLE_EOF;
+      this->at_end = TRUE;
+    } else {
+      ring_commit(&this->in,n);
+    }
+    return ! this->at_end;
   }
 
-  def close() {
-    if (this->hWrite != lcb_handle(this))
-      CloseHandle(this->hWrite);
-    lcb_free(this);
-    return 0;
+  // a serial port's read timeout only ends the read it happened in
+  static void clear_timeout(File *this) {
+    if (this->at_end && this->read_err == ERROR_TIMEOUT)
+      this->at_end = FALSE;
   }
 
-  def __gc () {
-    free(this->buf);
-    return 0;
+  // how many bytes to take, or -1 if more must be read first
+  static int buffered(File *this, int want, unsigned n) {
+    unsigned count = ring_count(&this->in), hdr;
+    int i;
+    switch (want) {
+    case READ_SOME:
+      return count > 0 || this->at_end ? (int)count : -1;
+    case READ_LINE:
+      i = ring_find(&this->in,'\n',this->scanned);
+      if (i >= 0)
+        return i + 1;
+      this->scanned = count;
+      return this->at_end ? (int)count : -1;
+    case READ_N:
+      return count >= n || this->at_end ? (int)(count < n ? count : n) : -1;
+    case READ_MESSAGE:
+      // a message cut short by the end is dropped
+      i = ring_frame(&this->in,&hdr);
+      if (i == RING_BAD) {
+        this->read_err = ERROR_INVALID_DATA;
+        this->at_end = TRUE;
+        return 0;
+      }
+      return i >= 0 ? i : (this->at_end ? 0 : -1);
+    default:
+      return this->at_end ? (int)count : -1;
+    }
   }
-}
 
+  static int read_buffered(File *this, int want, unsigned n) {
+    int len;
+    while ((len = buffered(this,want,n)) < 0)
+      fill(this);
+    return len;
+  }
 
-/// Launching processes.
-// @section Launch
+  // the same, for the main thread, which lets go of the Lua mutex if it
+  // has to wait, like @{File:write}
+  static int read_waiting(File *this, int want, unsigned n) {
+    int len = buffered(this,want,n);
+    if (len < 0) {
+      release_mutex();
+      len = read_buffered(this,want,n);
+      lock_mutex();
+    }
+    return len;
+  }
 
-/// set an environment variable for any child processes.
-// @{setenv.lua} shows how this also affects processes
-// launched with @{os.execute}
-// Note that this can't affect any system environment variables, see
-// [here](http://msdn.microsoft.com/en-us/library/ms682653%28VS.85%29.aspx)
-// for how to set these.
-// @param name name of variable
-// @param value value to set
-// @function setenv
-def setenv(Str name, Str value) {
-  WCHAR wname[256],wvalue[MAX_WPATH];
-  return push_bool(L, SetEnvironmentVariableW(wconv(name),wconv(value)));
-}
+  // push len bytes from the buffer; a line loses its line ending, unless kept
+  static void push_taken(lua_State *L, File *this, int len, int want, BOOL keep) {
+    const char *p = ring_peek(&this->in,len,(char*)scratch_buff(SCRATCH_BYTES,len));
+    int n = len;
+    if (want == READ_MESSAGE) {
+      unsigned hdr;
+      ring_frame(&this->in,&hdr);
+      p += hdr;
+      n -= hdr;
+    }
+    if (want == READ_LINE && ! keep) {
+      if (n > 0 && p[n-1] == '\n')
+        --n;
+      if (n > 0 && p[n-1] == '\r')
+        --n;
+    }
+    lua_pushlstring(L,p,n);
+    ring_consume(&this->in,len);
+    this->scanned = 0;
+  }
 
-/// Spawn a process.
-// @param program the command-line (program + parameters)
-// @param dir the working directory for the process (optional)
-// @return @{Process}
-// @return @{File}
-// @function spawn_process
-def spawn_process(Str program, StrNil dir) {
-  WCHAR wdir [MAX_WPATH];
-  SECURITY_ATTRIBUTES sa = {sizeof(SECURITY_ATTRIBUTES), 0, 0};
-  SECURITY_DESCRIPTOR sd;
-  STARTUPINFOW si = {
-           sizeof(STARTUPINFOW), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-       };
-  HANDLE hPipeRead,hWriteSubProcess;
-  HANDLE hRead2,hPipeWrite;
-  BOOL running;
-  PROCESS_INFORMATION pi;
-  sa.bInheritHandle = TRUE;
-  sa.lpSecurityDescriptor = NULL;
-  InitializeSecurityDescriptor(&sd, SECURITY_DESCRIPTOR_REVISION);
-  SetSecurityDescriptorDacl(&sd, TRUE, NULL, FALSE);
-  sa.nLength = sizeof(SECURITY_ATTRIBUTES);
-  sa.lpSecurityDescriptor = &sd;
+  // nothing was read, because the file has ended; read_all gives an empty string then
+  static BOOL ended(File *this, int len, int want) {
+    return len == 0 && want != READ_ALL;
+  }
 
-  // Create pipe for output redirection
-  CreatePipe(&hPipeRead, &hPipeWrite, &sa, 0);
+  typedef struct {
+    callback_data_
+    File *file;
+    int want;
+    unsigned n;
+    BOOL keep;
+    int len;
+    OVERLAPPED ov;   // for an overlapped file, whose reads are waited for by the reactor
+    BOOL pending;
+    ReactorOp op;
+  } TaskRead;
+
+  // in dispatch mode this runs later, on the main thread, so it frees tr
+  static void push_task_read(lua_State *L, TaskRead *tr) {
+    push_taken(L,tr->file,tr->len,tr->want,tr->keep);
+    free(tr);
+  }
 
-  // Create pipe for input redirection. In this code, you do not
-  // redirect the output of the child process, but you need a handle
-  // to set the hStdInput field in the STARTUP_INFO struct. For safety,
-  // you should not set the handles to an invalid handle.
+  // resume the task, once what it wants is in the buffer or the file has ended
+  static void resume_reader(TaskRead *tr, int len) {
+    File *this = tr->file;
+    tr->len = len;
+    if (ended(this,tr->len,tr->want)) {
+      lcb_call_push(tr,push_nil_arg,NULL,last_error(this->read_err),DISCARD);
+      free(tr);
+    } else {
+      lcb_call_push(tr,(LuaPusher)push_task_read,tr,NULL,DISCARD);
+    }
+  }
 
-  hRead2 = NULL;
-  CreatePipe(&hRead2, &hWriteSubProcess, &sa, 0);
+  static void task_reader(TaskRead *tr) { // background reader thread for a task
+    resume_reader(tr,read_buffered(tr->file,tr->want,tr->n));
+  }
 
-  SetHandleInformation(hPipeRead, HANDLE_FLAG_INHERIT, 0);
-  SetHandleInformation(hWriteSubProcess, HANDLE_FLAG_INHERIT, 0);
+  static void read_ended(File *this, DWORD err) {
+    this->read_err = err;
+    this->at_end = TRUE;
+  }
 
-  si.dwFlags = STARTF_USESHOWWINDOW | STARTF_USESTDHANDLES;
-  si.wShowWindow = SW_HIDE;
-  si.hStdInput = hRead2;
-  si.hStdOutput = hPipeWrite;
-  si.hStdError = hPipeWrite;
+  // the reactor's side of a task reading an overlapped file: each read goes
+  // straight into the file's buffer, until there is enough to resume the task
+  static int task_read_ready(ReactorOp *op, int status) {
+    TaskRead *tr = (TaskRead*)op->data;
+    File *this = tr->file;
+    DWORD got = 0;
+    unsigned space;
+    char *p;
+    int len;
+    if (status == REACTOR_CANCELLED) {
+      if (tr->pending) {
+        CancelIo(lcb_handle(this));
+        GetOverlappedResult(lcb_handle(this),&tr->ov,&got,TRUE);
+      }
+      lcb_done(tr,TRUE);
+      return 0;
+    }
+    if (status == REACTOR_ERROR) {
+      read_ended(this,ERROR_INVALID_HANDLE);
+    } else if (status == REACTOR_READY) {
+      tr->pending = FALSE;
+      if (! GetOverlappedResult(lcb_handle(this),&tr->ov,&got,FALSE))
+        read_ended(this,GetLastError());
+      else if (got == 0)
+        read_ended(this,this->serial ? ERROR_TIMEOUT : ERROR_HANDLE_EOF);
+      else
+        ring_commit(&this->in,got);
+    }
+    len = buffered(this,tr->want,tr->n);
+    if (len >= 0) {
+      resume_reader(tr,len);
+      return 0;
+    }
+    // the first read is also started here, so that it belongs to the reactor thread
+    op->timeout = REACTOR_FOREVER;
+    p = ring_space(&this->in,lcb_bufsz(this),&space);
+    if (p == NULL) {
+      read_ended(this,ERROR_NOT_ENOUGH_MEMORY);
+      resume_reader(tr,buffered(this,tr->want,tr->n));
+      return 0;
+    }
+    ResetEvent(tr->ov.hEvent);
+    if (! ReadFile(lcb_handle(this),p,space,NULL,&tr->ov)
+        && GetLastError() != ERROR_IO_PENDING) {
+      read_ended(this,GetLastError());
+      resume_reader(tr,buffered(this,tr->want,tr->n));
+      return 0;
+    }
+    tr->pending = TRUE;
+    return 1;
+  }
 
-  running = CreateProcessW(
+  // a big read goes straight into the buffer for the Lua string, after
+  // whatever the ring holds, so the bytes are only copied once more
+  static int read_direct(lua_State *L, File *this, unsigned n) {
+    unsigned have = ring_count(&this->in);
+    const char *q;
+    char *p;
+    DWORD got;
+#if LUA_VERSION_NUM > 501
+    luaL_Buffer B;
+    p = luaL_buffinitsize(L,&B,n);
+#else
+    p = (char*)scratch_buff(SCRATCH_BYTES,n);
+#endif
+    if (p == NULL) {
+      return push_error_msg(L,"out of memory");
+    }
+    q = ring_peek(&this->in,have,p);
+    if (q != p)
+      memcpy(p,q,have);
+    ring_consume(&this->in,have);
+    this->scanned = 0;
+    release_mutex();
+    while (have < n && ! this->at_end) {
+      if (! file_io(this,FALSE,p + have,n - have,&got)) {
+        this->read_err = GetLastError();
+        this->at_end = TRUE;
+      } else if (got == 0) {
+        this->read_err = this->serial ? ERROR_TIMEOUT : ERROR_HANDLE_EOF;
+        this->at_end = TRUE;
+      } else {
+        have += got;
+      }
+    }
+    lock_mutex();
+    if (have == 0) {
+      return push_error_code(L,this->read_err);
+    }
+#if LUA_VERSION_NUM > 501
+    luaL_pushresultsize(&B,have);
+#else
+    lua_pushlstring(L,p,have);
+#endif
+    return 1;
+  }
+
+  static int read_as(lua_State *L, File *this, int want, unsigned n, BOOL keep) {
+    int len;
+    clear_timeout(this);
+    if (want == READ_N && n > ring_count(&this->in) && ! in_task(L)) {
+      return read_direct(L,this,n);
+    }
+    if (in_task(L) && buffered(this,want,n) < 0) {
+      TaskRead *tr = (TaskRead*)malloc(sizeof(TaskRead));
+      lcb_task(tr,L);
+      tr->file = this;
+      tr->want = want;
+      tr->n = n;
+      tr->keep = keep;
+      tr->pending = FALSE;
+      if (this->overlapped) {
+        // the file's own event; nothing else reads it while the task waits
+        if (this->read_event == NULL)
+          this->read_event = CreateEvent(NULL,TRUE,FALSE,NULL);
+        memset(&tr->ov,0,sizeof(tr->ov));
+        tr->ov.hEvent = this->read_event;
+        reactor_init_op(&tr->op,tr->ov.hEvent,0,task_read_ready,tr);
+        reactor_add(&tr->op);
+      } else {
+        CloseHandle(start_thread((TCB)task_reader,tr));
+      }
+      return lua_yield(L,0);
+    }
+    len = read_waiting(this,want,n);
+    if (ended(this,len,want))
+      return push_error_code(L,this->read_err);
+    push_taken(L,this,len,want,keep);
+    return 1;
+  }
+
+  /// read from a file.
+  // Without a count, this returns whatever text is to hand; if there is
+  // none, it waits for the next chunk, of up to the buffer size (see
+  // @{File:set_buffer_size}). Inside a task (see @{go}) the read
+  // happens in the background, and other tasks can run meanwhile. For a
+  // file opened for overlapped I/O (any pipe from a pooled @{make_pipe_server},
+  // or one opened with the overlapped option) the reads are waited for by the
+  // same background thread as timers; otherwise each such read needs a
+  // thread of its own until it is done.
+  // The text may be binary, including NULs.
+  // @param n optional number of bytes; fewer are returned only at the end.
+  // A big count is read straight into the result, not through the buffer.
+  // @return text if successful, nil plus error otherwise (including at the end)
+  // @function read
+  def read(Int n = 0) {
+    return read_as(L,this,n > 0 ? READ_N : READ_SOME,n,FALSE);
+  }
+
+  /// read a line from a file.
+  // The text is buffered, and split into lines in C, so there is only one
+  // Lua string per line. A task waits for the line in the background.
+  // @param keep if true, keep the line ending; otherwise `\n` or `\r\n` is removed
+  // @return the line, or nil plus error at the end
+  // @function read_line
+  def read_line(Boolean keep) {
+    return read_as(L,this,READ_LINE,0,keep);
+  }
+
+  /// read everything until the end of the file.
+  // @return the text
+  // @function read_all
+  def read_all() {
+    return read_as(L,this,READ_ALL,0,FALSE);
+  }
+
+  /// read a message written by @{File:write_message}.
+  // Each message is put back together from however many reads it takes,
+  // and comes back as one string. A task waits for it in the background.
+  // @return the message, or nil plus error at the end, or if what was
+  // read is not a message
+  // @function read_message
+  def read_message() {
+    return read_as(L,this,READ_MESSAGE,0,FALSE);
+  }
+
+  /// write a message.
+  // The length goes first, as a varint, so that @{File:read_message} at
+  // the other end gets the message whole, however the pipe splits it up.
+  // @param s the message, which may be binary
+  // @return true, or nil plus error
+  // @function write_message
+  def write_message(Str s) {
+    size_t len = lua_objlen(L,2);
+    char hdr[RING_FRAME_HEADER], *buf = NULL;
+    int h;
+    if (len > RING_FRAME_MAX) {
+      return push_error_msg(L,"message is too long");
+    }
+    h = ring_put_length(hdr,(unsigned)len);
+    if (len + h <= WRITEV_GATHER_MAX) {
+      buf = (char*)scratch_buff(SCRATCH_BYTES,(int)(len + h));
+    }
+    if (buf != NULL) {
+      memcpy(buf,hdr,h);
+      memcpy(buf + h,s,len);
+      if (! write_waiting(this,buf,(DWORD)(len + h)))
+        return push_error(L);
+    } else if (! write_waiting(this,hdr,h) || ! write_waiting(this,s,(DWORD)len)) {
+      return push_error(L);
+    }
+    return push_ok(L);
+  }
+
+  static int next_line(lua_State *L) {
+    File *this = (File*)lua_touserdata(L,lua_upvalueindex(1));
+    int len;
+    clear_timeout(this);
+    len = read_waiting(this,READ_LINE,0);
+    if (ended(this,len,READ_LINE))
+      return 0;
+    push_taken(L,this,len,READ_LINE,FALSE);
+    return 1;
+  }
+
+  /// iterate over the lines of a file.
+  // Like @{File:read_line}, but this always waits for each line,
+  // even inside a task.
+  // @return an iterator
+  // @usage for line in f:lines() do print(line) end
+  // @function lines
+  def lines() {
+    lua_pushvalue(L,1);
+    lua_pushcclosure(L,next_line,1);
+    return 1;
+  }
+
+  // pass on each message which has all arrived; FALSE if the framing is broken
+  static BOOL call_frames(void *lcb, RingBuf *r) {
+    unsigned hdr;
+    int len;
+    while ((len = ring_frame(r,&hdr)) >= 0) {
+      char *scratch = (char*)scratch_buff(SCRATCH_BYTES,len);
+      const char *p;
+      if (scratch == NULL)
+        return FALSE;
+      p = ring_peek(r,len,scratch);
+      lcb_call_len(lcb,p + hdr,len - hdr,0);
+      ring_consume(r,len);
+    }
+    return len != RING_BAD;
+  }
+
+  static void file_reader (File *this) { // background reader thread
+    DWORD n;
+    if (this->framed) {
+      // an empty message is still a message, so the end is nil plus error
+      while (call_frames(this,&this->in)) {
+        if (! fill(this)) {
+          if (this->read_err != ERROR_TIMEOUT)
+            break;
+          clear_timeout(this);
+        }
+      }
+      if (! this->at_end)
+        this->read_err = ERROR_INVALID_DATA;
+      lcb_call_push(this,push_nil_arg,NULL,last_error(this->read_err),DISCARD);
+      return;
+    }
+    for (;;) {
+      n = raw_read(this);
+      // a serial port read which times out with nothing is not the end
+      if (n == 0 && this->serial && this->read_err == 0)
+        continue;
+      // empty buffer is passed at end - we can discard the callback then.
+      lcb_call_len(this,lcb_buf(this),n,n == 0 ? DISCARD : 0);
+      if (n == 0)
+        break;
+    }
+
+  }
+
+  // Overlapped reads and writes are waited for by the reactor thread,
+  // like the directory watcher, so a file does not need a thread of its own.
+  // The handle is the event, so lcb_done closes it.
+  typedef struct {
+    callback_data_
+    HANDLE file;
+    OVERLAPPED ov;
+    BOOL pending;   // is a read in progress?
+    BOOL notify;    // write_async was given a callback
+    BOOL framed;    // reads go into the ring, and whole messages are passed on
+    BOOL serial;    // a read may time out with nothing
+    unsigned high_water;  // if not zero, reads go into the ring until it holds this much
+    DWORD latency;  // or until the first of them has waited this long, in msec
+    DWORD first;
+    RingBuf in;
+    ReactorOp op;
+  } FileIo;
+
+  static FileIo *file_io_new(lua_State *L, HANDLE file, int callback, int size) {
+    FileIo *fio = (FileIo*)malloc(sizeof(FileIo));
+    lcb_callback(fio,L,callback);
+    fio->file = file;
+    fio->pending = FALSE;
+    fio->notify = ! lua_isnoneornil(L,callback);
+    fio->framed = FALSE;
+    fio->serial = FALSE;
+    fio->high_water = 0;
+    ring_init(&fio->in);
+    memset(&fio->ov,0,sizeof(fio->ov));
+    fio->ov.hEvent = lcb_handle(fio) = CreateEvent(NULL,TRUE,FALSE,NULL);
+    lcb_allocate_buffer(fio,size > 0 ? size : 1);
+    return fio;
+  }
+
+  static void file_io_done(FileIo *fio, BOOL release) {
+    ring_free(&fio->in);
+    lcb_done(fio,release);
+  }
+
+  // pass on everything in the ring as one chunk
+  static void call_buffered(void *lcb, RingBuf *r) {
+    unsigned n = ring_count(r);
+    char *scratch = (char*)scratch_buff(SCRATCH_BYTES,n);
+    if (n == 0 || scratch == NULL)
+      return;
+    lcb_call_len(lcb,ring_peek(r,n,scratch),n,0);
+    ring_consume(r,n);
+  }
+
+  // as with file_reader, an empty chunk means the end, or nil plus error for messages
+  static int async_read_end(FileIo *fio, DWORD err) {
+    if (fio->high_water > 0)
+      call_buffered(fio,&fio->in);
+    if (fio->framed)
+      lcb_call_push(fio,push_nil_arg,NULL,last_error(err),DISCARD);
+    else
+      lcb_call_len(fio,lcb_buf(fio),0,DISCARD);
+    file_io_done(fio,FALSE);
+    return 0;
+  }
+
+  static int async_read_ready(ReactorOp *op, int status) {
+    FileIo *fio = (FileIo*)op->data;
+    DWORD n = 0, space = lcb_bufsz(fio);
+    char *p = lcb_buf(fio);
+    if (status == REACTOR_CANCELLED) {
+      if (fio->pending) {
+        // the read was started on this thread, so CancelIo will stop it
+        CancelIo(fio->file);
+        GetOverlappedResult(fio->file,&fio->ov,&n,TRUE);
+      }
+      file_io_done(fio,TRUE);
+      return 0;
+    }
+    if (status == REACTOR_ERROR) {
+      return async_read_end(fio,ERROR_INVALID_HANDLE);
+    }
+    if (status == REACTOR_READY) {
+      fio->pending = FALSE;
+      if (! GetOverlappedResult(fio->file,&fio->ov,&n,FALSE))
+        return async_read_end(fio,GetLastError());
+      if (n == 0 && ! fio->serial)
+        return async_read_end(fio,ERROR_HANDLE_EOF);
+      if (fio->framed) {
+        ring_commit(&fio->in,n);
+        if (! call_frames(fio,&fio->in))
+          return async_read_end(fio,ERROR_INVALID_DATA);
+      } else if (fio->high_water > 0) {
+        if (n > 0 && ring_count(&fio->in) == 0)
+          fio->first = GetTickCount();
+        ring_commit(&fio->in,n);
+        // a serial read which times out with nothing means the port has gone quiet
+        if (ring_count(&fio->in) >= fio->high_water || n == 0)
+          call_buffered(fio,&fio->in);
+      } else if (n > 0) {
+        lcb_call_len(fio,lcb_buf(fio),n,0);
+      }
+    }
+    // below the high-water mark, what has come in is passed on once it has waited long enough
+    op->timeout = REACTOR_FOREVER;
+    if (fio->high_water > 0 && ring_count(&fio->in) > 0) {
+      DWORD elapsed = GetTickCount() - fio->first;
+      if (elapsed >= fio->latency)
+        call_buffered(fio,&fio->in);
+      else
+        op->timeout = fio->latency - elapsed;
+    }
+    if (fio->pending) {
+      return 1;
+    }
+    if (fio->framed || fio->high_water > 0) {
+      unsigned avail;
+      p = ring_space(&fio->in,lcb_bufsz(fio),&avail);
+      if (p == NULL)
+        return async_read_end(fio,ERROR_NOT_ENOUGH_MEMORY);
+      space = avail;
+    }
+    // the first read is also started here, so that it belongs to the reactor thread
+    ResetEvent(fio->ov.hEvent);
+    if (! ReadFile(fio->file,p,space,NULL,&fio->ov)
+        && GetLastError() != ERROR_IO_PENDING)
+      return async_read_end(fio,GetLastError());
+    fio->pending = TRUE;
+    return 1;
+  }
+
+  static int async_write_ready(ReactorOp *op, int status) {
+    FileIo *fio = (FileIo*)op->data;
+    DWORD n = 0;
+    // the buffer must stay put until the write is done, whatever happens
+    BOOL ok = GetOverlappedResult(fio->file,&fio->ov,&n,TRUE);
+    if (fio->notify && status != REACTOR_CANCELLED) {
+      if (ok)
+        lcb_call(fio,n,NULL,INTEGER | DISCARD);
+      else
+        lcb_call_push(fio,push_nil_arg,NULL,last_error(0),DISCARD);
+      lcb_done(fio,FALSE);
+    } else {
+      lcb_done(fio,fio->notify);
+    }
+    return 0;
+  }
+
+  /// asynchronous read.
+  // Each chunk is up to the buffer size (see @{File:set_buffer_size}),
+  // and may be binary. If the file was opened for overlapped I/O, the
+  // reads are waited for by the same background thread as timers, rather
+  // than a thread for each file. The callback then holds up that thread while
+  // it runs, so it must not block (see @{make_timer}).
+  // @param callback function that will receive each chunk of text
+  // as it comes in.
+  // @param opts optional; if true, the callback receives each message written
+  // by @{File:write_message} whole, and nil plus error at the end.
+  // Otherwise a table with fields:
+  //
+  // * `framed` as above
+  // * `high_water` collect what comes in, and only pass it on once there is
+  // at least this many bytes. For overlapped files only.
+  // * `latency` but do not keep anything waiting longer than this, in msec (default 50).
+  // A serial read which times out with nothing also passes on what there is.
+  //
+  // @return @{Thread}
+  // @function read_async
+  def read_async (Value callback, Value opts) {
+    BOOL framed = lua_toboolean(L,opts);
+    int high_water = 0, latency = 50;
+    if (lua_istable(L,opts)) {
+      framed = opt_bool_field(L,opts,"framed",FALSE);
+      high_water = opt_int_field(L,opts,"high_water",0);
+      latency = opt_int_field(L,opts,"latency",50);
+    }
+    if (high_water > 0 && ! this->overlapped) {
+      return push_error_msg(L,"high_water needs an overlapped file");
+    }
+    this->reading = TRUE;
+    this->framed = framed;
+    if (this->overlapped) {
+      FileIo *fio = file_io_new(L,lcb_handle(this),callback,lcb_bufsz(this));
+      fio->framed = framed;
+      fio->serial = this->serial;
+      if (! framed && high_water > 0) {
+        fio->high_water = high_water;
+        fio->latency = latency > 0 ? latency : 0;
+      }
+      return lcb_reactor_add(fio,&fio->op,fio->ov.hEvent,0,async_read_ready);
+    }
+    this->callback = make_ref(L,callback);
+    return lcb_new_thread((TCB)&file_reader,this);
+  }
+
+  /// asynchronous write.
+  // This returns straight away, and the text is written in the background.
+  // Writes finish in the order they were made. The file must have been
+  // opened for overlapped I/O, see @{open_pipe}, @{make_pipe_server}
+  // and @{open_serial}.
+  // @param s text, which may be binary
+  // @param callback optional function which is passed the number of bytes
+  // written, or nil and an error message
+  // @param framed if true, write `s` as a message, like @{File:write_message}
+  // @return true, or nil and an error message if the write could not start
+  // @function write_async
+  def write_async (Str s, Value callback, Boolean framed) {
+    DWORD len = (DWORD)lua_objlen(L,2);
+    char hdr[RING_FRAME_HEADER];
+    int h = 0;
+    FileIo *fio;
+    if (! this->overlapped) {
+      return push_error_msg(L,"file is not overlapped");
+    }
+    if (framed) {
+      if (len > RING_FRAME_MAX)
+        return push_error_msg(L,"message is too long");
+      h = ring_put_length(hdr,len);
+    }
+    fio = file_io_new(L,this->hWrite,callback,len + h);
+    memcpy(lcb_buf(fio),hdr,h);
+    memcpy(lcb_buf(fio) + h,s,len);
+    len += h;
+    if (! WriteFile(this->hWrite,lcb_buf(fio),len,NULL,&fio->ov)
+        && GetLastError() != ERROR_IO_PENDING) {
+      DWORD err = GetLastError();
+      lcb_free(fio);
+      free(fio);
+      return push_error_code(L,err);
+    }
+    reactor_init_op(&fio->op,fio->ov.hEvent,REACTOR_FOREVER,async_write_ready,fio);
+    reactor_add(&fio->op);
+    return push_ok(L);
+  }
+
+  static void close_events(File *this) {
+    if (this->read_event)
+      CloseHandle(this->read_event);
+    if (this->write_event)
+      CloseHandle(this->write_event);
+    this->read_event = this->write_event = NULL;
+  }
+
+  def close() {
+    if (this->hWrite != lcb_handle(this))
+      CloseHandle(this->hWrite);
+    lcb_free(this);
+    ring_free(&this->in);
+    close_events(this);
+    return 0;
+  }
+
+  def __gc () {
+    free(this->buf);
+    ring_free(&this->in);
+    close_events(this);
+    return 0;
+  }
+}
+
+// a pipe or serial port opened with FILE_FLAG_OVERLAPPED
+static int push_overlapped_File(lua_State *L, HANDLE h) {
+  push_new_File(L,h,h);
+  File_arg(L,-1)->overlapped = TRUE;
+  return 1;
+}
+
+static int push_serial_File(lua_State *L, HANDLE h, BOOL overlapped) {
+  push_new_File(L,h,h);
+  File_arg(L,-1)->overlapped = overlapped;
+  File_arg(L,-1)->serial = TRUE;
+  return 1;
+}
+
+#define PUMP_BUFF_SIZE 65536
+
+#define PUMP_STOP_MSEC 10
+
+typedef struct {
+  callback_data_
+  File *src, *dst;
+  Ref src_ref, dst_ref;   // so that neither is collected while we pump
+  volatile BOOL stopped;  // by Thread:kill
+  volatile LONG refs;     // held by the pump thread and by its Thread object
+} PumpData;
+
+static void pump_release(PumpData *pd) {
+  if (InterlockedDecrement(&pd->refs) == 0) {
+    free(lcb_buf(pd));
+    free(pd);
+  }
+}
+
+typedef BOOL (WINAPI *CancelIoExFn)(HANDLE,LPOVERLAPPED);
+typedef BOOL (WINAPI *CancelSynchronousIoFn)(HANDLE);
+
+// A pump is not terminated, since it would then never let go of its
+// Files. Instead its reads and writes are cancelled until it notices that
+// it has been stopped; this needs Vista or later, and on XP a pump cannot be killed.
+static BOOL pump_stop(void *data, HANDLE thread, BOOL kill) {
+  PumpData *pd = (PumpData*)data;
+  HMODULE kernel = GetModuleHandleA("kernel32.dll");
+  CancelIoExFn cancel_io = (CancelIoExFn)GetProcAddress(kernel,"CancelIoEx");
+  CancelSynchronousIoFn cancel_sync = (CancelSynchronousIoFn)GetProcAddress(kernel,"CancelSynchronousIo");
+  if (kill) {
+    if (cancel_io == NULL || cancel_sync == NULL)
+      return FALSE;
+    pd->stopped = TRUE;
+    // the pump needs the Lua mutex to let go of its references
+    release_mutex();
+    do {
+      // overlapped Files wait for their own I/O, which CancelSynchronousIo does not reach
+      cancel_sync(thread);
+      cancel_io(lcb_handle(pd->src),NULL);
+      cancel_io(pd->dst->hWrite,NULL);
+    } while (WaitForSingleObject(thread,PUMP_STOP_MSEC) == WAIT_TIMEOUT);
+    lock_mutex();
+  }
+  pump_release(pd);
+  return TRUE;
+}
+
+// the total is passed separately, since the pump is gone by the time
+// a queued callback runs.
+static void push_pumped(lua_State *L, void *data) {
+  ULONGLONG *total = (ULONGLONG*)data;
+  lua_pushnumber(L,(lua_Number)*total);
+  free(total);
+}
+
+static void pump_thread(PumpData *pd) { // background thread
+  File *src = pd->src, *dst = pd->dst;
+  unsigned have = ring_count(&src->in);
+  ULONGLONG *total = (ULONGLONG*)malloc(sizeof(ULONGLONG));
+  DWORD n, err = 0;
+  *total = 0;
+  // anything already buffered by reads from Lua goes first
+  if (have > 0) {
+    const char *p = ring_peek(&src->in,have,(char*)scratch_buff(SCRATCH_BYTES,have));
+    if (p == NULL)
+      err = ERROR_NOT_ENOUGH_MEMORY;
+    else if (! write_all(dst,p,have))
+      err = GetLastError();
+    else
+      *total += have;
+    ring_consume(&src->in,have);
+  }
+  while (err == 0 && ! src->at_end && ! pd->stopped) {
+    if (! file_io(src,FALSE,lcb_buf(pd),lcb_bufsz(pd),&n)) {
+      err = GetLastError();
+      // the other end closing is the normal way for a pipe to end
+      if (err == ERROR_BROKEN_PIPE || err == ERROR_HANDLE_EOF)
+        err = 0;
+      break;
+    }
+    if (n == 0)
+      break;
+    if (! write_all(dst,lcb_buf(pd),n)) {
+      err = GetLastError();
+      break;
+    }
+    *total += n;
+  }
+  call_lua(pd->L,pd->src_ref,0,NULL,NO_CALL | DISCARD);
+  call_lua(pd->L,pd->dst_ref,0,NULL,NO_CALL | DISCARD);
+  if (pd->callback != LUA_REFNIL && ! pd->stopped) {
+    lcb_call_push(pd,push_pumped,total,err ? last_error(err) : NULL,DISCARD);
+  } else {
+    if (pd->callback != LUA_REFNIL)
+      call_lua(pd->L,pd->callback,0,NULL,NO_CALL | DISCARD);
+    free(total);
+  }
+  pump_release(pd);
+}
+
+/// copy everything from one file to another, in the background.
+// The bytes go from one handle to the other in C, through a big buffer,
+// so no Lua strings are made and Lua is not called until the end.
+// Anything already read into the source's buffer is written first. Do not
+// use either file otherwise until the pump has finished.
+// @param src the @{File} to read from, until it ends
+// @param dst the @{File} to write to
+// @param opts optional callback, or a table with fields:
+//
+// * `callback` passed the number of bytes copied when the source ends, plus
+// an error message if something went wrong
+// * `size` the size of each read (default 65536)
+//
+// @return @{Thread}; @{Thread:kill} stops the pump, after which the callback is not called
+// @function pump
+def pump(Value src, Value dst, Value opts) {
+  PumpData *pd;
+  int callback = opts, size = PUMP_BUFF_SIZE;
+  File *fsrc = File_arg(L,src), *fdst = File_arg(L,dst);
+  if (lua_istable(L,opts)) {
+    size = opt_int_field(L,opts,"size",PUMP_BUFF_SIZE);
+    lua_getfield(L,opts,"callback");
+    callback = lua_gettop(L);
+  }
+  if (size <= 0) {
+    return push_error_msg(L,"buffer size must be positive");
+  }
+  pd = (PumpData*)malloc(sizeof(PumpData));
+  lcb_callback(pd,L,callback);
+  lcb_allocate_buffer(pd,size);
+  if (lcb_buf(pd) == NULL) {
+    lcb_free(pd);
+    free(pd);
+    return push_error_msg(L,"out of memory");
+  }
+  pd->src = fsrc;
+  pd->dst = fdst;
+  pd->src_ref = make_ref(L,src);
+  pd->dst_ref = make_ref(L,dst);
+  pd->stopped = FALSE;
+  pd->refs = 2;
+  lcb_new_thread((TCB)&pump_thread,pd);
+  Thread_arg(L,-1)->stop = pump_stop;
+  return 1;
+}
+
+/// Memory-mapped files.
+// @section Mapping
+
+// the first place where the len bytes of s are found in n bytes at p, or NULL
+static const char *find_bytes(const char *p, size_t n, const char *s, size_t len) {
+  const char *end = p + n, *q;
+  if (len == 0)
+    return p;
+  while ((size_t)(end - p) >= len) {
+    q = (const char*)memchr(p,s[0],(end - p) - len + 1);
+    if (q == NULL)
+      return NULL;
+    if (memcmp(q,s,len) == 0)
+      return q;
+    p = q + 1;
+  }
+  return NULL;
+}
+
+/// a file mapped into memory.
+// Nothing is copied until it is asked for; @{Mapping:sub},
+// @{Mapping:find} and @{Mapping:lines} work on the mapped bytes, and only
+// make strings for what they return. Positions start at 1 and may be
+// negative, as with Lua strings. `#m` is the size in bytes.
+// @type Mapping
+class Mapping {
+  HANDLE hFile;
+  HANDLE hMap;
+  char *base;
+  size_t size;
+  BOOL writeable;
+
+  constructor (HANDLE file, HANDLE map, LPSTR base, size_t size, BOOL writeable) {
+    this->hFile = file;
+    this->hMap = map;
+    this->base = base;
+    this->size = size;
+    this->writeable = writeable;
+  }
+
+  static void check_open(lua_State *L, Mapping *this) {
+    if (this->hFile == NULL)
+      luaL_error(L,"mapping is closed");
+  }
+
+  // a position as an offset, clamped to 0..size; negative positions count from the end
+  static size_t offset_of(Mapping *this, lua_Number i) {
+    if (i < 0)
+      i += (lua_Number)this->size + 1;
+    if (i < 1)
+      return 0;
+    if (i > (lua_Number)this->size)
+      return this->size;
+    return (size_t)i - 1;
+  }
+
+  /// the bytes from i to j, like `string.sub`.
+  // @param i start (default 1)
+  // @param j end, inclusive (default -1, the last byte)
+  // @return a string
+  // @function sub
+  def sub(Number i = 1, Value jv) {
+    lua_Number j = luaL_optnumber(L,jv,-1);
+    size_t start, end;
+    check_open(L,this);
+    start = offset_of(this,i);
+    if (j < 0)
+      j += (lua_Number)this->size + 1;
+    end = j < 0 ? 0 : (j > (lua_Number)this->size ? this->size : (size_t)j);
+    lua_pushlstring(L,this->base + start,end > start ? end - start : 0);
+    return 1;
+  }
+
+  /// find some text.
+  // This is a plain search, not a Lua pattern; for patterns, go through
+  // the @{Mapping:lines} and match each one.
+  // @param s the text
+  // @param init where to start looking (default 1)
+  // @return start and end positions, or nil
+  // @function find
+  def find(Str s, Number init = 1) {
+    size_t start, len = lua_objlen(L,2);
+    const char *q;
+    check_open(L,this);
+    start = offset_of(this,init);
+    q = find_bytes(this->base + start,this->size - start,s,len);
+    if (q == NULL) {
+      lua_pushnil(L);
+      return 1;
+    }
+    lua_pushnumber(L,(lua_Number)(q - this->base) + 1);
+    lua_pushnumber(L,(lua_Number)(q - this->base) + len);
+    return 2;
+  }
+
+  static int next_mapped_line(lua_State *L) {
+    Mapping *this = (Mapping*)lua_touserdata(L,lua_upvalueindex(1));
+    size_t pos = (size_t)lua_tonumber(L,lua_upvalueindex(2));
+    const char *p, *q;
+    size_t n;
+    check_open(L,this);
+    if (pos >= this->size)
+      return 0;
+    p = this->base + pos;
+    q = (const char*)memchr(p,'\n',this->size - pos);
+    n = q ? (size_t)(q - p) : this->size - pos;
+    lua_pushnumber(L,(lua_Number)(pos + n + 1));
+    lua_replace(L,lua_upvalueindex(2));
+    if (n > 0 && p[n-1] == '\r')
+      --n;
+    lua_pushlstring(L,p,n);
+    return 1;
+  }
+
+  /// iterate over the lines.
+  // `\n` or `\r\n` is removed from each line.
+  // @param init where to start (default 1)
+  // @return an iterator
+  // @usage for line in m:lines() do print(line) end
+  // @function lines
+  def lines(Number init = 1) {
+    check_open(L,this);
+    lua_pushvalue(L,1);
+    lua_pushnumber(L,(lua_Number)offset_of(this,init));
+    lua_pushcclosure(L,next_mapped_line,2);
+    return 1;
+  }
+
+  /// write into the mapping.
+  // The mapping must have been opened with mode 'w'. It cannot grow,
+  // so the text must fit.
+  // @param i position
+  // @param s text
+  // @function put
+  def put(Number i, Str s) {
+    size_t start, len = lua_objlen(L,3);
+    check_open(L,this);
+    if (! this->writeable) {
+      return push_error_msg(L,"mapping is read-only");
+    }
+    start = offset_of(this,i);
+    if (len > this->size - start) {
+      return push_error_msg(L,"text does not fit");
+    }
+    memcpy(this->base + start,s,len);
+    return push_ok(L);
+  }
+
+  def __len() {
+    lua_pushnumber(L,(lua_Number)this->size);
+    return 1;
+  }
+
+  /// unmap the file and close it.
+  // @function close
+  def close() {
+    if (this->base != NULL)
+      UnmapViewOfFile(this->base);
+    if (this->hMap != NULL)
+      CloseHandle(this->hMap);
+    if (this->hFile != NULL)
+      CloseHandle(this->hFile);
+    this->base = NULL;
+    this->hMap = this->hFile = NULL;
+    this->size = 0;
+    return 0;
+  }
+
+  def __gc() {
+    return l_Mapping_close(L);
+  }
+}
+
+/// map a file into memory.
+// The whole file is mapped, so on a 32-bit system it must fit in the
+// address space.
+// @param path the file
+// @param mode 'r' to read (the default) or 'w' to also write, with @{Mapping:put}
+// @return @{Mapping}
+// @function map_file
+def map_file(Str path, Str mode = "r") {
+  BOOL writeable = *mode == 'w';
+  HANDLE hFile, hMap = NULL;
+  LARGE_INTEGER size;
+  char *base = NULL;
+  hFile = CreateFileW(wstring(path),
+    writeable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+    FILE_SHARE_READ | (writeable ? 0 : FILE_SHARE_WRITE),
+    NULL,
+    OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+    NULL);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    return push_error(L);
+  }
+  if (! GetFileSizeEx(hFile,&size)) {
+    DWORD err = GetLastError();
+    CloseHandle(hFile);
+    return push_error_code(L,err);
+  }
+  if ((ULONGLONG)size.QuadPart > (ULONGLONG)(size_t)-1) {
+    CloseHandle(hFile);
+    return push_error_msg(L,"file is too big to map");
+  }
+  // an empty file cannot be mapped, but it is still a mapping of nothing
+  if (size.QuadPart > 0) {
+    hMap = CreateFileMapping(hFile,NULL,writeable ? PAGE_READWRITE : PAGE_READONLY,0,0,NULL);
+    if (hMap != NULL) {
+      base = (char*)MapViewOfFile(hMap,writeable ? FILE_MAP_WRITE : FILE_MAP_READ,0,0,0);
+    }
+    if (base == NULL) {
+      DWORD err = GetLastError();
+      if (hMap != NULL)
+        CloseHandle(hMap);
+      CloseHandle(hFile);
+      return push_error_code(L,err);
+    }
+  }
+  return push_new_Mapping(L,hFile,hMap,base,(size_t)size.QuadPart,writeable);
+}
+
+
+/// Launching processes.
+// @section Launch
+
+/// set an environment variable for any child processes.
+// @{setenv.lua} shows how this also affects processes
+// launched with @{os.execute}
+// Note that this can't affect any system environment variables, see
+// [here](http://msdn.microsoft.com/en-us/library/ms682653%28VS.85%29.aspx)
+// for how to set these.
+// @param name name of variable
+// @param value value to set
+// @function setenv
+def setenv(Str name, Str value) {
+  WCHAR wname[256],wvalue[MAX_WPATH];
+  return push_bool(L, SetEnvironmentVariableW(wconv(name),wconv(value)));
+}
+
+// add an argument to a command line, quoted so that the C runtime (and
+// CommandLineToArgvW) will give it back to the program unchanged.
+static void add_quoted_arg(luaL_Buffer *B, const char *arg) {
+  const char *p;
+  if (*arg && strpbrk(arg," \t\n\v\"") == NULL) {
+    luaL_addstring(B,arg);
+    return;
+  }
+  luaL_addchar(B,'"');
+  for (p = arg; ; p++) {
+    int slashes = 0;
+    while (*p == '\\') {
+      ++p;
+      ++slashes;
+    }
+    // backslashes only need doubling before a quote, including the closing one
+    if (*p == '\0' || *p == '"')
+      slashes = 2*slashes + (*p == '"');
+    while (slashes-- > 0)
+      luaL_addchar(B,'\\');
+    if (*p == '\0')
+      break;
+    luaL_addchar(B,*p);
+  }
+  luaL_addchar(B,'"');
+}
+
+// push the command line for an argv array. Numbers are allowed, so each
+// entry is first made a string in a table of our own, which keeps it alive
+// while the buffer grows.
+static void push_command_line(lua_State *L, int argv) {
+  luaL_Buffer B;
+  int i, args, n = lua_objlen(L,argv);
+  if (n == 0)
+    luaL_error(L,"spawn_process: argv is empty");
+  lua_createtable(L,n,0);
+  args = lua_gettop(L);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L,argv,i);
+    if (! lua_isstring(L,-1))
+      luaL_error(L,"spawn_process: argv[%d] is not a string",i);
+    lua_tostring(L,-1);
+    lua_rawseti(L,args,i);
+  }
+  luaL_buffinit(L,&B);
+  for (i = 1; i <= n; i++) {
+    const char *arg;
+    lua_rawgeti(L,args,i);
+    arg = lua_tostring(L,-1);
+    lua_pop(L,1); // still referenced by args
+    if (i > 1)
+      luaL_addchar(&B,' ');
+    add_quoted_arg(&B,arg);
+  }
+  luaL_pushresult(&B);
+  lua_replace(L,args);
+}
+
+// push a copy of a variable name in lower case, since Windows ignores the case
+static void push_lower_name(lua_State *L, const char *s, size_t len) {
+  luaL_Buffer B;
+  size_t i;
+  luaL_buffinit(L,&B);
+  for (i = 0; i < len; i++)
+    luaL_addchar(&B,(char)tolower((unsigned char)s[i]));
+  luaL_pushresult(&B);
+}
+
+// the length of an entry's name, which ends at the first '=' after its start
+static size_t env_name_len(const char *s) {
+  const char *eq = strchr(s + 1,'=');
+  return eq ? (size_t)(eq - s) : strlen(s);
+}
+
+// CreateProcess wants the block sorted by name, ignoring case as Windows
+// does (by upper case), with the '=C:' entries for current directories first
+static int compare_env(const void *a, const void *b) {
+  const char *s = *(const char**)a, *t = *(const char**)b;
+  size_t ls = env_name_len(s), lt = env_name_len(t), i;
+  if ((*s == '=') != (*t == '='))
+    return *s == '=' ? -1 : 1;
+  for (i = 0; i < ls && i < lt; i++) {
+    int c = toupper((unsigned char)s[i]) - toupper((unsigned char)t[i]);
+    if (c != 0)
+      return c;
+  }
+  return ls < lt ? -1 : (ls > lt);
+}
+
+// an environment block for the child: ours, with each name in the table set
+// to its value, or taken out if the value is false. It must be freed.
+static LPWSTR make_environment(lua_State *L, int env) {
+  LPWSTR ours, p;
+  luaL_Buffer B;
+  LPWSTR block, res;
+  const char *text, **sorted;
+  size_t len;
+  int wlen, top = lua_gettop(L), names, entries, i, n = 0;
+  // the names which are set here, in lower case
+  lua_newtable(L);
+  names = lua_gettop(L);
+  lua_newtable(L);
+  entries = lua_gettop(L);
+  lua_pushnil(L);
+  while (lua_next(L,env)) {
+    const char *name;
+    if (lua_type(L,-2) != LUA_TSTRING)
+      luaL_error(L,"spawn_process: env keys must be strings");
+    name = lua_tolstring(L,-2,&len);
+    push_lower_name(L,name,len);
+    lua_pushboolean(L,1);
+    lua_rawset(L,names);
+    if (lua_toboolean(L,-1)) {
+      if (! lua_isstring(L,-1))
+        luaL_error(L,"spawn_process: env.%s must be a string or false",name);
+      lua_pushfstring(L,"%s=%s",name,lua_tostring(L,-1));
+      lua_rawseti(L,entries,++n);
+    }
+    lua_pop(L,1);
+  }
+  // then whatever we have which is not being set; names like '=C:' start with '='
+  ours = (LPWSTR)GetEnvironmentStringsW();
+  for (p = ours; p != NULL && *p; p += wcslen(p) + 1) {
+    const char *eq;
+    push_wstring(L,p);
+    text = lua_tolstring(L,-1,&len);
+    eq = (text != NULL && len > 0) ? strchr(text + 1,'=') : NULL;
+    if (eq == NULL) {
+      lua_pop(L,1);
+      continue;
+    }
+    push_lower_name(L,text,eq - text);
+    lua_rawget(L,names);
+    if (lua_toboolean(L,-1)) {
+      lua_pop(L,2);
+    } else {
+      lua_pop(L,1);
+      lua_rawseti(L,entries,++n);
+    }
+  }
+  if (ours != NULL)
+    FreeEnvironmentStringsW(ours);
+  // the strings stay referenced by entries while they are sorted
+  sorted = (const char**)malloc((n + 1)*sizeof(const char*));
+  if (sorted == NULL) {
+    lua_settop(L,top);
+    return NULL;
+  }
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L,entries,i);
+    sorted[i-1] = lua_tostring(L,-1);
+    lua_pop(L,1);
+  }
+  qsort(sorted,n,sizeof(const char*),compare_env);
+  // each entry ends with a NUL, and the block with another one
+  luaL_buffinit(L,&B);
+  for (i = 0; i < n; i++) {
+    luaL_addstring(&B,sorted[i]);
+    luaL_addchar(&B,'\0');
+  }
+  luaL_addchar(&B,'\0');
+  luaL_pushresult(&B);
+  free(sorted);
+  text = lua_tolstring(L,-1,&len);
+  block = wstring_l(text,(int)len,&wlen);
+  res = block ? (LPWSTR)malloc((wlen + 1)*sizeof(WCHAR)) : NULL;
+  if (res != NULL)
+    memcpy(res,block,(wlen + 1)*sizeof(WCHAR));
+  lua_settop(L,top);
+  return res;
+}
+
+enum { SPAWN_IN, SPAWN_OUT, SPAWN_ERR };
+enum { STREAM_PIPE, STREAM_INHERIT, STREAM_NULL, STREAM_STDOUT, STREAM_FILE };
+
+// how one of the child's standard streams is to be set up. stdin is 'pipe',
+// 'inherit', 'null' or a File to read from; stdout and stderr the same, with
+// a File to write to, and stderr may also be 'stdout'.
+static int stream_kind(lua_State *L, int opts, int which, HANDLE *file) {
+  static const char *names[] = {"stdin","stdout","stderr"};
+  static const char *kinds[] = {"pipe","inherit","null","stdout",NULL};
+  int kind = STREAM_PIPE;
+  lua_getfield(L,opts,names[which]);
+  if (lua_isuserdata(L,-1)) {
+    File *f = File_arg(L,lua_gettop(L));
+    *file = which == SPAWN_IN ? lcb_handle(f) : f->hWrite;
+    kind = STREAM_FILE;
+  } else if (! lua_isnil(L,-1)) {
+    const char *how = luaL_checkstring(L,-1);
+    for (kind = 0; kinds[kind] != NULL; kind++)
+      if (strcmp(how,kinds[kind]) == 0)
+        break;
+    if (kinds[kind] == NULL || (kind == STREAM_STDOUT && which != SPAWN_ERR))
+      luaL_error(L,"spawn_process: %s cannot be '%s'",names[which],how);
+  }
+  lua_pop(L,1);
+  return kind;
+}
+
+// an inheritable copy of a handle of ours, or NULL if there is none
+static HANDLE inheritable(HANDLE h) {
+  HANDLE res = NULL;
+  if (h == NULL || h == INVALID_HANDLE_VALUE)
+    return NULL;
+  if (! DuplicateHandle(GetCurrentProcess(),h,GetCurrentProcess(),&res,0,TRUE,DUPLICATE_SAME_ACCESS))
+    return NULL;
+  return res;
+}
+
+// set up one of the child's standard streams: `child` is the end it
+// inherits, and `ours` our end of a pipe.
+static BOOL spawn_stream(int which, int kind, HANDLE file, HANDLE child_out, HANDLE *child, HANDLE *ours) {
+  static const DWORD std_handles[] = {STD_INPUT_HANDLE,STD_OUTPUT_HANDLE,STD_ERROR_HANDLE};
+  SECURITY_ATTRIBUTES sa = {sizeof(SECURITY_ATTRIBUTES), NULL, TRUE};
+  HANDLE r, w;
+  *child = *ours = NULL;
+  switch (kind) {
+  case STREAM_PIPE:
+    if (! CreatePipe(&r,&w,&sa,0))
+      return FALSE;
+    *child = which == SPAWN_IN ? r : w;
+    *ours = which == SPAWN_IN ? w : r;
+    SetHandleInformation(*ours,HANDLE_FLAG_INHERIT,0);
+    return TRUE;
+  case STREAM_INHERIT:
+    // a GUI program may well have nothing to pass on
+    *child = inheritable(GetStdHandle(std_handles[which]));
+    return TRUE;
+  case STREAM_NULL:
+    *child = CreateFileW(L"NUL",GENERIC_READ | GENERIC_WRITE,FILE_SHARE_READ | FILE_SHARE_WRITE,
+      &sa,OPEN_EXISTING,0,NULL);
+    if (*child == INVALID_HANDLE_VALUE) {
+      *child = NULL;
+      return FALSE;
+    }
+    return TRUE;
+  case STREAM_STDOUT:
+    *child = inheritable(child_out);
+    return TRUE;
+  default:
+    *child = inheritable(file);
+    if (*child == NULL && file == NULL)
+      SetLastError(ERROR_INVALID_HANDLE);
+    return *child != NULL;
+  }
+}
+
+static void close_handles(HANDLE *hs, int n) {
+  int i;
+  for (i = 0; i < n; i++)
+    if (hs[i] != NULL)
+      CloseHandle(hs[i]);
+}
+
+// spawn_process with a table of options
+static int spawn_with_options(lua_State *L, int opts, const char *dir) {
+  WCHAR wcwd[MAX_WPATH];
+  STARTUPINFOW si = {sizeof(STARTUPINFOW)};
+  PROCESS_INFORMATION pi;
+  HANDLE child[3], ours[3] = {NULL,NULL,NULL}, file[3] = {NULL,NULL,NULL};
+  int kind[3];
+  LPWSTR env = NULL, cmdline;
+  const char *cwd;
+  DWORD flags = CREATE_NEW_PROCESS_GROUP, err = 0;
+  int i;
+  BOOL running;
+
+  lua_getfield(L,opts,"argv");
+  if (lua_istable(L,-1)) {
+    push_command_line(L,lua_gettop(L));
+    lua_replace(L,-2);
+  } else {
+    lua_pop(L,1);
+    lua_getfield(L,opts,"command");
+    if (! lua_isstring(L,-1))
+      luaL_error(L,"spawn_process: needs argv (an array) or command (a string)");
+  }
+  lua_getfield(L,opts,"cwd");
+  cwd = lua_tostring(L,-1);
+  if (cwd == NULL)
+    cwd = dir;
+  if (cwd != NULL)
+    wstring_buff(cwd,wcwd,MAX_WPATH);
+  lua_pop(L,1);
+
+  // anything wrong with the options is found before there is anything to close
+  for (i = SPAWN_IN; i <= SPAWN_ERR; i++)
+    kind[i] = stream_kind(L,opts,i,&file[i]);
+  lua_getfield(L,opts,"env");
+  if (lua_istable(L,-1)) {
+    env = make_environment(L,lua_gettop(L));
+    if (env == NULL)
+      return push_error_code(L,ERROR_NOT_ENOUGH_MEMORY);
+    flags |= CREATE_UNICODE_ENVIRONMENT;
+  }
+  lua_pop(L,1);
+  for (i = SPAWN_IN; i <= SPAWN_ERR; i++) {
+    if (! spawn_stream(i,kind[i],file[i],child[SPAWN_OUT],&child[i],&ours[i])) {
+      err = GetLastError();
+      free(env);
+      close_handles(child,i);
+      close_handles(ours,i);
+      return push_error_code(L,err);
+    }
+  }
+
+  si.dwFlags = STARTF_USESHOWWINDOW | STARTF_USESTDHANDLES;
+  si.wShowWindow = SW_HIDE;
+  si.hStdInput = child[SPAWN_IN];
+  si.hStdOutput = child[SPAWN_OUT];
+  si.hStdError = child[SPAWN_ERR];
+  // converted last, since the environment also goes through the scratch buffer
+  cmdline = (LPWSTR)wstring(lua_tostring(L,-1));
+  running = CreateProcessW(NULL, cmdline, NULL, NULL, TRUE, flags, env,
+    cwd ? wcwd : NULL, &si, &pi);
+  if (! running)
+    err = GetLastError();
+  free(env);
+  close_handles(child,3);
+  if (! running) {
+    close_handles(ours,3);
+    return push_error_code(L,err);
+  }
+  CloseHandle(pi.hThread);
+  push_new_Process(L,pi.dwProcessId,pi.hProcess);
+  if (ours[SPAWN_OUT] != NULL || ours[SPAWN_IN] != NULL)
+    push_new_File(L,ours[SPAWN_OUT],ours[SPAWN_IN]);
+  else
+    lua_pushnil(L);
+  if (ours[SPAWN_ERR] != NULL)
+    push_new_File(L,ours[SPAWN_ERR],NULL);
+  else
+    lua_pushnil(L);
+  return 3;
+}
+
+/// Spawn a process.
+// With a command-line, stdout and stderr both go to the returned @{File},
+// which also writes to stdin. With a table of options, the streams are
+// kept apart:
+//
+//  - `argv` an array of the program and its arguments, which are quoted as needed,
+//  - or `command`, a command-line as before
+//  - `cwd` the working directory, otherwise `dir`
+//  - `env` a table of variables to set (or with `false`, to remove) in a copy of ours
+//  - `stdin`, `stdout`, `stderr` each either 'pipe' (the default), 'inherit',
+//  'null', or a @{File} to use; stderr may also be 'stdout'
+//
+// @param program the command-line (program + parameters), or a table of options
+// @param dir the working directory for the process (optional)
+// @return @{Process}
+// @return @{File} reading stdout and writing stdin, if either is a pipe
+// @return @{File} reading stderr, if it is a pipe (options only)
+// @function spawn_process
+def spawn_process(Value program, StrNil dir) {
+  WCHAR wdir [MAX_WPATH];
+  SECURITY_ATTRIBUTES sa = {sizeof(SECURITY_ATTRIBUTES), 0, 0};
+  SECURITY_DESCRIPTOR sd;
+  STARTUPINFOW si = {
+           sizeof(STARTUPINFOW), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+       };
+  HANDLE hPipeRead,hWriteSubProcess;
+  HANDLE hRead2,hPipeWrite;
+  BOOL running;
+  PROCESS_INFORMATION pi;
+  if (lua_istable(L,program))
+    return spawn_with_options(L,program,dir);
+  sa.bInheritHandle = TRUE;
+  sa.lpSecurityDescriptor = NULL;
+  InitializeSecurityDescriptor(&sd, SECURITY_DESCRIPTOR_REVISION);
+  SetSecurityDescriptorDacl(&sd, TRUE, NULL, FALSE);
+  sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+  sa.lpSecurityDescriptor = &sd;
+
+  // Create pipe for output redirection
+  CreatePipe(&hPipeRead, &hPipeWrite, &sa, 0);
+
+  // Create pipe for input redirection. In this code, you do not
+  // redirect the output of the child process, but you need a handle
+  // to set the hStdInput field in the STARTUP_INFO struct. For safety,
+  // you should not set the handles to an invalid handle.
+
+  hRead2 = NULL;
+  CreatePipe(&hRead2, &hWriteSubProcess, &sa, 0);
+
+  SetHandleInformation(hPipeRead, HANDLE_FLAG_INHERIT, 0);
+  SetHandleInformation(hWriteSubProcess, HANDLE_FLAG_INHERIT, 0);
+
+  si.dwFlags = STARTF_USESHOWWINDOW | STARTF_USESTDHANDLES;
+  si.wShowWindow = SW_HIDE;
+  si.hStdInput = hRead2;
+  si.hStdOutput = hPipeWrite;
+  si.hStdError = hPipeWrite;
+
+  running = CreateProcessW(
         NULL,
-        (LPWSTR)wstring(program),
+        (LPWSTR)wstring(luaL_checkstring(L,program)),
         NULL, NULL,
         TRUE, CREATE_NEW_PROCESS_GROUP,
         NULL,
@@ -1458,16 +3415,20 @@ def thread(Value fun, Value data) {
 // Timer support //////////
 typedef struct {
   callback_data_
-  int msec;
+  ReactorOp op;
 } TimerData;
 
-static void timer_thread(TimerData *data) { // background timer thread
-  while (1) {
-    Sleep(data->msec);
-    // no parameters passed, but if we return true then we exit!
-    if (lcb_call(data,0,0,0))
-      break;
+// the wheel's clock is 32-bit msec, so nothing can be due further off than half of it
+#define TIMER_MAX_MSEC 2147483647.0
+
+static int timer_ready(ReactorOp *op, int status) { // runs on the reactor thread
+  TimerData *data = (TimerData*)op->data;
+  // no parameters passed, unless periodic, but if we return true then we stop!
+  if (status == REACTOR_CANCELLED || lcb_call(data,op->overruns,0,op->period ? INTEGER : 0)) {
+    lcb_done(data,TRUE);
+    return 0;
   }
+  return 1;
 }
 
 /// Asynchronous Timers.
@@ -1475,68 +3436,429 @@ static void timer_thread(TimerData *data) { // background timer thread
 
 /// Create an asynchronous timer.
 // The callback can return true if it wishes to cancel the timer.
+// All timers share one background thread and a timing wheel, so thousands
+// of them are cheap; @{bench-timers.lua} measures how late they fire.
+// Their callbacks are run from that thread one at a time, so a callback
+// which blocks makes every other timer late, along with directory watchers,
+// `wait_async` and overlapped `read_async`; one which waits for another of
+// these callbacks to happen will wait forever.
 // @{test-sleep.lua} shows how you need to call @{sleep} at the end of
 // a console application for these timers to work in the background.
-// @param msec interval in millisec
+//
+// Normally the interval is counted from when the callback returns, so a
+// slow callback makes the timer drift. With a policy, the timer is periodic
+// instead: it is due at fixed deadlines, measured from when it was made,
+// and `msec` may be a fraction. If callbacks fall behind, 'skip' drops the
+// deadlines missed, and 'catchup' calls back for each of them as soon as it
+// can; either way, the callback is passed the number of deadlines which had
+// already passed as well. @{test-periodic.lua} compares the two kinds.
+//
+// If the timer does not have to be exact, give it some slack: then it may
+// fire up to that much later, at the same time as other timers, so that the
+// machine wakes up less often. @{timer_stats} shows how many wakeups this saves.
+// @param msec interval in millisec, more than zero and less than about 24 days
 // @param callback a function to be called at each interval.
+// @param policy either 'skip' or 'catchup' (optional)
+// @param slack in millisec (default 0)
 // @return @{Thread}
 // @function make_timer
-def make_timer(Int msec, Value callback) {
-  TimerData *data = (TimerData *)malloc(sizeof(TimerData));
-  data->msec = msec;
+def make_timer(Number msec, Value callback, StrNil policy, Int slack = 0) {
+  TimerData *data;
+  int skip = policy == NULL || strcmp(policy,"skip") == 0;
+  if (! skip && strcmp(policy,"catchup") != 0) {
+    return push_error_msg(L,"policy must be 'skip' or 'catchup'");
+  }
+  // a zero interval would fire continuously, and the wheel counts msec in 32 bits
+  if (! (msec > 0 && msec < TIMER_MAX_MSEC)) {
+    return push_error_msg(L,"interval is out of range");
+  }
+  data = (TimerData *)malloc(sizeof(TimerData));
   lcb_callback(data,L,callback);
-  return lcb_new_thread((TCB)&timer_thread,data);
+  reactor_init_op(&data->op,NULL,msec < 1 ? 1 : (int)msec,timer_ready,data);
+  if (policy != NULL) {
+    reactor_set_period(&data->op,(ReactorTime)(msec*1000 + 0.5),skip ? REACTOR_SKIP : REACTOR_CATCH_UP);
+  }
+  data->op.slack = slack > 0 ? slack : 0;
+  return lcb_reactor_push(data,&data->op);
+}
+
+/// statistics for timers.
+// Timers which come due together are run in one wakeup, and (unless
+// @{use_gui} or @{use_dispatch} is used) with one acquisition of the Lua lock.
+// @return a table with fields `wakeups`, the times the background thread has
+// woken up; `timeouts`, the number of callbacks for timers and other timeouts;
+// and `saved`, the number
+// of those which shared a wakeup with another
+// @function timer_stats
+def timer_stats() {
+  ReactorStats stats;
+  reactor_stats(&stats);
+  lua_newtable(L);
+  lua_pushinteger(L,stats.wakeups);
+  lua_setfield(L,-2,"wakeups");
+  lua_pushinteger(L,stats.timeouts);
+  lua_setfield(L,-2,"timeouts");
+  lua_pushinteger(L,stats.saved);
+  lua_setfield(L,-2,"saved");
+  return 1;
+}
+
+/// Timing.
+// @section Timing
+
+// Lua 5.1 and 5.2 numbers are doubles, which hold whole nanoseconds exactly
+// for over a hundred days
+static void push_ns(lua_State *L, TimeNs ns) {
+#if LUA_VERSION_NUM >= 503
+  lua_pushinteger(L,(lua_Integer)ns);
+#else
+  lua_pushnumber(L,(lua_Number)ns);
+#endif
+}
+
+/// a high-resolution clock.
+// It only goes forward, and is not affected by changes to the system time.
+// @return time in nanoseconds, from some arbitrary starting point
+// @function clock
+def clock() {
+  push_ns(L,timing_clock());
+  return 1;
+}
+
+// forward reference to Stopwatch constructor
+static int push_new_Stopwatch(lua_State *L,Boolean start);
+
+/// make a stopwatch, for timing code.
+// @param start true if it should start timing now
+// @return @{Stopwatch}
+// @see bench-stopwatch.lua
+// @function stopwatch
+def stopwatch(Boolean start) {
+  return push_new_Stopwatch(L,start);
+}
+
+/// a class for timing code many times over.
+// Each timing is added to statistics kept in C, so nothing is allocated
+// per timing: count, minimum, maximum, mean and percentiles. Times are in
+// nanoseconds.
+// @type Stopwatch
+class Stopwatch {
+  TimeNs started;  // 0 if not running
+  TimingStats stats;
+
+  constructor (Boolean start) {
+    this->started = start ? timing_clock() : 0;
+    timing_reset(&this->stats);
+  }
+
+  static int elapsed(lua_State *L, Stopwatch *this, BOOL restart) {
+    TimeNs now = timing_clock(), ns;
+    if (this->started == 0) {
+      return push_error_msg(L,"stopwatch is not running");
+    }
+    ns = now - this->started;
+    timing_add(&this->stats,ns);
+    this->started = restart ? now : 0;
+    push_ns(L,ns);
+    return 1;
+  }
+
+  /// start timing.
+  // @function start
+  def start() {
+    this->started = timing_clock();
+    return 0;
+  }
+
+  /// add the time since starting, or the last lap, and carry on timing.
+  // @return the time
+  // @function lap
+  def lap() {
+    return elapsed(L,this,TRUE);
+  }
+
+  /// add the time since starting, or the last lap, and stop.
+  // @return the time
+  // @function stop
+  def stop() {
+    return elapsed(L,this,FALSE);
+  }
+
+  /// a percentile of the times so far.
+  // @param p from 0 to 100; 50 is the median
+  // @return the time, good to within about 2%
+  // @function percentile
+  def percentile(Number p) {
+    push_ns(L,timing_percentile(&this->stats,p));
+    return 1;
+  }
+
+  /// statistics for the times so far.
+  // @return a table with fields `count`, `min`, `max`, `mean`, `p50`, `p90` and `p99`
+  // @function stats
+  def stats() {
+    TimingStats *st = &this->stats;
+    lua_newtable(L);
+    lua_pushnumber(L,(lua_Number)st->count);
+    lua_setfield(L,-2,"count");
+    push_ns(L,st->min);
+    lua_setfield(L,-2,"min");
+    push_ns(L,st->max);
+    lua_setfield(L,-2,"max");
+    lua_pushnumber(L,st->count > 0 ? st->sum/st->count : 0);
+    lua_setfield(L,-2,"mean");
+    push_ns(L,timing_percentile(st,50));
+    lua_setfield(L,-2,"p50");
+    push_ns(L,timing_percentile(st,90));
+    lua_setfield(L,-2,"p90");
+    push_ns(L,timing_percentile(st,99));
+    lua_setfield(L,-2,"p99");
+    return 1;
+  }
+
+  /// forget all the times so far, and stop.
+  // @function reset
+  def reset() {
+    this->started = 0;
+    timing_reset(&this->stats);
+    return 0;
+  }
+
+  def __tostring() {
+    TimingStats *st = &this->stats;
+    lua_pushfstring(L,"Stopwatch: %d times, mean %f p50 %f p99 %f max %f ns",(int)st->count,
+      (lua_Number)(st->count > 0 ? st->sum/st->count : 0),(lua_Number)timing_percentile(st,50),
+      (lua_Number)timing_percentile(st,99),(lua_Number)st->max);
+    return 1;
+  }
 }
 
 #define PSIZE 512
 
 typedef struct {
   callback_data_
-  const char *pipename;
+  char *pipename;
+  BOOL overlapped;
+  int instances;    // how many wait for clients at once
+  DWORD bufsize;
+  HANDLE stop;      // a pool is stopped by setting this (see pipe_pool_stop)
+  DWORD thread_id;
+  volatile LONG refs;  // a pool is held by its thread and by its Thread object
 } PipeServerParms;
 
+static HANDLE create_pipe(PipeServerParms *parms, BOOL overlapped) {
+  return CreateNamedPipe(
+    parms->pipename,          // pipe named
+    PIPE_ACCESS_DUPLEX |      // read/write access
+      (overlapped ? FILE_FLAG_OVERLAPPED : 0),
+    PIPE_WAIT,                // blocking mode
+    PIPE_UNLIMITED_INSTANCES,
+    parms->bufsize,           // output buffer size
+    parms->bufsize,           // input buffer size
+    0,                        // client time-out
+    NULL);                    // default security attribute
+}
+
+// could not create named pipe - callback is passed nil, err msg.
+// A single server's parms belong to the Thread object, which frees them if killed.
+static void pipe_server_done(PipeServerParms *parms) {
+  lcb_call_push(parms,push_nil_arg,NULL,last_error(0),DISCARD);
+}
+
+static void push_pipe_file(lua_State *L, void *hPipe) {
+  push_new_File(L,(HANDLE)hPipe,(HANDLE)hPipe);
+}
+
+static void push_overlapped_pipe_file(lua_State *L, void *hPipe) {
+  push_overlapped_File(L,(HANDLE)hPipe);
+}
+
+// ConnectNamedPipe, which must be given an OVERLAPPED if the pipe is
+static BOOL connect_pipe(HANDLE hPipe, BOOL overlapped) {
+  OVERLAPPED ov;
+  DWORD bytes;
+  BOOL ok;
+  if (! overlapped) {
+    return ConnectNamedPipe(hPipe, NULL) ?
+      TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
+  }
+  memset(&ov,0,sizeof(ov));
+  ov.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+  ok = ConnectNamedPipe(hPipe,&ov);
+  if (! ok) {
+    DWORD err = GetLastError();
+    if (err == ERROR_IO_PENDING)
+      ok = GetOverlappedResult(hPipe,&ov,&bytes,TRUE);
+    else
+      ok = err == ERROR_PIPE_CONNECTED;
+  }
+  CloseHandle(ov.hEvent);
+  return ok;
+}
+
 static void pipe_server_thread(PipeServerParms *parms) {
   while (1) {
     BOOL connected;
-    HANDLE hPipe = CreateNamedPipe(
-      parms->pipename,             // pipe named
-      PIPE_ACCESS_DUPLEX,       // read/write access
-      PIPE_WAIT,                // blocking mode
-      255,
-      PSIZE,                  // output buffer size
-      PSIZE,                  // input buffer size
-      0,                        // client time-out
-      NULL);                    // default security attribute
+    HANDLE hPipe = create_pipe(parms,parms->overlapped);
 
     if (hPipe == INVALID_HANDLE_VALUE) {
-      // could not create named pipe - callback is passed nil, err msg.
-      lua_pushnil(parms->L);
-      lcb_call(parms,-1,last_error(0),REF_IDX | DISCARD);
+      pipe_server_done(parms);
       return;
     }
     // Wait for the client to connect; if it succeeds,
     // the function returns a nonzero value. If the function
     // returns zero, GetLastError returns ERROR_PIPE_CONNECTED.
 
-    connected = ConnectNamedPipe(hPipe, NULL) ?
-         TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
+    connected = connect_pipe(hPipe,parms->overlapped);
+
+    if (connected) {
+      // pass it a new File; this is made by the thread that runs the callback
+      lcb_call_push(parms,parms->overlapped ? push_overlapped_pipe_file : push_pipe_file,hPipe,0,0);
+    } else {
+      CloseHandle(hPipe);
+    }
+  }
+}
+
+typedef struct {
+  HANDLE pipe;   // INVALID_HANDLE_VALUE if it could not be replaced
+  OVERLAPPED ov;
+} PipeInstance;
+
+// a new instance, which starts waiting for a client straight away
+static BOOL listen_pipe(PipeServerParms *parms, PipeInstance *pi) {
+  HANDLE ev = pi->ov.hEvent;
+  memset(&pi->ov,0,sizeof(pi->ov));
+  pi->ov.hEvent = ev;
+  ResetEvent(ev);
+  pi->pipe = create_pipe(parms,TRUE);
+  if (pi->pipe == INVALID_HANDLE_VALUE)
+    return FALSE;
+  if (! ConnectNamedPipe(pi->pipe,&pi->ov)) {
+    DWORD err = GetLastError();
+    if (err == ERROR_PIPE_CONNECTED) {
+      SetEvent(ev);  // a client got in before we asked
+    } else if (err != ERROR_IO_PENDING) {
+      CloseHandle(pi->pipe);
+      pi->pipe = INVALID_HANDLE_VALUE;
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+#define PIPE_RETRY_MSEC 100
+
+// the pool needs one of the handles it waits for, to be told to stop
+#define PIPE_POOL_MAX (MAXIMUM_WAIT_OBJECTS - 1)
 
+static void pipe_pool_release(PipeServerParms *parms) {
+  if (InterlockedDecrement(&parms->refs) == 0) {
+    CloseHandle(parms->stop);
+    free(parms->pipename);
+    free(parms);
+  }
+}
+
+// A pool is not terminated, since then nothing would close its instances.
+// Instead it is told to stop, and Thread:kill waits until it has let go of
+// them, unless it is being killed from its own callback.
+static BOOL pipe_pool_stop(void *data, HANDLE thread, BOOL kill) {
+  PipeServerParms *parms = (PipeServerParms*)data;
+  if (kill) {
+    SetEvent(parms->stop);
+    if (parms->thread_id != GetCurrentThreadId()) {
+      // the pool needs the Lua mutex to let go of its callback
+      release_mutex();
+      WaitForSingleObject(thread,INFINITE);
+      lock_mutex();
+    }
+  }
+  pipe_pool_release(parms);
+  return TRUE;
+}
+
+// the first n instances, some of which may be waiting for a client.
+// The OVERLAPPED must outlive a connect, so any which is pending is cancelled first.
+static void close_pipe_pool(PipeInstance *pool, int n) {
+  DWORD bytes, err = GetLastError();
+  int i;
+  for (i = 0; i < n; i++) {
+    if (pool[i].pipe != INVALID_HANDLE_VALUE) {
+      CancelIo(pool[i].pipe);
+      GetOverlappedResult(pool[i].pipe,&pool[i].ov,&bytes,TRUE);
+      CloseHandle(pool[i].pipe);
+    }
+    CloseHandle(pool[i].ov.hEvent);
+  }
+  SetLastError(err);
+}
+
+// Several instances wait for clients at once, so clients do not queue up
+// behind each other. Each one that connects is replaced before the callback
+// is called. The handles are overlapped, so the Files are too.
+static void pipe_pool_loop(PipeServerParms *parms) {
+  PipeInstance pool[PIPE_POOL_MAX];
+  HANDLE events[PIPE_POOL_MAX + 1];
+  int i, n = parms->instances, empty = 0;
+  for (i = 0; i < n; i++) {
+    events[i] = pool[i].ov.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+    if (! listen_pipe(parms,&pool[i])) {
+      close_pipe_pool(pool,i + 1);
+      pipe_server_done(parms);
+      return;
+    }
+  }
+  events[n] = parms->stop;
+  while (1) {
+    DWORD bytes, res = WaitForMultipleObjects(n + 1,events,FALSE,empty ? PIPE_RETRY_MSEC : INFINITE);
+    HANDLE hPipe;
+    BOOL connected;
+    if (res == WAIT_TIMEOUT) {
+      // instances which could not be replaced, most likely because there were too many
+      for (i = 0, empty = 0; i < n; i++) {
+        if (pool[i].pipe == INVALID_HANDLE_VALUE && ! listen_pipe(parms,&pool[i]))
+          ++empty;
+      }
+      continue;
+    }
+    if (res == WAIT_OBJECT_0 + n) { // Thread:kill
+      close_pipe_pool(pool,n);
+      call_lua(parms->L,parms->callback,0,NULL,NO_CALL | DISCARD);
+      return;
+    }
+    if (res > WAIT_OBJECT_0 + n) {
+      close_pipe_pool(pool,n);
+      pipe_server_done(parms);
+      return;
+    }
+    i = res - WAIT_OBJECT_0;
+    hPipe = pool[i].pipe;
+    connected = GetOverlappedResult(hPipe,&pool[i].ov,&bytes,FALSE);
+    if (! listen_pipe(parms,&pool[i]))
+      ++empty;
     if (connected) {
-      push_new_File(parms->L,hPipe,hPipe);
-      lcb_call(parms,-1,0,REF_IDX); // pass it a new File reference
+      lcb_call_push(parms,push_overlapped_pipe_file,hPipe,0,0);
     } else {
       CloseHandle(hPipe);
     }
   }
 }
 
+static void pipe_pool_thread(PipeServerParms *parms) { // background thread
+  parms->thread_id = GetCurrentThreadId();
+  pipe_pool_loop(parms);
+  pipe_pool_release(parms);
+}
+
 /// Dealing with named pipes.
 // @section Pipes
 
 /// open a pipe for reading and writing.
 // @param pipename the pipename (default is "\\\\.\\pipe\\luawinapi")
+// @param overlapped if true, open the pipe for overlapped I/O, see @{File:write_async}
 // @function open_pipe
-def open_pipe(Str pipename = "\\\\.\\pipe\\luawinapi") {
+def open_pipe(Str pipename = "\\\\.\\pipe\\luawinapi", Boolean overlapped) {
   HANDLE hPipe = CreateFile(
       pipename,
       GENERIC_READ |  // read and write access
@@ -1544,10 +3866,12 @@ def open_pipe(Str pipename = "\\\\.\\pipe\\luawinapi") {
       0,              // no sharing
       NULL,           // default security attributes
       OPEN_EXISTING,  // opens existing pipe
-      0,              // default attributes
+      overlapped ? FILE_FLAG_OVERLAPPED : 0,
       NULL);          // no template file
   if (hPipe == INVALID_HANDLE_VALUE) {
     return push_error(L);
+  } else if (overlapped) {
+    return push_overlapped_File(L,hPipe);
   } else {
     return push_new_File(L,hPipe,hPipe);
   }
@@ -1560,12 +3884,49 @@ def open_pipe(Str pipename = "\\\\.\\pipe\\luawinapi") {
 // @param callback a function that will be passed a File object
 // @param pipename Must be of the form \\.\pipe\name, defaults to
 // \\.\pipe\luawinapi.
+// @param opts optional; if true, the clients' Files are opened for overlapped I/O,
+// see @{File:write_async}. Otherwise a table with fields:
+//
+// * `overlapped` as above
+// * `instances` how many clients can be connecting at once (default 1, at most 63).
+// With more than one, the Files are always overlapped.
+// * `buffer` the size of the pipe buffers in bytes, more than zero (default 512)
+//
 // @return @{Thread}.
 // @function make_pipe_server
-def make_pipe_server(Value callback, Str pipename = "\\\\.\\pipe\\luawinapi") {
-  PipeServerParms *psp = (PipeServerParms*)malloc(sizeof(PipeServerParms));
+def make_pipe_server(Value callback, Str pipename = "\\\\.\\pipe\\luawinapi", Value opts) {
+  PipeServerParms *psp;
+  BOOL overlapped = lua_toboolean(L,opts);
+  int instances = 1, bufsize = PSIZE;
+  // a bad option raises an error, so they are read before anything is made
+  if (lua_istable(L,opts)) {
+    overlapped = opt_bool_field(L,opts,"overlapped",FALSE);
+    instances = opt_int_field(L,opts,"instances",1);
+    bufsize = opt_int_field(L,opts,"buffer",PSIZE);
+  }
+  if (bufsize <= 0) {
+    return push_error_msg(L,"buffer size must be more than zero");
+  }
+  if (instances < 1) {
+    instances = 1;
+  } else if (instances > PIPE_POOL_MAX) {
+    instances = PIPE_POOL_MAX;
+  }
+  psp = (PipeServerParms*)malloc(sizeof(PipeServerParms));
   lcb_callback(psp,L,callback);
-  psp->pipename = pipename;
+  psp->pipename = (char*)malloc(strlen(pipename) + 1);
+  strcpy(psp->pipename,pipename);
+  psp->overlapped = overlapped;
+  psp->instances = instances;
+  psp->bufsize = bufsize;
+  if (instances > 1) {
+    psp->stop = CreateEvent(NULL,TRUE,FALSE,NULL);
+    psp->refs = 2;
+    psp->thread_id = 0;
+    lcb_new_thread((TCB)&pipe_pool_thread,psp);
+    Thread_arg(L,-1)->stop = pipe_pool_stop;
+    return 1;
+  }
   return lcb_new_thread((TCB)&pipe_server_thread,psp);
 }
 
@@ -1582,6 +3943,7 @@ def make_pipe_server(Value callback, Str pipename = "\\\\.\\pipe\\luawinapi") {
 // @function short_path
 def short_path(Str path) {
   WCHAR wpath[MAX_WPATH];
+  LPWSTR wbuff;
   HANDLE hFile;
   int res;
   wconv(path);
@@ -1598,9 +3960,10 @@ def short_path(Str path) {
   } else { // if we created it successfully, then close.
     CloseHandle(hFile);
   }
-  res = GetShortPathNameW(wpath,wbuff,sizeof(wbuff));
-  if (res > 0) {
-    return push_wstring(L,wbuff);
+  wbuff = wide_result(WBUFF);
+  res = GetShortPathNameW(wpath,wbuff,WBUFF);
+  if (res > 0 && res < WBUFF) {
+    return push_wstring_l(L,wbuff,res);
   } else {
     return push_error(L);
   }
@@ -1700,7 +4063,8 @@ def get_disk_free_space(Str root) {
 // @return UNC name
 // @function get_disk_network_name
 def get_disk_network_name(Str root) {
-  DWORD size = sizeof(wbuff);
+  LPWSTR wbuff = wide_result(WBUFF);
+  DWORD size = WBUFF;
   DWORD res = WNetGetConnectionW(wstring(root),wbuff,&size);
   if (res == NO_ERROR) {
     return push_wstring(L,wbuff);
@@ -1711,46 +4075,234 @@ def get_disk_network_name(Str root) {
 
 // Directory change notification ///////
 
+// A batch of file change events, collected on the reactor thread and
+// passed to Lua as one array. Each event is stored as the action followed
+// by the NUL-terminated file name. If coalescing, a hash table of event
+// offsets is used to spot repeated events.
+typedef struct {
+  int n;
+  int used;
+  int size;
+  char *data;
+  int *hash;   // offset+1 of each event, 0 for empty
+  int hsize;   // a power of two
+} FileBatch;
+
 typedef struct {
   callback_data_
   DWORD how;
   DWORD subdirs;
+  int batch_max;      // batching: most events in a batch, or 0 if not batching
+  DWORD batch_msec;   // and the longest to wait before passing it on
+  BOOL coalesce;      // drop repeated events within a batch
+  OVERLAPPED ov;
+  BOOL pending;       // is a read in progress?
+  FileBatch *b;
+  DWORD first;        // when the first event of the batch arrived
+  ReactorOp op;
 } FileChangeParms;
 
-static void file_change_thread(FileChangeParms *fc) { // background file monitor thread
-  while (1) {
-    int next, offset;
-    DWORD bytes;
-    // This fills in some gaps:
-    // http://qualapps.blogspot.com/2010/05/understanding-readdirectorychangesw_19.html
-    if (! ReadDirectoryChangesW(lcb_handle(fc),lcb_buf(fc),lcb_bufsz(fc),
-        fc->subdirs, fc->how, &bytes,NULL,NULL))  {
-        lcb_call(fc,-1,last_error(0),INTEGER | DISCARD);
-        break;
+#define BATCH_BUFF_SIZE 65536
+#define BATCH_MAX_EVENTS 65536
+
+static void batch_free(FileBatch *b) {
+  free(b->data);
+  free(b->hash);
+  free(b);
+}
+
+// max is at most BATCH_MAX_EVENTS, so the hash cannot fill up; NULL if out of memory
+static FileBatch *batch_new(int max, BOOL coalesce) {
+  FileBatch *b = (FileBatch*)malloc(sizeof(FileBatch));
+  if (b == NULL)
+    return NULL;
+  b->n = 0;
+  b->used = 0;
+  b->size = 1024;
+  b->data = (char*)malloc(b->size);
+  b->hash = NULL;
+  b->hsize = 0;
+  if (coalesce) {
+    b->hsize = 16;
+    while (b->hsize < 2*max)
+      b->hsize *= 2;
+    b->hash = (int*)calloc(b->hsize,sizeof(int));
+  }
+  if (b->data == NULL || (coalesce && b->hash == NULL)) {
+    batch_free(b);
+    return NULL;
+  }
+  return b;
+}
+
+static unsigned int batch_hash(DWORD action, const char *name, int len) {
+  unsigned int h = 2166136261u ^ action; // FNV-1a
+  int i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// add an event, unless we are coalescing and it is already in this batch.
+// FALSE if out of memory.
+static BOOL batch_add(FileBatch *b, DWORD action, const char *name, int len) {
+  int need = sizeof(DWORD) + len + 1, *slot = NULL;
+  if (b->hash) {
+    unsigned int i = batch_hash(action,name,len) & (b->hsize - 1);
+    while (b->hash[i] != 0) {
+      const char *rec = b->data + b->hash[i] - 1;
+      if (memcmp(rec,&action,sizeof(DWORD)) == 0
+          && strncmp(rec + sizeof(DWORD),name,len) == 0 && rec[sizeof(DWORD) + len] == '\0')
+        return TRUE;
+      i = (i + 1) & (b->hsize - 1);
     }
-    next = 0;
-    offset = 0;
-    do {
-      int outchars;
-      char outbuff[MAX_PATH];
-      PFILE_NOTIFY_INFORMATION pni = (PFILE_NOTIFY_INFORMATION)(lcb_buf(fc)+offset);
-      outchars = WideCharToMultiByte(
-        get_encoding(), 0,
-        pni->FileName,
-        pni->FileNameLength/2, // it's bytes, not number of characters!
-        outbuff,sizeof(outbuff),
-        NULL,NULL);
-      if (outchars == 0) {
-        lcb_call(fc,-1,"wide char conversion borked",INTEGER | DISCARD);
-        break;
+    slot = &b->hash[i];
+  }
+  if (b->used + need > b->size) {
+    int size = b->size;
+    char *data;
+    while (b->used + need > size)
+      size *= 2;
+    data = (char*)realloc(b->data,size);
+    if (data == NULL)
+      return FALSE;
+    b->data = data;
+    b->size = size;
+  }
+  if (slot)
+    *slot = b->used + 1;
+  memcpy(b->data + b->used,&action,sizeof(DWORD));
+  memcpy(b->data + b->used + sizeof(DWORD),name,len);
+  b->data[b->used + sizeof(DWORD) + len] = '\0';
+  b->used += need;
+  ++b->n;
+  return TRUE;
+}
+
+// push the batch as an array of {action,name} pairs; this runs on the Lua thread.
+static void push_file_batch(lua_State *L, void *data) {
+  FileBatch *b = (FileBatch*)data;
+  int i, offset = 0;
+  lua_createtable(L,b->n,0);
+  for (i = 1; i <= b->n; i++) {
+    DWORD action;
+    const char *name = b->data + offset + sizeof(DWORD);
+    memcpy(&action,b->data + offset,sizeof(DWORD));
+    lua_createtable(L,2,0);
+    lua_pushinteger(L,action);
+    lua_rawseti(L,-2,1);
+    lua_pushstring(L,name);
+    lua_rawseti(L,-2,2);
+    lua_rawseti(L,-2,i);
+    offset += sizeof(DWORD) + strlen(name) + 1;
+  }
+  batch_free(b);
+}
+
+static void file_change_done(FileChangeParms *fc, BOOL release) {
+  if (fc->pending) {
+    DWORD bytes;
+    // the read was started on this thread, so CancelIo will stop it
+    CancelIo(lcb_handle(fc));
+    GetOverlappedResult(lcb_handle(fc),&fc->ov,&bytes,TRUE);
+  }
+  CloseHandle(fc->ov.hEvent);
+  if (fc->b != NULL)
+    batch_free(fc->b);
+  lcb_done(fc,release);
+}
+
+// pass on the error, and stop watching
+static int file_change_error(FileChangeParms *fc, const char *msg) {
+  lcb_call(fc,-1,msg,INTEGER | DISCARD);
+  file_change_done(fc,FALSE);
+  return 0;
+}
+
+// pass on each event in the buffer, or add them to the current batch.
+// Returns an error message if that fails.
+static const char *file_change_events(FileChangeParms *fc, DWORD bytes) {
+  int offset = 0;
+  // bytes is zero if there were too many changes to fit in the buffer
+  while (bytes > 0) {
+    int outchars;
+    char outbuff[MAX_PATH];
+    PFILE_NOTIFY_INFORMATION pni = (PFILE_NOTIFY_INFORMATION)(lcb_buf(fc)+offset);
+    outchars = mbstring_buff(
+      pni->FileName,
+      pni->FileNameLength/2, // it's bytes, not number of characters!
+      outbuff,sizeof(outbuff)-1);
+    if (fc->batch_max > 0) {
+      if (fc->b == NULL) {
+        fc->b = batch_new(fc->batch_max,fc->coalesce);
+        if (fc->b == NULL)
+          return "out of memory";
+        fc->first = GetTickCount();
+      }
+      if (! batch_add(fc->b,pni->Action,outbuff,outchars))
+        return "out of memory";
+      if (fc->b->n >= fc->batch_max) {
+        lcb_call_push(fc,push_file_batch,fc->b,0,0);
+        fc->b = NULL;
       }
+    } else {
+      if (outchars == 0)
+        return "wide char conversion borked";
       outbuff[outchars] = '\0';  // not null-terminated!
       // pass the action that occurred and the file name
       lcb_call(fc,pni->Action,outbuff,INTEGER);
-      next = pni->NextEntryOffset;
-      offset += next;
-    } while (next != 0);
+    }
+    if (pni->NextEntryOffset == 0)
+      break;
+    offset += pni->NextEntryOffset;
+  }
+  return NULL;
+}
+
+// The directory is read with overlapped I/O, and the reactor thread waits for
+// the read to finish. This fills in some gaps:
+// http://qualapps.blogspot.com/2010/05/understanding-readdirectorychangesw_19.html
+static int file_change_ready(ReactorOp *op, int status) {
+  FileChangeParms *fc = (FileChangeParms*)op->data;
+  if (status == REACTOR_CANCELLED) {
+    file_change_done(fc,TRUE);
+    return 0;
+  }
+  if (status == REACTOR_ERROR) {
+    return file_change_error(fc,"cannot wait for changes");
+  }
+  if (status == REACTOR_READY) {
+    DWORD bytes;
+    const char *err;
+    fc->pending = FALSE;
+    if (! GetOverlappedResult(lcb_handle(fc),&fc->ov,&bytes,FALSE))
+      return file_change_error(fc,last_error(0));
+    err = file_change_events(fc,bytes);
+    if (err != NULL)
+      return file_change_error(fc,err);
+  }
+  // a batch is passed on when it has waited long enough for more events
+  op->timeout = REACTOR_FOREVER;
+  if (fc->b != NULL) {
+    DWORD elapsed = GetTickCount() - fc->first;
+    if (elapsed >= fc->batch_msec) {
+      lcb_call_push(fc,push_file_batch,fc->b,0,0);
+      fc->b = NULL;
+    } else {
+      op->timeout = fc->batch_msec - elapsed;
+    }
+  }
+  // the first read is also started here, so that it belongs to the reactor thread
+  if (! fc->pending) {
+    ResetEvent(fc->ov.hEvent);
+    if (! ReadDirectoryChangesW(lcb_handle(fc),lcb_buf(fc),lcb_bufsz(fc),
+        fc->subdirs, fc->how, NULL,&fc->ov,NULL))
+      return file_change_error(fc,last_error(0));
+    fc->pending = TRUE;
   }
+  return 1;
 }
 
 //// start watching a directory.
@@ -1763,7 +4315,9 @@ static void file_change_thread(FileChangeParms *fc) { // background file monitor
 //
 // @param subdirs whether subdirectories should be monitored
 // @param callback a function which will receive the kind of change
-// plus the filename that changed. The change will be one of these:
+// plus the filename that changed. It is called from the background thread
+// which runs timers, so it should return quickly (see @{make_timer}).
+// The change will be one of these:
 //
 // * `FILE_ACTION_ADDED`
 // * `FILE_ACTION_REMOVED`
@@ -1771,27 +4325,60 @@ static void file_change_thread(FileChangeParms *fc) { // background file monitor
 // * `FILE_ACTION_RENAMED_OLD_NAME`
 // * `FILE_ACTION_RENAMED_NEW_NAME`
 //
+// @param batch optional table of batching options. If given, the callback
+// receives an array of events, each of which is a `{action,name}` pair.
+// The fields are:
+//
+// * `max` most events in one batch (default 256, at most 65536)
+// * `latency` longest time in msec to wait for more events after the first one (default 50)
+// * `coalesce` if true, only keep the first of any repeated events in a batch
+//
 // @return a thread object.
 // @see test-watcher.lua
 // @function watch_for_file_changes
-def watch_for_file_changes (Str dir, Int how, Boolean subdirs, Value callback) {
-  FileChangeParms *fc = (FileChangeParms*)malloc(sizeof(FileChangeParms));
-  lcb_callback(fc,L,callback);
-  fc->how = how;
-  fc->subdirs = subdirs;
-  lcb_handle(fc) = CreateFileW(wstring(dir),
+def watch_for_file_changes (Str dir, Int how, Boolean subdirs, Value callback, Value batch) {
+  FileChangeParms *fc;
+  HANDLE hDir;
+  int batch_max = 0, batch_msec = 0;
+  BOOL coalesce = FALSE;
+  // a bad option raises an error, so they are read before anything is made
+  if (lua_istable(L,batch)) {
+    batch_max = opt_int_field(L,batch,"max",256);
+    batch_msec = opt_int_field(L,batch,"latency",50);
+    coalesce = opt_bool_field(L,batch,"coalesce",FALSE);
+    if (batch_max < 1)
+      batch_max = 1;
+    else if (batch_max > BATCH_MAX_EVENTS)
+      batch_max = BATCH_MAX_EVENTS;
+    if (batch_msec < 0)
+      batch_msec = 0;
+  }
+  hDir = CreateFileW(wstring(dir),
     FILE_LIST_DIRECTORY,
     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
     NULL,
     OPEN_ALWAYS,
-    FILE_FLAG_BACKUP_SEMANTICS,
+    FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
     NULL
     );
-  if (lcb_handle(fc) == INVALID_HANDLE_VALUE) {
+  if (hDir == INVALID_HANDLE_VALUE) {
     return push_error(L);
   }
-  lcb_allocate_buffer(fc,2048);
-  return lcb_new_thread((TCB)&file_change_thread,fc);
+  fc = (FileChangeParms*)malloc(sizeof(FileChangeParms));
+  lcb_callback(fc,L,callback);
+  lcb_handle(fc) = hDir;
+  fc->how = how;
+  fc->subdirs = subdirs;
+  fc->batch_max = batch_max;
+  fc->batch_msec = batch_msec;
+  fc->coalesce = coalesce;
+  fc->pending = FALSE;
+  fc->b = NULL;
+  memset(&fc->ov,0,sizeof(fc->ov));
+  fc->ov.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+  lcb_allocate_buffer(fc,batch_max > 0 ? BATCH_BUFF_SIZE : 2048);
+  // a zero timeout, so that the reactor thread starts reading straight away
+  return lcb_reactor_add(fc,&fc->op,fc->ov.hEvent,0,file_change_ready);
 }
 
 /// Class representing Windows registry keys.
@@ -1815,7 +4402,7 @@ class Regkey {
     const char *str;
     const BYTE *data;
     WCHAR wname[MAX_KEYS];
-    wstring_buff(name,wname,sizeof(wname));
+    wstring_buff(name,wname,MAX_KEYS);
     if (lua_isstring(L,val)) {
         if (type == REG_DWORD) {
             return push_error_msg(L, "parameter must be a number for REG_DWORD");
@@ -1848,17 +4435,27 @@ class Regkey {
   // @return the type
   // @function get_value
   def get_value(Str name = "") {
-    DWORD type,size = sizeof(wbuff);
-    void *data = wbuff;
-    if (RegQueryValueExW(this->key,wstring(name),0,&type,data,&size) != ERROR_SUCCESS) {
-      return push_error(L);
+    DWORD type,size = WBUFF*sizeof(WCHAR);
+    WStr wname = wstring(name);
+    LPWSTR wbuff = wide_result(WBUFF);
+    LONG res = RegQueryValueExW(this->key,wname,0,&type,(LPBYTE)wbuff,&size);
+    if (res == ERROR_MORE_DATA) {
+      wbuff = wide_result(size/sizeof(WCHAR) + 1);
+      res = RegQueryValueExW(this->key,wname,0,&type,(LPBYTE)wbuff,&size);
+    }
+    if (res != ERROR_SUCCESS) {
+      return push_error_code(L,res);
     }
     if (type == REG_BINARY) {
-      lua_pushlstring(L,(const char *)data,size);
+      lua_pushlstring(L,(const char *)wbuff,size);
     } else if (type == REG_EXPAND_SZ || type == REG_SZ) {
-      push_wstring(L,wbuff); //,size);
+      // the stored string may or may not include the NUL
+      int len = size/sizeof(WCHAR);
+      if (len > 0 && wbuff[len-1] == 0)
+        --len;
+      push_wstring_l(L,wbuff,len);
     } else {
-      lua_pushnumber(L,*(unsigned long *)data);
+      lua_pushnumber(L,*(unsigned long *)wbuff);
     }
     lua_pushinteger(L,type);
     return 2;
@@ -1881,12 +4478,13 @@ class Regkey {
     int i = 0;
     LONG res;
     DWORD size;
+    LPWSTR wbuff = wide_result(WBUFF);
     lua_newtable(L);
     while (1) {
-      size = sizeof(wbuff);
+      size = WBUFF;
       res = RegEnumKeyExW(this->key,i,wbuff,&size,NULL,NULL,NULL,NULL);
       if (res != ERROR_SUCCESS) break;
-      push_wstring(L,wbuff);
+      push_wstring_l(L,wbuff,size);
       lua_rawseti(L,-2,i+1);
       ++i;
     }
@@ -1973,13 +4571,8 @@ function winapi.execute(cmd,unicode)
     cmd = comspec ..' /c '..cmd
     local P,f = winapi.spawn_process(cmd)
     if not P then return nil,f end
-    local txt = f:read()
-    local out = {}
-    while txt do
-      table.insert(out,txt)
-      txt = f:read()
-    end
-    return P:wait():get_exit_code(),table.concat(out,'')
+    local out = f:read_all()
+    return P:wait():get_exit_code(),out
   else
     local tmpfile,res,f,out = winapi.temp_name()
     cmd = comspec..' /u /c '..cmd..' > "'..tmpfile..'"'
@@ -2041,6 +4634,10 @@ function winapi.dirs(mask,subdirs) return winapi.files(mask,subdirs,'D') end
 
 initial init_mutex {
   setup_mutex();
+  setup_scratch();
+  setup_call_pool();
+  setup_tasks(L);
+  reactor_set_batch(batch_lua_calls);
   return 0;
 }
 
@@ -9,6 +9,9 @@
 #define MAX_KEY MAX_PATH
 
 #include "wutils.h"
+#include "utf.h"
+#include "queue.h"
+#include "pool.h"
 
 #define eq(s1,s2) (strcmp(s1,s2)==0)
 
@@ -116,49 +119,264 @@ int push_bool(lua_State *L, int bval) {
   }
 }
 
-BOOL call_lua_direct(lua_State *L, Ref ref, int idx, const char *text, int flags) {
-  BOOL res,ipush = 1;
-  // push the function
-  push_ref(L,ref);
-
-  // first argument is optional, it may be a stack reference or an integer
-  if (flags & REF_IDX)
-    lua_pushvalue(L,idx);
-  else if (flags & INTEGER)
-    lua_pushinteger(L,idx);
-  else
-    ipush = 0;
+/// get an integer field from an optional table of options.
+// @param L the state
+// @param idx the stack index of the table; if it isn't a table, we get the default
+// @param key the field name
+// @param def the default value
+// @return the value
+// @function opt_int_field
+int opt_int_field(lua_State *L, int idx, const char *key, int def) {
+  int res = def;
+  if (lua_istable(L,idx)) {
+    lua_getfield(L,idx,key);
+    if (! lua_isnil(L,-1))
+      res = luaL_checkinteger(L,-1);
+    lua_pop(L,1);
+  }
+  return res;
+}
 
-  // there may be text - if so, we are responsible for cleaning it up!
-  if (text != NULL) {
-    lua_pushstring(L,text);
-    ++ipush;
-    free((char*)text);
+/// get a boolean field from an optional table of options.
+// @param L the state
+// @param idx the stack index of the table; if it isn't a table, we get the default
+// @param key the field name
+// @param def the default value
+// @return the value
+// @function opt_bool_field
+BOOL opt_bool_field(lua_State *L, int idx, const char *key, BOOL def) {
+  BOOL res = def;
+  if (lua_istable(L,idx)) {
+    lua_getfield(L,idx,key);
+    if (! lua_isnil(L,-1))
+      res = lua_toboolean(L,-1);
+    lua_pop(L,1);
   }
+  return res;
+}
 
-  lua_call(L, ipush, 1);
-  res = lua_toboolean(L,-1);
+// Tasks /////
+// A task is a coroutine started by winapi.go(). Inside a task, blocking
+// calls yield instead, and the task is resumed by a callback when they are done.
+// Tasks are kept in a registry table, which also holds the main thread;
+// resuming must happen from there, since the task's own state is suspended.
+
+#define TASKS "winapi.tasks"
+
+#if LUA_VERSION_NUM > 501
+#define lua_resume(L,n) lua_resume(L,NULL,n)
+#endif
+
+void setup_tasks(lua_State *L) {
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushliteral(L,"k");
+  lua_setfield(L,-2,"__mode");
+  lua_setmetatable(L,-2);
+  lua_pushthread(L);
+  lua_setfield(L,-2,"main");
+  lua_setfield(L,LUA_REGISTRYINDEX,TASKS);
+}
 
-  // optionally dispose of the function
-  if (flags & DISCARD) {
-    release_ref(L,ref);
+/// is this a task?
+// @param L the state
+// @return TRUE if the state belongs to a coroutine started by winapi.go()
+// @function in_task
+BOOL in_task(lua_State *L) {
+  BOOL res;
+  if (lua_pushthread(L)) { // the main thread is never a task
+    lua_pop(L,1);
+    return FALSE;
   }
+  lua_getfield(L,LUA_REGISTRYINDEX,TASKS);
+  lua_pushvalue(L,-2);
+  lua_rawget(L,-2);
+  res = lua_toboolean(L,-1);
+  lua_pop(L,3);
   return res;
 }
 
+/// the main thread, which resumes tasks.
+// @param L the state
+// @function main_state
+lua_State *main_state(lua_State *L) {
+  lua_State *main;
+  lua_getfield(L,LUA_REGISTRYINDEX,TASKS);
+  lua_getfield(L,-1,"main");
+  main = lua_tothread(L,-1);
+  lua_pop(L,2);
+  return main;
+}
+
+/// start a task. The function and its arguments are on top of the stack,
+// and are replaced by the new task.
+// @param L the state
+// @param nargs number of arguments
+// @return TRUE if the task ran without error, so far
+// @function start_task
+BOOL start_task(lua_State *L, int nargs) {
+  lua_State *co = lua_newthread(L);
+  lua_getfield(L,LUA_REGISTRYINDEX,TASKS);
+  lua_pushvalue(L,-2);
+  lua_pushboolean(L,1);
+  lua_rawset(L,-3);
+  lua_pop(L,1);
+  lua_insert(L,-(nargs+2));
+  lua_xmove(L,co,nargs+1);
+  return resume_task(co,nargs);
+}
+
+/// resume a task. Any error is reported on stderr, since there is
+// nobody to pass it to.
+// @param co the task
+// @param nargs number of values on its stack to pass
+// @return TRUE if there was no error
+// @function resume_task
+BOOL resume_task(lua_State *co, int nargs) {
+  int res = lua_resume(co,nargs);
+  if (res != 0 && res != LUA_YIELD) {
+    fprintf(stderr,"error in task: %s\n",lua_tostring(co,-1));
+    lua_pop(co,1);
+    return FALSE;
+  }
+  // discard anything returned or yielded; nobody is waiting for it
+  lua_settop(co,0);
+  return TRUE;
+}
+
 // Calling back to Lua /////
 // For console applications, we just use a mutex to ensure that Lua will not
 // be re-entered, but if use_gui() is called, we use a message window to
 // make sure that the callback happens on the main GUI thread.
+// If use_dispatch() is called, then callbacks are put on a lock-free queue
+// instead, and are run by the main thread in dispatch_events().
 
 typedef struct {
+  QNode node;
   lua_State *L;
   Ref ref;
   int idx;
   const char *text;
+  int len;      // length of text, or -1 if it ends with a NUL
   int flags;
+  LuaPusher push;
+  void *data;
 } LuaCallParms;
 
+static BOOL call_lua_parms(LuaCallParms *P) {
+  lua_State *L = P->L;
+  BOOL res,ipush = 1;
+  int idx = P->idx;
+  if (P->flags & NO_CALL) {
+    if (P->flags & DISCARD)
+      release_ref(L,P->ref);
+    return FALSE;
+  }
+  // a relative stack index must be made absolute before we push anything
+  if ((P->flags & REF_IDX) && idx < 0)
+    idx = lua_gettop(L) + idx + 1;
+
+  // push the function, or a task waiting for this callback
+  push_ref(L,P->ref);
+
+  // first argument is optional; it may be pushed by a function, or
+  // be a stack reference or an integer
+  if (P->push)
+    P->push(L,P->data);
+  else if (P->flags & REF_IDX)
+    lua_pushvalue(L,idx);
+  else if (P->flags & INTEGER)
+    lua_pushinteger(L,idx);
+  else
+    ipush = 0;
+
+  if (P->text != NULL) {
+    if (P->len >= 0)
+      lua_pushlstring(L,P->text,P->len);
+    else
+      lua_pushstring(L,P->text);
+    ++ipush;
+  }
+
+  if (lua_type(L,-(ipush+1)) == LUA_TTHREAD) {
+    // the arguments become the results of the call the task yielded in
+    lua_State *co = lua_tothread(L,-(ipush+1));
+    lua_xmove(L,co,ipush);
+    lua_pop(L,1);
+    resume_task(co,ipush);
+    res = FALSE;
+  } else {
+    lua_call(L, ipush, 1);
+    res = lua_toboolean(L,-1);
+    lua_pop(L,1);
+  }
+
+  // optionally dispose of the function
+  if (P->flags & DISCARD) {
+    release_ref(L,P->ref);
+  }
+  return res;
+}
+
+BOOL call_lua_direct(lua_State *L, Ref ref, int idx, const char *text, int flags) {
+  LuaCallParms parms;
+  BOOL res;
+  parms.L = L;
+  parms.ref = ref;
+  parms.idx = idx;
+  parms.text = text;
+  parms.len = -1;
+  parms.flags = flags;
+  parms.push = NULL;
+  parms.data = NULL;
+  res = call_lua_parms(&parms);
+  // there may be text - if so, we are responsible for cleaning it up!
+  if (text != NULL)
+    free((char*)text);
+  return res;
+}
+
+// Callbacks which are queued or posted need their parameters and text kept
+// until they are run. These come from a pool and a ring buffer, so that
+// producers don't hit malloc for every event.
+#define CALL_POOL_SIZE 1024
+#define CALL_ARENA_SIZE (256*1024)
+
+static Pool s_call_pool;
+static Arena s_text_arena;
+
+void setup_call_pool() {
+  if (s_call_pool.items == NULL) {
+    pool_init(&s_call_pool,sizeof(LuaCallParms),CALL_POOL_SIZE);
+    arena_init(&s_text_arena,CALL_ARENA_SIZE);
+  }
+}
+
+// only one thread at a time gets here: either the GUI thread, or the
+// thread calling dispatch_events()
+static void free_call_parms(LuaCallParms *P) {
+  if (P->text != NULL)
+    arena_free(&s_text_arena,(char*)P->text);
+  pool_free(&s_call_pool,P);
+}
+
+/// push counters for the callback allocators.
+// @param L the state
+// @return 1; a table with fields `pool_hits`, `pool_misses`, `text_hits` and `text_misses`
+// @function push_call_stats
+int push_call_stats(lua_State *L) {
+  lua_newtable(L);
+  lua_pushinteger(L,s_call_pool.hits);
+  lua_setfield(L,-2,"pool_hits");
+  lua_pushinteger(L,s_call_pool.misses);
+  lua_setfield(L,-2,"pool_misses");
+  lua_pushinteger(L,s_text_arena.hits);
+  lua_setfield(L,-2,"text_hits");
+  lua_pushinteger(L,s_text_arena.misses);
+  lua_setfield(L,-2,"text_misses");
+  return 1;
+}
+
 #define MY_INTERNAL_LUA_MESSAGE WM_USER+42
 
 static LRESULT CALLBACK WndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
@@ -167,8 +385,8 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
   if (uMsg == MY_INTERNAL_LUA_MESSAGE) {
     BOOL res;
     LuaCallParms *P  = (LuaCallParms*)lParam;
-    res = call_lua_direct(P->L,P->ref,P->idx,P->text,P->flags);
-    free(P);
+    res = call_lua_parms(P);
+    free_call_parms(P);
     return res;
   }
 
@@ -197,6 +415,59 @@ void make_message_window() {
   }
 }
 
+static BOOL s_use_queue = FALSE;
+static Queue s_queue;
+static HANDLE hQueueEvent = NULL;
+static volatile LONG s_waiting = 0;
+
+/// put callbacks on a queue, to be run by `dispatch_events`.
+// @function make_dispatch_queue
+void make_dispatch_queue() {
+  if (! s_use_queue) {
+    queue_init(&s_queue);
+    hQueueEvent = CreateEvent(NULL,FALSE,FALSE,NULL);
+    s_use_queue = TRUE;
+  }
+}
+
+/// are callbacks going through the dispatch queue?
+// @function dispatching
+BOOL dispatching() {
+  return s_use_queue;
+}
+
+/// run callbacks from the dispatch queue.
+// Callbacks are run in the order in which they were queued. This must
+// only be called from the main thread.
+// @param timeout how long to wait in msec; may be `INFINITE`
+// @param whole if TRUE, keep going until the time is up; otherwise return
+// as soon as some callbacks have been run
+// @return the number of callbacks run
+// @function dispatch_events
+int dispatch_events(DWORD timeout, BOOL whole) {
+  DWORD start = GetTickCount(), elapsed;
+  int n = 0;
+  while (1) {
+    LuaCallParms *P;
+    while ((P = (LuaCallParms*)queue_pop(&s_queue)) != NULL) {
+      call_lua_parms(P);
+      free_call_parms(P);
+      ++n;
+    }
+    if (n > 0 && ! whole)
+      break;
+    elapsed = GetTickCount() - start;
+    if (timeout != INFINITE && elapsed >= timeout)
+      break;
+    // producers only signal the event if we say we are waiting for it
+    InterlockedExchange(&s_waiting,1);
+    if (queue_empty(&s_queue))
+      WaitForSingleObject(hQueueEvent,timeout == INFINITE ? INFINITE : timeout - elapsed);
+    InterlockedExchange(&s_waiting,0);
+  }
+  return n;
+}
+
 static HANDLE hMutex = NULL;
 
 void lock_mutex() {
@@ -211,6 +482,27 @@ void release_mutex() {
   ReleaseMutex(hMutex);
 }
 
+// A background thread may make a batch of calls, taking the mutex once for
+// the lot. It is taken by the first call in the batch, if there is one.
+static DWORD s_batch_thread = 0;
+static BOOL s_batch_locked = FALSE;
+
+/// start or finish a batch of calls from this thread.
+// Only one thread may be making a batch at a time.
+// @param begin TRUE to start, FALSE to finish
+// @function batch_lua_calls
+void batch_lua_calls(int begin) {
+  if (begin) {
+    s_batch_thread = GetCurrentThreadId();
+  } else {
+    s_batch_thread = 0;
+    if (s_batch_locked) {
+      s_batch_locked = FALSE;
+      release_mutex();
+    }
+  }
+}
+
 // this is a useful function to call a Lua function within an exclusive
 // mutex lock. There are two parameters:
 //
@@ -220,10 +512,55 @@ void release_mutex() {
 // - the second can be NULL or some text. If NULL, nothing is pushed.
 //
 
+static BOOL post_lua_call(lua_State *L, Ref ref, int idx, LuaPusher push, void *data, const char *text, int len, int flags) {
+  BOOL res;
+  LuaCallParms parms, *P = &parms;
+  // with the mutex, the call happens now, so there's no need to copy anything
+  if (s_use_queue || ! s_use_mutex) {
+    P = (LuaCallParms*)pool_alloc(&s_call_pool);
+    if (text) {
+      size_t n = len >= 0 ? (size_t)len : strlen(text);
+      char *mtext = (char *)arena_alloc(&s_text_arena,n+1);
+      memcpy(mtext,text,n);
+      mtext[n] = '\0';
+      text = mtext;
+    }
+  }
+  P->L = L;
+  P->ref = ref;
+  P->idx = idx;
+  P->text = text;
+  P->len = len;
+  P->flags = flags;
+  P->push = push;
+  P->data = data;
+  if (s_use_queue) {
+    queue_push(&s_queue,&P->node);
+    if (InterlockedExchange(&s_waiting,0))
+      SetEvent(hQueueEvent);
+    res = FALSE;
+  } else if (s_use_mutex && s_batch_thread == GetCurrentThreadId()) {
+    if (! s_batch_locked) {
+      lock_mutex();
+      s_batch_locked = TRUE;
+    }
+    res = call_lua_parms(P);
+  } else if (s_use_mutex) {
+    lock_mutex();
+    res = call_lua_parms(P);
+    release_mutex();
+  } else {
+    PostMessage(hMessageWin,MY_INTERNAL_LUA_MESSAGE,0,(LPARAM)P);
+    res = FALSE; // for now
+  }
+  return res;
+}
+
 /// call a Lua function.
 // This ensures that only one Lua function can be entered at any time, controlled
 // by a mutex. If in 'GUI mode' then the Lua function is furthermore called
-// from the GUI state.
+// from the GUI state. In 'dispatch mode' the call is queued, and the result
+// is always FALSE.
 // @param L the state
 // @param ref a reference to the function
 // @param idx a stack index: if greater than zero, pass value to function
@@ -232,29 +569,34 @@ void release_mutex() {
 // idx as an integer. If REF_IDX treat idx as a stack reference.
 // @function call_lua
 BOOL call_lua(lua_State *L, Ref ref, int idx, const char *text, int flags) {
-  BOOL res;
-  if (text) {
-    size_t len = strlen(text);
-    char *mtext = (char *)malloc(len+1);
-    memcpy(mtext,text,len+1);
-    text = mtext;
-  }
-  if (s_use_mutex) {
-    lock_mutex();
-    res = call_lua_direct(L,ref,idx,text,flags);
-    release_mutex();
-  } else {
-    LuaCallParms *parms = (LuaCallParms*)malloc(sizeof(LuaCallParms));
-    parms->L = L;
-    parms->ref = ref;
-    parms->idx = idx;
-    parms->text = text;
-    parms->flags = flags;
-    PostMessage(hMessageWin,MY_INTERNAL_LUA_MESSAGE,0,(LPARAM)parms);
-    res = FALSE; // for now
-  }
+  return post_lua_call(L,ref,idx,NULL,NULL,text,-1,flags);
+}
 
-  return res;
+/// call a Lua function, passing it some bytes which may include NULs.
+// Otherwise the same as `call_lua`; the bytes are only copied if the call
+// has to be queued.
+// @param L the state
+// @param ref a reference to the function
+// @param text the bytes
+// @param len how many
+// @param flags if DISCARD remove the reference after calling.
+// @function call_lua_len
+BOOL call_lua_len(lua_State *L, Ref ref, const char *text, int len, int flags) {
+  return post_lua_call(L,ref,0,NULL,NULL,text,len,flags);
+}
+
+/// call a Lua function, with the first argument pushed by a function.
+// The push function is called just before the Lua function, on the thread
+// which runs it. So it is safe to create Lua objects there, unlike with `REF_IDX`.
+// @param L the state
+// @param ref a reference to the function
+// @param push a function which pushes the first argument
+// @param data passed to `push`
+// @param text a string: if not NULL, pass this string to the function
+// @param flags if DISCARD remove the reference after calling.
+// @function call_lua_push
+BOOL call_lua_push(lua_State *L, Ref ref, LuaPusher push, void *data, const char *text, int flags) {
+  return post_lua_call(L,ref,0,push,data,text,-1,flags);
 }
 
 static int current_encoding = CP_ACP;
@@ -275,16 +617,27 @@ int get_encoding() {
 }
 
 /// convert text to UTF-16 depending on encoding.
+// If the encoding is `CP_UTF8` we use our own converter (see utf.c),
+// which is a good deal faster than `MultiByteToWideChar`.
 // @param text the input multi-byte text
 // @param wbuf the output wide char text
 // @param bufsz the size of the output buffer.
 // @return a pointer to `wbuf`
 // @function wstring_buff
 LPWSTR wstring_buff(LPCSTR text, LPWSTR wbuf, int bufsz) {
-  int res = MultiByteToWideChar(
-    current_encoding, 0,
-    text,-1,
-    wbuf,bufsz);
+  int res;
+  if (current_encoding == CP_UTF8) {
+    res = utf8_to_utf16(text,strlen(text)+1,(utf16_t*)wbuf,bufsz);
+    if (res == -1) {
+      SetLastError(ERROR_INSUFFICIENT_BUFFER);
+      res = 0;
+    }
+  } else {
+    res = MultiByteToWideChar(
+      current_encoding, 0,
+      text,-1,
+      wbuf,bufsz);
+  }
   if (res != 0) {
     return wbuf;
   } else {
@@ -292,31 +645,199 @@ LPWSTR wstring_buff(LPCSTR text, LPWSTR wbuf, int bufsz) {
   }
 }
 
-/// push a wide string on the Lua stack with given size.
-// This converts to the current encoding first.
+static int mbstring_cp(int cp, LPCWSTR us, int len, char *buf, int bufsz) {
+  if (cp == CP_UTF8) {
+    int res = utf16_to_utf8((const utf16_t*)us,len,buf,bufsz);
+    if (res == -1) {
+      SetLastError(ERROR_INSUFFICIENT_BUFFER);
+      res = 0;
+    }
+    return res;
+  } else {
+    return WideCharToMultiByte(
+      cp, 0,
+      us,len,
+      buf,bufsz,
+      NULL,NULL);
+  }
+}
+
+/// convert a wide string of given size to the current encoding.
+// Like `WideCharToMultiByte`, the result is not NUL-terminated.
+// @param us the wide string
+// @param len size of wide string
+// @param buf the output buffer
+// @param bufsz the size of the output buffer
+// @return number of bytes written, or 0 on error
+// @function mbstring_buff
+int mbstring_buff(LPCWSTR us, int len, char *buf, int bufsz) {
+  return mbstring_cp(current_encoding,us,len,buf,bufsz);
+}
+
+// Scratch buffers for converting text. Each thread has its own set, kept in
+// thread-local storage, so that background threads can convert text without
+// taking the Lua lock. The buffers are kept between calls and only ever grow;
+// conversions size them for the worst case up front, so that the text is
+// converted in one pass.
+typedef struct {
+  void *buf[SCRATCH_MAX];
+  int size[SCRATCH_MAX];
+} Scratch;
+
+static DWORD s_scratch_tls = TLS_OUT_OF_INDEXES;
+
+void setup_scratch() {
+  if (s_scratch_tls == TLS_OUT_OF_INDEXES)
+    s_scratch_tls = TlsAlloc();
+}
+
+/// a per-thread scratch buffer.
+// It is reused by the next call on this thread asking for the same kind of buffer.
+// @param which one of `SCRATCH_TEXT`, `SCRATCH_WIDE` or `SCRATCH_BYTES`
+// @param size the number of bytes needed
+// @return the buffer, or NULL if out of memory
+// @function scratch_buff
+void *scratch_buff(int which, int size) {
+  Scratch *s = (Scratch*)TlsGetValue(s_scratch_tls);
+  if (s == NULL) {
+    s = (Scratch*)calloc(1,sizeof(Scratch));
+    if (s == NULL) return NULL;
+    TlsSetValue(s_scratch_tls,s);
+  }
+  if (size > s->size[which]) {
+    int newsize = s->size[which] ? s->size[which] : 256;
+    void *buf;
+    while (newsize < size)
+      newsize *= 2;
+    buf = realloc(s->buf[which],newsize);
+    if (buf == NULL) return NULL;
+    s->buf[which] = buf;
+    s->size[which] = newsize;
+  }
+  return s->buf[which];
+}
+
+/// free the scratch buffers of this thread.
+// Called when our background threads finish.
+// @function free_scratch
+void free_scratch() {
+  Scratch *s = (Scratch*)TlsGetValue(s_scratch_tls);
+  if (s != NULL) {
+    int i;
+    for (i = 0; i < SCRATCH_MAX; i++)
+      free(s->buf[i]);
+    free(s);
+    TlsSetValue(s_scratch_tls,NULL);
+  }
+}
+
+/// a wide char scratch buffer for converted text.
+// It is reused by the next call to `wide_scratch` or `wstring_l` on this thread.
+// @param len the number of wide chars needed
+// @return the buffer, or NULL if out of memory
+// @function wide_scratch
+LPWSTR wide_scratch(int len) {
+  return (LPWSTR)scratch_buff(SCRATCH_TEXT,len*sizeof(WCHAR));
+}
+
+/// a wide char scratch buffer for text coming back from Windows.
+// This is distinct from the buffer used for converted text, so it can be
+// used together with `wstring_l`.
+// @param len the number of wide chars needed
+// @return the buffer, or NULL if out of memory
+// @function wide_result
+LPWSTR wide_result(int len) {
+  return (LPWSTR)scratch_buff(SCRATCH_WIDE,len*sizeof(WCHAR));
+}
+
+/// convert text of given length and encoding to UTF-16.
+// Unlike `wstring_buff` there is no limit on size; the result lives in
+// a per-thread scratch buffer which is reused by the next call.
+// @param cp the encoding of the text, e.g. `CP_UTF8`
+// @param text the input multi-byte text
+// @param len the size of the text in bytes
+// @param pwlen if not NULL, receives the number of wide chars (not counting the NUL)
+// @return the NUL-terminated wide text, or NULL on error
+// @function wstring_cp
+LPWSTR wstring_cp(int cp, LPCSTR text, int len, int *pwlen) {
+  // a byte never becomes more than one UTF-16 unit
+  LPWSTR wbuf = wide_scratch(len+1);
+  int res = 0;
+  if (wbuf == NULL) {
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return NULL;
+  }
+  if (cp == CP_UTF8) {
+    res = utf8_to_utf16(text,len,(utf16_t*)wbuf,len);
+  } else if (len > 0) {
+    res = MultiByteToWideChar(cp,0,text,len,wbuf,len);
+    if (res == 0)
+      return NULL;
+  }
+  wbuf[res] = 0;
+  if (pwlen)
+    *pwlen = res;
+  return wbuf;
+}
+
+/// convert text of given length to UTF-16 depending on encoding.
+// @param text the input multi-byte text
+// @param len the size of the text in bytes
+// @param pwlen if not NULL, receives the number of wide chars
+// @return the NUL-terminated wide text, or NULL on error
+// @function wstring_l
+LPWSTR wstring_l(LPCSTR text, int len, int *pwlen) {
+  return wstring_cp(current_encoding,text,len,pwlen);
+}
+
+/// push a wide string on the Lua stack with given size and encoding.
 // @param L the State
+// @param cp the encoding wanted, e.g. `CP_UTF8`
 // @param us the wide string
 // @param len size of wide string
 // @return 1; the encoded string or 2, `nil` and the error message
-// @function push_wstring_l
-int push_wstring_l(lua_State *L, LPCWSTR us, int len) {
+// @function push_wstring_cp
+int push_wstring_cp(lua_State *L, int cp, LPCWSTR us, int len) {
+  // three bytes per unit is enough for UTF-8 and the DBCS code pages
   int osz = 3*len;
-  char *obuff = malloc(osz);
-  int res = WideCharToMultiByte(
-    current_encoding, 0,
-    us,len,
-    obuff,osz,
-    NULL,NULL);
+  char *obuff;
+  int res;
+  if (len == 0) {
+    lua_pushliteral(L,"");
+    return 1;
+  }
+  obuff = (char*)scratch_buff(SCRATCH_BYTES,osz);
+  if (obuff == NULL) {
+    return push_error_msg(L,"out of memory");
+  }
+  res = mbstring_cp(cp,us,len,obuff,osz);
+  if (res == 0 && cp != CP_UTF8 && GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+    osz = mbstring_cp(cp,us,len,NULL,0);
+    obuff = (char*)scratch_buff(SCRATCH_BYTES,osz);
+    if (obuff == NULL) {
+      return push_error_msg(L,"out of memory");
+    }
+    res = mbstring_cp(cp,us,len,obuff,osz);
+  }
   if (res == 0) {
-    free(obuff);
     return push_error(L);
   } else {
     lua_pushlstring(L,obuff,res);
-    free(obuff);
     return 1;
   }
 }
 
+/// push a wide string on the Lua stack with given size.
+// This converts to the current encoding first.
+// @param L the State
+// @param us the wide string
+// @param len size of wide string
+// @return 1; the encoded string or 2, `nil` and the error message
+// @function push_wstring_l
+int push_wstring_l(lua_State *L, LPCWSTR us, int len) {
+  return push_wstring_cp(L,current_encoding,us,len);
+}
+
 /// push a wide string on the Lua stack.
 // @param L the state
 // @param us the wide string
@@ -7,7 +7,8 @@ extern int mutex_locked;
 enum {
     INTEGER = 1,
     REF_IDX = 2,
-    DISCARD = 4
+    DISCARD = 4,
+    NO_CALL = 8   // with DISCARD, just release the reference
 };
 
 Ref make_ref(lua_State *L, int idx);
@@ -21,10 +22,28 @@ int push_error_code(lua_State *L, int err);
 int push_ok(lua_State *L);
 int push_bool(lua_State *L, int bval);
 void throw_error(lua_State *L, LPCSTR msg);
+int opt_int_field(lua_State *L, int idx, const char *key, int def);
+BOOL opt_bool_field(lua_State *L, int idx, const char *key, BOOL def);
+typedef void (*LuaPusher)(lua_State *L, void *data);
+
+void setup_tasks(lua_State *L);
+BOOL in_task(lua_State *L);
+lua_State *main_state(lua_State *L);
+BOOL start_task(lua_State *L, int nargs);
+BOOL resume_task(lua_State *co, int nargs);
+
 BOOL call_lua_direct(lua_State *L, Ref ref, int idx, LPCSTR text, int discard);
 void make_message_window();
+void setup_call_pool();
+int push_call_stats(lua_State *L);
+void make_dispatch_queue();
+BOOL dispatching();
+int dispatch_events(DWORD timeout, BOOL whole);
 BOOL call_lua(lua_State *L, Ref ref, int idx, LPCSTR text, int discard);
+BOOL call_lua_len(lua_State *L, Ref ref, LPCSTR text, int len, int discard);
+BOOL call_lua_push(lua_State *L, Ref ref, LuaPusher push, void *data, LPCSTR text, int discard);
 void lock_mutex();
+void batch_lua_calls(int begin);
 void release_mutex();
 void setup_mutex();
 
@@ -33,6 +52,24 @@ void set_encoding(int e);
 int get_encoding();
 
 LPWSTR wstring_buff(LPCSTR text, LPWSTR wbuf, int bufsz);
+int mbstring_buff(LPCWSTR us, int len, char *buf, int bufsz);
+
+// per-thread scratch buffers
+enum {
+  SCRATCH_TEXT,   // text converted to UTF-16
+  SCRATCH_WIDE,   // UTF-16 text from Windows
+  SCRATCH_BYTES,  // text converted from UTF-16
+  SCRATCH_MAX
+};
+
+void setup_scratch();
+void *scratch_buff(int which, int size);
+void free_scratch();
+LPWSTR wide_scratch(int len);
+LPWSTR wide_result(int len);
+LPWSTR wstring_cp(int cp, LPCSTR text, int len, int *pwlen);
+LPWSTR wstring_l(LPCSTR text, int len, int *pwlen);
+int push_wstring_cp(lua_State *L, int cp, LPCWSTR us, int len);
 int push_wstring_l(lua_State *L, LPCWSTR us, int len);
 int push_wstring(lua_State *L, LPCWSTR us);
 